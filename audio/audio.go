@@ -3,6 +3,7 @@ package audio
 import (
 	"log"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/thestk/rtaudio/contrib/go/rtaudio"
@@ -23,10 +24,15 @@ type Audio interface {
 	Devices() []Device
 	Current() Device
 	Open(i, sr, bufSz, inChans, outChans int)
+	// Xruns returns the number of callbacks that followed an output underflow
+	// or an input overflow of the device since it has been created
+	Xruns() (underruns, overruns int)
 	Destroy()
 }
 
 type rt struct {
+	underruns uint64 // First to be aligned for atomic access
+	overruns  uint64
 	sync.Mutex
 	audio     rtaudio.RtAudio
 	cb        Callback
@@ -78,6 +84,10 @@ func (rt *rt) Devices() []Device {
 	return devices
 }
 
+func (rt *rt) Xruns() (underruns, overruns int) {
+	return int(atomic.LoadUint64(&rt.underruns)), int(atomic.LoadUint64(&rt.overruns))
+}
+
 func (rt *rt) Current() Device {
 	devices := rt.Devices()
 	rt.Lock()
@@ -114,8 +124,11 @@ func (rt *rt) Open(id, sampleRate, bufSz int, inChans, outChans int) {
 	err := rt.audio.Open(outParams, inParams, rtaudio.FormatFloat32,
 		uint(sampleRate), uint(bufSz),
 		func(out, in rtaudio.Buffer, dur time.Duration, status rtaudio.StreamStatus) int {
-			if status == rtaudio.StatusOutputUnderflow {
-				return 0
+			if status&rtaudio.StatusOutputUnderflow != 0 {
+				atomic.AddUint64(&rt.underruns, 1)
+			}
+			if status&rtaudio.StatusInputOverflow != 0 {
+				atomic.AddUint64(&rt.overruns, 1)
 			}
 			rt.cb(in.Float32(), out.Float32(), sampleRate, bufSz, inChans, outChans)
 			return 0
@@ -0,0 +1,332 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"math"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/naivesound/glitch/core"
+	"github.com/naivesound/glitch/loader"
+)
+
+type Options struct {
+	Duration   float64
+	SampleRate int
+	Channels   int
+	Bits       int
+	Float      bool
+	Raw        bool
+	BufferSize int
+	Tick       core.TickMode
+	Control    int
+	Threads    int
+	Pipeline   bool
+	Profile    bool
+	State      bool
+	Resume     []byte
+}
+
+var tickModes = map[string]core.TickMode{
+	"hold":   core.TickHold,
+	"linear": core.TickLinear,
+	"off":    core.TickOff,
+}
+
+type Result struct {
+	In      string
+	Out     string
+	Elapsed time.Duration
+	Err     error
+}
+
+func (opts *Options) sampleSize() int {
+	if opts.Float {
+		return 4
+	}
+	return opts.Bits / 8
+}
+
+func (opts *Options) frames() int {
+	return int(opts.Duration * float64(opts.SampleRate))
+}
+
+func writeWavHeader(w io.Writer, opts *Options) error {
+	format := uint16(1) // PCM
+	if opts.Float {
+		format = 3 // IEEE float
+	}
+	channels := uint16(opts.Channels)
+	size := uint32(opts.frames() * opts.Channels * opts.sampleSize())
+	align := channels * uint16(opts.sampleSize())
+	header := []interface{}{
+		[]byte("RIFF"), uint32(36 + size), []byte("WAVE"),
+		[]byte("fmt "), uint32(16), format, channels, uint32(opts.SampleRate),
+		uint32(opts.SampleRate) * uint32(align), align, uint16(8 * opts.sampleSize()),
+		[]byte("data"), size,
+	}
+	for _, v := range header {
+		if err := binary.Write(w, binary.LittleEndian, v); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Render compiles the program and writes the requested number of frames as
+// little-endian PCM, preceded by a WAV header unless raw output is requested.
+// The program continues from a snapshot if one is given to resume. With
+// profiling the cycles spent in each node are written as folded stacks, and
+// the state at the end is saved if requested, both next to the given stem.
+func Render(text string, w io.Writer, stem string, opts *Options) error {
+	g := core.NewGlitch()
+	if g == nil {
+		return errors.New("failed to create glitch")
+	}
+	defer g.Destroy()
+	g.SetTick(opts.Tick)
+	g.SetControl(opts.Control)
+	g.SetThreads(opts.Threads)
+	g.SetPipeline(opts.Pipeline)
+	if err := g.Compile(text); err != nil {
+		return err
+	}
+	if opts.Resume != nil {
+		if err := g.Restore(opts.Resume); err != nil {
+			return err
+		}
+	}
+	if !opts.Raw {
+		if err := writeWavHeader(w, opts); err != nil {
+			return err
+		}
+	}
+
+	n := opts.BufferSize * opts.Channels
+	f32 := make([]float32, n)
+	s16 := make([]int16, n)
+	s32 := make([]int32, n)
+	b := make([]byte, n*opts.sampleSize())
+	for frames := opts.frames(); frames > 0; frames = frames - opts.BufferSize {
+		m := opts.BufferSize
+		if frames < m {
+			m = frames
+		}
+		k := m * opts.Channels
+		switch {
+		case opts.Float:
+			g.Fill(f32, m, opts.Channels)
+			for i, x := range f32[:k] {
+				binary.LittleEndian.PutUint32(b[i*4:], math.Float32bits(x))
+			}
+		case opts.Bits == 16:
+			g.FillInt16(s16, m, opts.Channels)
+			for i, x := range s16[:k] {
+				binary.LittleEndian.PutUint16(b[i*2:], uint16(x))
+			}
+		case opts.Bits == 24:
+			g.FillInt24(b, m, opts.Channels)
+		default:
+			g.FillInt32(s32, m, opts.Channels)
+			for i, x := range s32[:k] {
+				binary.LittleEndian.PutUint32(b[i*4:], uint32(x))
+			}
+		}
+		if _, err := w.Write(b[:k*opts.sampleSize()]); err != nil {
+			return err
+		}
+	}
+	if opts.State {
+		state, err := g.Snapshot()
+		if err != nil {
+			return err
+		}
+		if err := ioutil.WriteFile(stem+".state", state, 0644); err != nil {
+			return err
+		}
+	}
+	if opts.Profile {
+		return g.Profile(stem+".folded", text, false)
+	}
+	return nil
+}
+
+func renderFile(in, out string, opts *Options) (err error) {
+	text, err := ioutil.ReadFile(in)
+	if err != nil {
+		return err
+	}
+	var f io.Writer = os.Stdout
+	if out != "-" {
+		file, err := os.Create(out)
+		if err != nil {
+			return err
+		}
+		defer func() {
+			if cerr := file.Close(); err == nil {
+				err = cerr
+			}
+		}()
+		f = file
+	}
+	w := bufio.NewWriterSize(f, 64*1024)
+	stem := out
+	if out == "-" {
+		stem = in
+	}
+	stem = strings.TrimSuffix(stem, filepath.Ext(stem))
+	if err := Render(string(text), w, stem, opts); err != nil {
+		return err
+	}
+	return w.Flush()
+}
+
+// outputName returns the output path for the input file, dir is either empty
+// (next to the input) or a directory for batch rendering.
+func outputName(in, dir string, opts *Options) string {
+	ext := ".wav"
+	if opts.Raw {
+		ext = ".raw"
+	}
+	name := strings.TrimSuffix(in, filepath.Ext(in)) + ext
+	if dir != "" {
+		name = filepath.Join(dir, filepath.Base(name))
+	}
+	return name
+}
+
+func main() {
+	opts := &Options{}
+	flag.Float64Var(&opts.Duration, "d", 10, "duration in seconds")
+	flag.IntVar(&opts.SampleRate, "r", 44100, "sample rate")
+	flag.IntVar(&opts.Channels, "c", 2, "number of channels")
+	flag.IntVar(&opts.Bits, "b", 16, "sample size in bits: 16, 24 or 32")
+	flag.BoolVar(&opts.Float, "float", false, "write 32-bit float samples")
+	flag.BoolVar(&opts.Raw, "raw", false, "write raw PCM without a WAV header")
+	flag.IntVar(&opts.BufferSize, "buf", 512, "frames rendered per block")
+	out := flag.String("o", "", "output file, - for stdout, or an output directory")
+	jobs := flag.Int("j", runtime.NumCPU(), "number of files rendered in parallel")
+	dir := flag.String("samples", "samples", "samples directory")
+	seed := flag.Uint64("seed", 0, "random seed")
+	flag.IntVar(&opts.Control, "control", 0, "ramp of control-rate arguments in frames, negative to evaluate them every frame")
+	flag.IntVar(&opts.Threads, "threads", 0, "worker threads rendering mix() tracks of each file")
+	flag.BoolVar(&opts.Pipeline, "pipeline", false, "render effect inputs a block ahead on the worker threads instead of mix() tracks")
+	flag.BoolVar(&opts.Profile, "profile", false, "write cycles spent in each expression as folded stacks next to the output, needs CGO_CFLAGS=-DEXPR_PROFILE")
+	flag.BoolVar(&opts.State, "state", false, "save the state at the end next to the output, to continue from it with -resume")
+	resume := flag.String("resume", "", "continue from a state saved with -state by the same program")
+	trace := flag.String("trace", "", "write a Chrome trace of engine activity to the file, for chrome://tracing or ui.perfetto.dev")
+	tick := flag.String("tick", "hold", "evaluation of t-only expressions: hold, linear or off")
+	flag.Usage = func() {
+		fmt.Fprintf(os.Stderr, "Usage: %s [options] file.glitch...\n", os.Args[0])
+		flag.PrintDefaults()
+	}
+	flag.Parse()
+
+	files := flag.Args()
+	if len(files) == 0 {
+		flag.Usage()
+		os.Exit(2)
+	}
+	if opts.Bits != 16 && opts.Bits != 24 && opts.Bits != 32 {
+		log.Fatal("sample size must be 16, 24 or 32 bits")
+	}
+	if opts.Channels < 1 || opts.SampleRate < 1 || opts.BufferSize < 1 || *jobs < 1 {
+		log.Fatal("channels, sample rate, buffer size and jobs must be positive")
+	}
+	if mode, ok := tickModes[*tick]; ok {
+		opts.Tick = mode
+	} else {
+		log.Fatal("tick mode must be hold, linear or off")
+	}
+	if len(files) > 1 && *out == "-" {
+		log.Fatal("only one file can be rendered to stdout")
+	}
+	// An existing directory is the output directory, even for one file
+	batch := len(files) > 1 || *out == ""
+	if st, err := os.Stat(*out); err == nil && st.IsDir() {
+		batch = true
+	}
+	if *resume != "" {
+		if len(files) > 1 {
+			log.Fatal("only one file can be resumed")
+		}
+		state, err := ioutil.ReadFile(*resume)
+		if err != nil {
+			log.Fatal(err)
+		}
+		opts.Resume = state
+	}
+
+	core.Init(opts.SampleRate, *seed)
+	if *trace != "" {
+		core.TraceStart()
+	}
+	samples := loader.New(*dir)
+	samples.Poll()
+	core.Loader = samples
+
+	// Each worker renders one file at a time with its own engine instance
+	queue := make(chan string)
+	results := make(chan Result)
+	wg := &sync.WaitGroup{}
+	for i := 0; i < *jobs; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for in := range queue {
+				r := Result{In: in, Out: *out}
+				if batch {
+					r.Out = outputName(in, *out, opts)
+				}
+				start := time.Now()
+				r.Err = renderFile(r.In, r.Out, opts)
+				r.Elapsed = time.Since(start)
+				results <- r
+			}
+		}()
+	}
+	go func() {
+		for _, in := range files {
+			queue <- in
+		}
+		close(queue)
+		wg.Wait()
+		close(results)
+	}()
+
+	status := 0
+	start := time.Now()
+	for r := range results {
+		if r.Err != nil {
+			log.Printf("%s: %v", r.In, r.Err)
+			status = 1
+			continue
+		}
+		log.Printf("%s -> %s: %.1fs rendered in %.3fs (%.1fx realtime)", r.In, r.Out,
+			opts.Duration, r.Elapsed.Seconds(), opts.Duration/r.Elapsed.Seconds())
+	}
+	if len(files) > 1 {
+		elapsed := time.Since(start).Seconds()
+		log.Printf("%d files: %.1fs rendered in %.3fs (%.1fx realtime)", len(files),
+			opts.Duration*float64(len(files)), elapsed, opts.Duration*float64(len(files))/elapsed)
+	}
+	if *trace != "" {
+		core.TraceStop()
+		if err := core.TraceDump(*trace); err != nil {
+			log.Printf("%s: %v", *trace, err)
+			status = 1
+		}
+	}
+	os.Exit(status)
+}
@@ -9,11 +9,13 @@ import (
 
 	"github.com/naivesound/glitch/audio"
 	"github.com/naivesound/glitch/core"
+	"github.com/naivesound/glitch/loader"
 	"github.com/zserge/webview"
 )
 
 type App struct {
 	glitch  core.Glitch
+	ahead   *core.Ahead
 	audio   audio.Audio
 	midi    audio.MIDI
 	notify  chan struct{}
@@ -21,9 +23,14 @@ type App struct {
 
 	sync func()
 
+	underruns int // Xruns already reported to the instance
+	overruns  int
+	tracing   bool
+
 	*Config
 
 	IsPlaying    bool               `json:"isPlaying"`
+	LoadMeter    core.Load          `json:"load"`
 	Text         string             `json:"text"`
 	Error        error              `json:"error"`
 	AudioDevices []audio.Device     `json:"audioDevices"`
@@ -33,16 +40,31 @@ type App struct {
 func NewApp(config *Config) (app *App, err error) {
 	app = &App{Config: config}
 
-	loader := &sampleLoader{}
-	go loader.poll()
-	core.Loader = loader
+	samples := loader.New("samples")
+	go samples.Poll()
+	core.Loader = samples
 	core.Init(config.SampleRate, uint64(time.Now().UnixNano()))
+	if config.Trace {
+		app.tracing = true
+		core.TraceStart()
+	}
 
 	app.glitch = core.NewGlitch()
+	if config.Record != "" {
+		if err := app.glitch.Record(config.Record); err != nil {
+			log.Println(err)
+		}
+	}
+	if config.Ahead > 0 {
+		app.ahead = core.NewAhead(app.glitch, config.SampleRate*config.Ahead/1000,
+			config.BufferSize, 2)
+	}
 
 	app.notify = make(chan struct{}, 256)
 	if app.midi, err = audio.NewMIDI(app.notify, func(msg []byte) {
-		app.glitch.MIDI(msg)
+		if err := app.glitch.MIDIAt(msg, time.Now()); err != nil {
+			log.Println(err)
+		}
 	}); err != nil {
 		app.Destroy()
 		return nil, err
@@ -50,7 +72,10 @@ func NewApp(config *Config) (app *App, err error) {
 
 	if app.audio, err = audio.NewAudio(app.notify, func(in, out []float32, sr, frames, inChannels, outChannels int) {
 		samples := out
-		if app.IsPlaying {
+		app.xrun()
+		if app.IsPlaying && app.ahead != nil {
+			app.ahead.Read(samples, len(samples)/outChannels, outChannels)
+		} else if app.IsPlaying {
 			app.glitch.Fill(samples, len(samples)/outChannels, outChannels)
 		} else {
 			for i := 0; i < len(samples); i++ {
@@ -88,6 +113,14 @@ func NewApp(config *Config) (app *App, err error) {
 							})
 						}
 					}()
+					go func() {
+						for range time.Tick(500 * time.Millisecond) {
+							app.webview.Dispatch(func() {
+								app.LoadMeter = app.glitch.Load()
+								app.sync()
+							})
+						}
+					}()
 				}
 			} else {
 				log.Println("unhandled external invoke:", data)
@@ -103,6 +136,19 @@ func NewApp(config *Config) (app *App, err error) {
 	return app, nil
 }
 
+// xrun reports underruns of the device and of the render-ahead ring, and
+// overruns of the device, that happened since the last callback
+func (app *App) xrun() {
+	underruns, overruns := app.audio.Xruns()
+	if app.ahead != nil {
+		underruns = underruns + app.ahead.Underruns()
+	}
+	if underruns != app.underruns || overruns != app.overruns {
+		app.glitch.Xrun(underruns-app.underruns, overruns-app.overruns)
+		app.underruns, app.overruns = underruns, overruns
+	}
+}
+
 func (app *App) Run() {
 	app.webview.Run()
 }
@@ -118,6 +164,9 @@ func (app *App) Destroy() {
 	if app.midi != nil {
 		app.midi.Destroy()
 	}
+	if app.ahead != nil {
+		app.ahead.Close()
+	}
 	if app.glitch != nil {
 		app.glitch.Destroy()
 	}
@@ -149,8 +198,25 @@ func (app *App) Load(path string) {
 	app.Config.Save()
 }
 
+// DumpTrace writes the engine activity recorded so far as a Chrome trace,
+// tracing is started on the first call if it was not enabled in the config
+func (app *App) DumpTrace() {
+	if !app.tracing {
+		app.tracing = true
+		core.TraceStart()
+		return
+	}
+	if name := app.webview.Dialog(webview.DialogTypeSave, 0, "Save trace...", ""); name != "" {
+		if err := core.TraceDump(name); err != nil {
+			log.Println(err)
+		}
+	}
+}
+
 func (app *App) SetVar(name string, value float32) {
-	app.glitch.Set(name, value)
+	if err := app.glitch.SetAt(name, value, time.Now()); err != nil {
+		log.Println(err)
+	}
 }
 
 func (app *App) ChangeText(text string) {
@@ -188,10 +254,17 @@ func (app *App) SelectMIDI(name string, connected bool) {
 
 func (app *App) TogglePlayback() {
 	app.IsPlaying = !app.IsPlaying
+	if !app.IsPlaying && app.ahead != nil {
+		app.ahead.Flush()
+	}
 }
 
 func (app *App) Stop() {
 	app.glitch.Reset()
 	app.glitch.Compile(app.Text)
+	app.glitch.ResetLoad()
 	app.IsPlaying = false
+	if app.ahead != nil {
+		app.ahead.Flush()
+	}
 }
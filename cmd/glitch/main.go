@@ -22,6 +22,9 @@ type Config struct {
 	AudioDevice int             `json:"audioDevice"`
 	SampleRate  int             `json:"sampleRate"`
 	BufferSize  int             `json:"bufferSize"`
+	Ahead       int             `json:"ahead"`  // Milliseconds rendered ahead of the device
+	Trace       bool            `json:"trace"`  // Record engine activity from the start
+	Record      string          `json:"record"` // File the session is logged to for glitch_replay
 }
 
 var DefaultConfig = Config{
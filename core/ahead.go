@@ -0,0 +1,158 @@
+package core
+
+import (
+	"runtime"
+	"sync"
+	"sync/atomic"
+)
+
+// Ahead renders an instance on its own locked OS thread into a ring of frames
+// ahead of playback, so that the audio callback only copies from the ring and
+// a slow buffer is absorbed by the frames rendered earlier instead of being
+// heard as a dropout. The ring has one reader and one writer that only share
+// the counts of frames played and rendered. Messages passed to MIDIAt and
+// changes passed to SetAt are delayed by the size of the ring, so that they
+// keep their spacing.
+type Ahead struct {
+	read      uint64 // Frames played, advanced by Read
+	write     uint64 // Frames rendered, advanced by the render thread
+	flush     uint64 // Frames rendered before the last Flush, never played
+	underruns uint64
+	mu        sync.Mutex // Held by the render thread while it fills a block
+	glitch    Glitch
+	ring      []float32
+	frames    int // Size of the ring, a multiple of block
+	block     int
+	channels  int
+	wake      chan struct{}
+	quit      chan struct{}
+	done      chan struct{}
+}
+
+// NewAhead starts rendering g in blocks of the given number of frames, up to
+// the given number of frames ahead of playback
+func NewAhead(g Glitch, frames, block, channels int) *Ahead {
+	if block < 1 {
+		block = 512
+	}
+	if frames < block {
+		frames = block
+	}
+	frames = (frames + block - 1) / block * block
+	a := &Ahead{
+		glitch:   g,
+		ring:     make([]float32, frames*channels),
+		frames:   frames,
+		block:    block,
+		channels: channels,
+		wake:     make(chan struct{}, 1),
+		quit:     make(chan struct{}),
+		done:     make(chan struct{}),
+	}
+	go a.run()
+	return a
+}
+
+// Read copies the next frames into buf, frames that have not been rendered in
+// time are silent
+func (a *Ahead) Read(buf []float32, frames, channels int) {
+	r := a.read
+	f := atomic.LoadUint64(&a.flush)
+	if f > r {
+		r = f
+	}
+	n := int(atomic.LoadUint64(&a.write) - r)
+	if n > frames {
+		n = frames
+	}
+	for i := 0; i < n; i++ {
+		src := int((r+uint64(i))%uint64(a.frames)) * a.channels
+		for j := 0; j < channels; j++ {
+			buf[i*channels+j] = a.ring[src+j%a.channels]
+		}
+	}
+	for i := n * channels; i < frames*channels; i++ {
+		buf[i] = 0
+	}
+	if n < frames && f <= a.read {
+		atomic.AddUint64(&a.underruns, 1)
+	}
+	atomic.StoreUint64(&a.read, r+uint64(n))
+	a.notify()
+}
+
+// Flush drops the frames rendered so far, e.g. when playback is paused or the
+// instance is reset, so that they are not played later
+func (a *Ahead) Flush() {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	atomic.StoreUint64(&a.flush, atomic.LoadUint64(&a.write))
+	a.notify()
+}
+
+// notify wakes the render thread if it waits for free frames
+func (a *Ahead) notify() {
+	select {
+	case a.wake <- struct{}{}:
+	default:
+	}
+}
+
+// Occupancy returns the number of frames rendered and not played yet
+func (a *Ahead) Occupancy() int {
+	return int(atomic.LoadUint64(&a.write) - a.played())
+}
+
+// played returns the number of frames that have been played or dropped
+func (a *Ahead) played() uint64 {
+	r := atomic.LoadUint64(&a.read)
+	if f := atomic.LoadUint64(&a.flush); f > r {
+		return f
+	}
+	return r
+}
+
+// Size returns the number of frames the ring holds
+func (a *Ahead) Size() int {
+	return a.frames
+}
+
+// Underruns returns the number of reads that ran out of rendered frames
+func (a *Ahead) Underruns() int {
+	return int(atomic.LoadUint64(&a.underruns))
+}
+
+// Close stops the render thread, the ring can not be read after that
+func (a *Ahead) Close() {
+	close(a.quit)
+	<-a.done
+}
+
+func (a *Ahead) run() {
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	TraceThread("glitch ahead")
+	defer close(a.done)
+	for {
+		free := a.frames - int(a.write-a.played())
+		if free < a.block {
+			select {
+			case <-a.wake:
+				continue
+			case <-a.quit:
+				return
+			}
+		}
+		select {
+		case <-a.quit:
+			return
+		default:
+		}
+		a.mu.Lock()
+		off := int(a.write%uint64(a.frames)) * a.channels
+		a.glitch.FillAhead(a.ring[off:off+a.block*a.channels], a.block, a.channels,
+			free-a.block)
+		atomic.StoreUint64(&a.write, a.write+uint64(a.block))
+		a.mu.Unlock()
+	}
+}
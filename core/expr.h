@@ -12,6 +12,16 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef EXPR_PROFILE
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define expr_cycles() __rdtsc()
+#else
+#include <time.h>
+#define expr_cycles() ((unsigned long long)clock())
+#endif
+#endif
+
 /*
  * Simple expandable vector implementation
  */
@@ -120,11 +130,24 @@ struct expr {
       void *context;
     } func;
   } param;
+#ifdef EXPR_PROFILE
+  struct {
+    int start, end;            /* Source span, empty if the node is synthetic */
+    unsigned long long cycles; /* Including the evaluation of arguments */
+    unsigned long calls;
+  } prof;
+#endif
 };
 
 #define expr_init()                                                            \
   { .type = (enum expr_type)0 }
 
+#ifdef EXPR_PROFILE
+#define expr_span(e, a, b) ((e)->prof.start = (int)(a), (e)->prof.end = (int)(b))
+#else
+#define expr_span(e, a, b)
+#endif
+
 struct expr_string {
   const char *s;
   int n;
@@ -293,12 +316,21 @@ static int to_int(float x) {
     return 0;
   } else if (isinf(x) != 0) {
     return INT_MAX * isinf(x);
+  } else if (x < (float)INT_MIN || x >= -(float)INT_MIN) {
+    return INT_MIN; /* As x86 converts it, C leaves it undefined */
   } else {
     return (int)x;
   }
 }
 
+/* A profiling build evaluates nodes through a wrapper that counts the calls
+ * and cycles of each node, and costs nothing otherwise */
+#ifdef EXPR_PROFILE
+static float expr_eval(struct expr *e);
+static float expr_eval_node(struct expr *e) {
+#else
 static float expr_eval(struct expr *e) {
+#endif
   float n;
   switch (e->type) {
   case OP_UNARY_MINUS:
@@ -327,10 +359,10 @@ static float expr_eval(struct expr *e) {
            expr_eval(&e->param.op.args.buf[1]);
   case OP_SHL:
     return to_int(expr_eval(&e->param.op.args.buf[0]))
-           << to_int(expr_eval(&e->param.op.args.buf[1]));
+           << (to_int(expr_eval(&e->param.op.args.buf[1])) & 31);
   case OP_SHR:
     return to_int(expr_eval(&e->param.op.args.buf[0])) >>
-           to_int(expr_eval(&e->param.op.args.buf[1]));
+           (to_int(expr_eval(&e->param.op.args.buf[1])) & 31);
   case OP_LT:
     return expr_eval(&e->param.op.args.buf[0]) <
            expr_eval(&e->param.op.args.buf[1]);
@@ -399,6 +431,20 @@ static float expr_eval(struct expr *e) {
   }
 }
 
+#ifdef EXPR_PROFILE
+static float expr_eval(struct expr *e) {
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    e->prof.calls++; /* Too cheap to be timed */
+    return expr_eval_node(e);
+  }
+  unsigned long long start = expr_cycles();
+  float x = expr_eval_node(e);
+  e->prof.cycles = e->prof.cycles + (expr_cycles() - start);
+  e->prof.calls++;
+  return x;
+}
+#endif
+
 #define EXPR_TOP (1 << 0)
 #define EXPR_TOPEN (1 << 1)
 #define EXPR_TCLOSE (1 << 2)
@@ -508,6 +554,7 @@ static int expr_bind(const char *s, size_t len, vec_expr_t *es) {
     struct expr arg = vec_pop(es);
     struct expr unary = expr_init();
     unary.type = op;
+    expr_span(&unary, arg.prof.start, arg.prof.end);
     vec_push(&unary.param.op.args, arg);
     vec_push(es, unary);
   } else {
@@ -521,6 +568,7 @@ static int expr_bind(const char *s, size_t len, vec_expr_t *es) {
     if (op == OP_ASSIGN && a.type != OP_VAR) {
       return -1; /* Bad assignment */
     }
+    expr_span(&binary, a.prof.start, b.prof.end);
     vec_push(&binary.param.op.args, a);
     vec_push(&binary.param.op.args, b);
     vec_push(es, binary);
@@ -555,6 +603,7 @@ static inline void expr_copy(struct expr *dst, struct expr *src) {
   int i;
   struct expr arg;
   dst->type = src->type;
+  expr_span(dst, src->prof.start, src->prof.end);
   if (src->type == OP_FUNC) {
     dst->param.func.f = src->param.func.f;
     vec_foreach(&src->param.func.args, arg, i) {
@@ -585,6 +634,9 @@ static struct expr *expr_create(const char *s, size_t len,
                                 struct expr_func *funcs) {
   float num;
   struct expr_var *v;
+#ifdef EXPR_PROFILE
+  const char *src = s;
+#endif
   const char *id = NULL;
   size_t idn = 0;
 
@@ -664,6 +716,7 @@ static struct expr *expr_create(const char *s, size_t len,
         }
       } else if ((v = expr_var(vars, id, idn)) != NULL) {
         vec_push(&es, expr_varref(v));
+        expr_span(&vec_peek(&es), id - src, id - src + idn);
         paren = EXPR_PAREN_FORBIDDEN;
       }
       id = NULL;
@@ -756,6 +809,7 @@ static struct expr *expr_create(const char *s, size_t len,
               }
               p = &vec_nth(&p->param.op.args, 1);
             }
+            expr_span(&root, str.s - src, tok - src + 1);
             vec_push(&es, root);
             vec_free(&arg.args);
           } else {
@@ -771,6 +825,7 @@ static struct expr *expr_create(const char *s, size_t len,
               }
               bound_func.param.func.context = p;
             }
+            expr_span(&bound_func, str.s - src, tok - src + 1);
             vec_push(&es, bound_func);
           }
         }
@@ -778,6 +833,7 @@ static struct expr *expr_create(const char *s, size_t len,
       paren_next = EXPR_PAREN_FORBIDDEN;
     } else if (!isnan(num = expr_parse_number(tok, n))) {
       vec_push(&es, expr_const(num));
+      expr_span(&vec_peek(&es), tok - src, tok - src + n);
       paren_next = EXPR_PAREN_FORBIDDEN;
     } else if (expr_op(tok, n, -1) != OP_UNKNOWN) {
       enum expr_type op = expr_op(tok, n, -1);
@@ -825,6 +881,7 @@ static struct expr *expr_create(const char *s, size_t len,
 
   if (idn > 0) {
     vec_push(&es, expr_varref(expr_var(vars, id, idn)));
+    expr_span(&vec_peek(&es), id - src, id - src + idn);
   }
 
   while (vec_len(&os) > 0) {
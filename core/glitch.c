@@ -1,6 +1,13 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "expr.h"
 #include "libglitch.h"
@@ -10,18 +17,230 @@
 
 static glitch_loader_fn loader = NULL;
 
+/* Instance being evaluated by this thread, used by built-ins that read the
+ * engine state. Instances may be rendered from different threads. */
+static LIBGLITCH_TLS struct glitch *glitch_current = NULL;
+
 #define PI 3.1415926f
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define MAX_DELAY_TIME 10    /* seconds */
 #define MIN_DELAY_BLOCK 8192 /* smallest delay buffer resize */
 
+#define GLITCH_SCRATCH 2048      /* samples rendered per conversion pass */
+
 #include <math.h>
 #define LOG2(n) (logf(n) / logf(2.f))
 #define POW2(n) (powf(2.f, (n)))
 #define SQRT(n) (sqrt(n))
 #define SIN(n) (sinf((n)*2 * PI))
 
+/* Monotonic time in seconds */
+static double glitch_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Trace: each thread records events into its own ring, claimed on its first
+ * event and released when the thread exits, e.g. as Go starts and stops
+ * threads running cgo calls. Only the owner writes a ring and publishes the
+ * number of events written, so recording takes no locks. The rings are
+ * static, their pages are only touched by threads that trace.
+ */
+#define GLITCH_TRACE_THREADS 64
+#define GLITCH_TRACE_EVENTS 4096 /* Per thread, latest events are kept */
+
+struct glitch_trace_event {
+  double ts;  /* Microseconds since the first glitch_trace_start */
+  double dur; /* Microseconds, complete events only */
+  long arg;
+  char phase; /* B, E, i or X as in the Chrome trace format */
+  char name[23];
+};
+
+struct glitch_trace_ring {
+  unsigned long head;  /* Events written */
+  unsigned long first; /* Events written by earlier owners */
+  int used;
+  char name[24];
+  struct glitch_trace_event events[GLITCH_TRACE_EVENTS];
+};
+
+static struct glitch_trace_ring glitch_trace_rings[GLITCH_TRACE_THREADS];
+static int glitch_trace_nrings = 0; /* Rings ever claimed */
+static int glitch_trace_on = 0;
+static double glitch_trace_t0 = 0;
+static LIBGLITCH_TLS struct glitch_trace_ring *glitch_trace_self = NULL;
+static pthread_key_t glitch_trace_key;
+static pthread_once_t glitch_trace_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit, the events are kept until the ring is claimed again */
+static void glitch_trace_release(void *p) {
+  struct glitch_trace_ring *r = (struct glitch_trace_ring *)p;
+  __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void glitch_trace_key_create() {
+  pthread_key_create(&glitch_trace_key, glitch_trace_release);
+}
+
+static struct glitch_trace_ring *glitch_trace_ring() {
+  if (glitch_trace_self != NULL) {
+    return glitch_trace_self;
+  }
+  pthread_once(&glitch_trace_once, glitch_trace_key_create);
+  for (int i = 0; i < GLITCH_TRACE_THREADS; i++) {
+    struct glitch_trace_ring *r = &glitch_trace_rings[i];
+    int used = 0;
+    if (!__atomic_compare_exchange_n(&r->used, &used, 1, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED)) {
+      continue;
+    }
+    r->name[0] = '\0';
+    __atomic_store_n(&r->first, r->head, __ATOMIC_RELEASE);
+    int n = __atomic_load_n(&glitch_trace_nrings, __ATOMIC_RELAXED);
+    while (n <= i && !__atomic_compare_exchange_n(&glitch_trace_nrings, &n,
+                                                  i + 1, 0, __ATOMIC_ACQ_REL,
+                                                  __ATOMIC_RELAXED)) {
+    }
+    pthread_setspecific(glitch_trace_key, r);
+    glitch_trace_self = r;
+    break;
+  }
+  return glitch_trace_self;
+}
+
+static void glitch_trace_copy(char *dst, const char *src, size_t len) {
+  size_t i = 0;
+  for (; i + 1 < len && src[i] != '\0'; i++) {
+    dst[i] = src[i];
+  }
+  dst[i] = '\0';
+}
+
+static void glitch_trace(char phase, const char *name, long arg, double ts,
+                         double dur) {
+  struct glitch_trace_ring *r;
+  if (!__atomic_load_n(&glitch_trace_on, __ATOMIC_RELAXED) ||
+      (r = glitch_trace_ring()) == NULL) {
+    return;
+  }
+  struct glitch_trace_event *e = &r->events[r->head % GLITCH_TRACE_EVENTS];
+  e->ts = (isnan(ts) ? (glitch_clock() - glitch_trace_t0) * 1e6 : ts);
+  e->dur = dur;
+  e->arg = arg;
+  e->phase = phase;
+  glitch_trace_copy(e->name, name, sizeof(e->name));
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void glitch_trace_start() {
+  if (glitch_trace_t0 == 0) {
+    glitch_trace_t0 = glitch_clock();
+  }
+  __atomic_store_n(&glitch_trace_on, 1, __ATOMIC_RELEASE);
+}
+
+void glitch_trace_stop() {
+  __atomic_store_n(&glitch_trace_on, 0, __ATOMIC_RELEASE);
+}
+
+double glitch_trace_now() { return (glitch_clock() - glitch_trace_t0) * 1e6; }
+
+void glitch_trace_thread(const char *name) {
+  struct glitch_trace_ring *r = glitch_trace_ring();
+  if (r != NULL) {
+    glitch_trace_copy(r->name, name, sizeof(r->name));
+  }
+}
+
+void glitch_trace_begin(const char *name) {
+  glitch_trace('B', name, 0, NAN, 0);
+}
+
+void glitch_trace_end(const char *name) {
+  glitch_trace('E', name, 0, NAN, 0);
+}
+
+void glitch_trace_instant(const char *name, long arg) {
+  glitch_trace('i', name, arg, NAN, 0);
+}
+
+void glitch_trace_complete(const char *name, double ts, double dur) {
+  glitch_trace('X', name, 0, ts, dur);
+}
+
+static void glitch_trace_json(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+int glitch_trace_dump(FILE *out) {
+  struct glitch_trace_event *events = (struct glitch_trace_event *)malloc(
+      GLITCH_TRACE_EVENTS * sizeof(struct glitch_trace_event));
+  int first = 1;
+  if (events == NULL) {
+    return -1;
+  }
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  int n = __atomic_load_n(&glitch_trace_nrings, __ATOMIC_ACQUIRE);
+  for (int tid = 0; tid < MIN(n, GLITCH_TRACE_THREADS); tid++) {
+    struct glitch_trace_ring *r = &glitch_trace_rings[tid];
+    unsigned long owned = __atomic_load_n(&r->first, __ATOMIC_ACQUIRE);
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long base =
+        (head > GLITCH_TRACE_EVENTS ? head - GLITCH_TRACE_EVENTS : 0);
+    for (unsigned long i = base; i < head; i++) {
+      events[i - base] = r->events[i % GLITCH_TRACE_EVENTS];
+    }
+    /* Events overwritten by the owner while copying are dropped, as is the
+     * slot it may be writing, and events of earlier owners of the ring */
+    unsigned long now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = MIN(MAX(base, owned), head);
+    if (now >= GLITCH_TRACE_EVENTS && now - GLITCH_TRACE_EVENTS + 1 > tail) {
+      tail = MIN(now - GLITCH_TRACE_EVENTS + 1, head);
+    }
+    fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": ", (first ? "" : ","), tid);
+    if (r->name[0] != '\0') {
+      glitch_trace_json(out, r->name);
+    } else {
+      fprintf(out, "\"thread %d\"", tid);
+    }
+    fprintf(out, "}}");
+    first = 0;
+    for (unsigned long i = tail; i < head; i++) {
+      struct glitch_trace_event *e = &events[i - base];
+      fprintf(out, ",\n{\"name\": ");
+      glitch_trace_json(out, e->name);
+      fprintf(out, ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d",
+              e->phase, e->ts, tid);
+      if (e->phase == 'X') {
+        fprintf(out, ", \"dur\": %.3f, \"args\": {\"value\": %ld}", e->dur,
+                e->arg);
+      } else if (e->phase == 'i') {
+        fprintf(out, ", \"s\": \"t\", \"args\": {\"value\": %ld}", e->arg);
+      }
+      fprintf(out, "}");
+    }
+  }
+  fprintf(out, "\n]}\n");
+  free(events);
+  return 0;
+}
+
 static float arg(vec_expr_t *args, int n, float defval) {
   if (vec_len(args) < n + 1) {
     return defval;
@@ -88,6 +307,11 @@ struct sample_context {
   float t;
 };
 
+struct poly_context {
+  struct expr *voices[GLITCH_MAX_VOICES]; /* Template copy per voice slot */
+  unsigned long age[GLITCH_MAX_VOICES];   /* Note-on seen by each copy */
+};
+
 static float lib_byte(struct expr_func *f, vec_expr_t *args, void *context) {
   (void)f;
   (void)context;
@@ -102,10 +326,24 @@ static float lib_s(struct expr_func *f, vec_expr_t *args, void *context) {
                                    libglitch_wrap(arg(args, 0, 0)));
 }
 
+/* Seeds a random stream on its first use, streams of an instance are split
+ * from its seed in order of their first use */
+static libglitch_rand_t *glitch_rand(libglitch_rand_t *r) {
+  if (!r->init) {
+    struct glitch *g = glitch_current;
+    if (g != NULL) {
+      libglitch_rand_init(r, g->seed, g->streams++);
+    } else {
+      libglitch_rand_init(r, libglitch_rand_seed, 0);
+    }
+  }
+  return r;
+}
+
 static float lib_r(struct expr_func *f, vec_expr_t *args, void *context) {
   (void)f;
-  (void)context;
-  return libglitch_rand(arg(args, 0, 1));
+  return libglitch_rand(glitch_rand((libglitch_rand_t *)context),
+                        arg(args, 0, 1));
 }
 
 static float lib_l(struct expr_func *f, vec_expr_t *args, void *context) {
@@ -176,6 +414,16 @@ static float lib_hz(struct expr_func *f, vec_expr_t *args, void *context) {
   return libglitch_hz(arg(args, 0, 0));
 }
 
+/* Copies the body for each list of values */
+static void each_init(struct each_context *each, vec_expr_t *args) {
+  each->init = 1;
+  for (int i = 0; i < vec_len(args) - 2; i++) {
+    struct expr tmp = {0};
+    expr_copy(&tmp, &vec_nth(args, 1));
+    vec_push(&each->args, tmp);
+  }
+}
+
 static float lib_each(struct expr_func *f, vec_expr_t *args, void *context) {
   (void)f;
   struct each_context *each = (struct each_context *)context;
@@ -186,12 +434,7 @@ static float lib_each(struct expr_func *f, vec_expr_t *args, void *context) {
   }
 
   if (!each->init) {
-    each->init = 1;
-    for (int i = 0; i < vec_len(args) - 2; i++) {
-      struct expr tmp = {0};
-      expr_copy(&tmp, &vec_nth(args, 1));
-      vec_push(&each->args, tmp);
-    }
+    each_init(each, args);
   }
 
   // List of variables
@@ -234,6 +477,100 @@ static void lib_each_cleanup(struct expr_func *f, void *context) {
   vec_free(&each->args);
 }
 
+static inline int glitch_ctz(uint32_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  for (; (x & 1) == 0; x = x >> 1) {
+    n++;
+  }
+  return n;
+#endif
+}
+
+/* Returns the index of the first active voice at or after i, or -1 */
+static int glitch_voice_next(struct glitch_voices *vs, int i) {
+  while (i < vs->n) {
+    uint32_t w = vs->active[i / 32] >> (i % 32);
+    if (w == 0) {
+      i = (i / 32 + 1) * 32;
+      continue;
+    }
+    i = i + glitch_ctz(w);
+    return (i < vs->n ? i : -1);
+  }
+  return -1;
+}
+
+#define glitch_voice_foreach(vs, i)                                            \
+  for (int i = glitch_voice_next((vs), 0); i >= 0;                             \
+       i = glitch_voice_next((vs), i + 1))
+
+/* Assigns values to the variables from the list, e.g. (key, gate, vel) */
+static void glitch_bind(struct expr *list, float *values, int n) {
+  for (int i = 0; i < n; i++) {
+    struct expr *var = list;
+    if (list->type == OP_COMMA) {
+      var = &vec_nth(&list->param.op.args, 0);
+      list = &vec_nth(&list->param.op.args, 1);
+    }
+    if (var->type == OP_VAR) {
+      *var->param.var.value = values[i];
+    }
+    if (var == list) {
+      break;
+    }
+  }
+}
+
+static void glitch_voice_adopt(struct glitch *g);
+
+static float lib_poly(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct poly_context *poly = (struct poly_context *)context;
+  struct glitch *g = glitch_current;
+  if (g == NULL || vec_len(args) < 2) {
+    return NAN;
+  }
+  struct glitch_voices *vs = &g->voices;
+  struct expr *vars = &vec_nth(args, 0);
+  float mix = 0;
+  glitch_voice_adopt(g);
+  glitch_voice_foreach(vs, i) {
+    struct expr *e = poly->voices[i];
+    if (e == NULL) {
+      e = poly->voices[i] = (struct expr *)calloc(1, sizeof(struct expr));
+      if (e == NULL) {
+        continue;
+      }
+      expr_copy(e, &vec_nth(args, 1));
+    }
+    if (poly->age[i] != vs->age[i]) {
+      /* New note in this slot: reset instruments with a NaN gate */
+      float reset[] = {NAN, NAN, NAN};
+      poly->age[i] = vs->age[i];
+      glitch_bind(vars, reset, 3);
+      expr_eval(e);
+    }
+    float values[] = {vs->key[i], vs->gate[i], vs->vel[i]};
+    glitch_bind(vars, values, 3);
+    float r = expr_eval(e);
+    if (!isnan(r)) {
+      mix = mix + r;
+    }
+  }
+  return mix / SQRT(vs->n);
+}
+
+static void lib_poly_cleanup(struct expr_func *f, void *context) {
+  (void)f;
+  struct poly_context *poly = (struct poly_context *)context;
+  for (int i = 0; i < GLITCH_MAX_VOICES; i++) {
+    expr_destroy(poly->voices[i], NULL);
+  }
+}
+
 static float lib_sin(struct expr_func *f, vec_expr_t *args, void *context) {
   (void)f;
   return libglitch_sin((libglitch_osc_t *)context, arg(args, 0, NAN));
@@ -293,6 +630,36 @@ static float lib_fm(struct expr_func *f, vec_expr_t *args, void *context) {
   return v0;
 }
 
+/* Initialize vector of steps, cache all expression pointers */
+static void seq_init(struct seq_context *seq, vec_expr_t *args) {
+  seq->init = 1;
+  for (int i = 1; i < vec_len(args); i++) {
+    struct expr *e = &vec_nth(args, i);
+    struct expr *dur = NULL;
+    if (e->type == OP_COMMA) {
+      dur = &vec_nth(&e->param.op.args, 0);
+      e = &vec_nth(&e->param.op.args, 1);
+    }
+    struct seq_step step = {.gliss = 0, .e = e, .dur = dur};
+    if (e->type == OP_COMMA) {
+      int gliss = 0;
+      for (struct expr *sube = e; sube->type == OP_COMMA;
+           sube = &vec_nth(&sube->param.op.args, 1)) {
+        gliss++;
+      }
+      while (e->type == OP_COMMA) {
+        step.e = &vec_nth(&e->param.op.args, 0);
+        step.gliss = gliss;
+        vec_push(&seq->steps, step);
+        e = &vec_nth(&e->param.op.args, 1);
+        step.gliss = -1;
+      }
+      step.e = e;
+    }
+    vec_push(&seq->steps, step);
+  }
+}
+
 static float lib_seq(struct expr_func *f, vec_expr_t *args, void *context) {
   struct seq_context *seq = (struct seq_context *)context;
 
@@ -301,34 +668,8 @@ static float lib_seq(struct expr_func *f, vec_expr_t *args, void *context) {
     return NAN;
   }
 
-  /* Initialize vector of steps, cache all expression pointers */
   if (!seq->init) {
-    seq->init = 1;
-    for (int i = 1; i < vec_len(args); i++) {
-      struct expr *e = &vec_nth(args, i);
-      struct expr *dur = NULL;
-      if (e->type == OP_COMMA) {
-        dur = &vec_nth(&e->param.op.args, 0);
-        e = &vec_nth(&e->param.op.args, 1);
-      }
-      struct seq_step step = {.gliss = 0, .e = e, .dur = dur};
-      if (e->type == OP_COMMA) {
-        int gliss = 0;
-        for (struct expr *sube = e; sube->type == OP_COMMA;
-             sube = &vec_nth(&sube->param.op.args, 1)) {
-          gliss++;
-        }
-        while (e->type == OP_COMMA) {
-          step.e = &vec_nth(&e->param.op.args, 0);
-          step.gliss = gliss;
-          vec_push(&seq->steps, step);
-          e = &vec_nth(&e->param.op.args, 1);
-          step.gliss = -1;
-        }
-        step.e = e;
-      }
-      vec_push(&seq->steps, step);
-    }
+    seq_init(seq, args);
   }
 
   /* A function can be either "seq" or "loop" */
@@ -489,6 +830,26 @@ static void lib_mix_cleanup(struct expr_func *f, void *context) {
   vec_free(&mix->values);
 }
 
+static float lib_out(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  (void)context;
+  /* Multichannel output evaluated as a single signal is a channel average */
+  float v = 0;
+  for (int i = 0; i < vec_len(args); i++) {
+    v = v + expr_eval(&vec_nth(args, i));
+  }
+  return (vec_len(args) > 0 ? v / vec_len(args) : 0);
+}
+
+static float lib_pan(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  (void)context;
+  /* Panned signal evaluated as a single signal is the signal itself */
+  float v = arg(args, 0, NAN);
+  (void)arg(args, 1, 0);
+  return v;
+}
+
 static float lib_filter(struct expr_func *f, vec_expr_t *args, void *context) {
   libglitch_biquad_t *biquad = (libglitch_biquad_t *)context;
   libglitch_biquad_filter_t type = -1;
@@ -590,6 +951,7 @@ static float lib_pluck(struct expr_func *f, vec_expr_t *args, void *context) {
   float freq = arg(args, 0, NAN);
   float decay = arg(args, 1, 0.5);
   if (vec_len(args) < 3) {
+    glitch_rand(&pluck->rng);
     return libglitch_pluck(pluck, freq, decay, NULL, NULL);
   } else {
     return libglitch_pluck(pluck, freq, decay, (float (*)(void *))expr_eval,
@@ -604,17 +966,18 @@ static void lib_pluck_cleanup(struct expr_func *f, void *context) {
 }
 
 #define MAX_FUNCS 1024
-#define FIRST_USER_FUNC 24
+#define FIRST_USER_FUNC 27
 static struct expr_func glitch_funcs[MAX_FUNCS + 1] = {
     {"byte", lib_byte, NULL, 0},
     {"s", lib_s, NULL, 0},
-    {"r", lib_r, NULL, 0},
+    {"r", lib_r, NULL, sizeof(libglitch_rand_t)},
     {"l", lib_l, NULL, 0},
     {"a", lib_a, NULL, 0},
     {"scale", lib_scale, NULL, 0},
     {"hz", lib_hz, NULL, 0},
 
     {"each", lib_each, lib_each_cleanup, sizeof(struct each_context)},
+    {"poly", lib_poly, lib_poly_cleanup, sizeof(struct poly_context)},
 
     {"sin", lib_sin, NULL, sizeof(libglitch_osc_t)},
     {"tri", lib_tri, NULL, sizeof(libglitch_osc_t)},
@@ -637,126 +1000,3113 @@ static struct expr_func glitch_funcs[MAX_FUNCS + 1] = {
     {"bsf", lib_filter, NULL, sizeof(libglitch_biquad_t)},
 
     {"delay", lib_delay, lib_delay_cleanup, sizeof(libglitch_delay_t)},
+
+    {"out", lib_out, NULL, 0},
+    {"pan", lib_pan, NULL, 0},
     {NULL, NULL, NULL, 0},
 };
 
-struct glitch *glitch_create() {
-  struct glitch *g = calloc(1, sizeof(struct glitch));
-  return g;
-}
+/*
+ * Integer kernel: a subtree built from integer constants, t and integer
+ * operators computes the same value in float and in int arithmetic as long
+ * as every intermediate value stays below 2^24. Inside tick wrappers such
+ * subtrees are compiled into a flat program and evaluated for a block of
+ * consecutive ticks at once, one plain loop per operator so that the
+ * compiler can vectorize it. Blocks where the bounds of the values can't be
+ * proven run the same program lane by lane in float arithmetic.
+ */
+#define GLITCH_INT_OPS 32
+#define GLITCH_INT_BLOCK 64
+#define GLITCH_INT_MAX (1LL << 24)
 
-void glitch_init(int sample_rate, unsigned long long seed) {
-  libglitch_init(sample_rate, seed);
-}
+struct int_op {
+  enum expr_type type; /* OP_CONST loads value, OP_VAR loads t */
+  int a, b;            /* Registers of the operands */
+  int value;
+};
 
-void glitch_set_sample_loader(glitch_loader_fn fn) { loader = fn; }
+struct int_context {
+  int init;
+  int nops; /* Zero if the subtree can't be compiled */
+  struct int_op ops[GLITCH_INT_OPS];
+  float t0; /* t of the first value in the block */
+  int len;  /* Number of values in the block */
+  float block[GLITCH_INT_BLOCK];
+};
 
-int glitch_add_sample(const char *name) {
-  for (int i = FIRST_USER_FUNC; i < MAX_FUNCS; i++) {
-    if (glitch_funcs[i].name == NULL || strlen(glitch_funcs[i].name) == 0) {
-      const char *s = calloc(1, strlen(name) + 1);
-      strcpy((char *)s, name);
-      glitch_funcs[i].name = s;
-      glitch_funcs[i].f = lib_sample;
-      glitch_funcs[i].ctxsz = sizeof(struct sample_context);
-      glitch_funcs[i + 1].name = NULL;
-      return 0;
+static int glitch_int_trunc(enum expr_type type) {
+  return type == OP_UNARY_BITWISE_NOT || type == OP_SHL || type == OP_SHR ||
+         type == OP_BITWISE_AND || type == OP_BITWISE_OR ||
+         type == OP_BITWISE_XOR;
+}
+
+/* Compiles an integer-valued subtree, returns the register of its value or -1.
+ * Division is integer-valued only if the parent truncates the result. */
+static int glitch_int_compile(struct glitch *g, struct expr *e,
+                              struct int_op *ops, int *n, int trunc) {
+  struct int_op op = {e->type, 0, 0, 0};
+  if (e->type == OP_CONST) {
+    float v = e->param.num.value;
+    if (!(v > -GLITCH_INT_MAX && v < GLITCH_INT_MAX) || v != (int)v) {
+      return -1;
     }
-    if (strcmp(glitch_funcs[i].name, name) == 0) {
+    op.value = (int)v;
+  } else if (e->type == OP_VAR) {
+    if (e->param.var.value != &g->t->value) {
+      return -1;
+    }
+  } else {
+    switch (e->type) {
+    case OP_DIVIDE:
+      if (!trunc) {
+        return -1;
+      }
+      break;
+    case OP_UNARY_MINUS:
+    case OP_UNARY_LOGICAL_NOT:
+    case OP_UNARY_BITWISE_NOT:
+    case OP_MULTIPLY:
+    case OP_REMAINDER:
+    case OP_PLUS:
+    case OP_MINUS:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_XOR:
+      break;
+    default:
       return -1;
     }
+    vec_expr_t *args = &e->param.op.args;
+    int argtrunc = glitch_int_trunc(e->type);
+    op.a = glitch_int_compile(g, &vec_nth(args, 0), ops, n, argtrunc);
+    if (op.a < 0) {
+      return -1;
+    }
+    if (vec_len(args) > 1) {
+      op.b = glitch_int_compile(g, &vec_nth(args, 1), ops, n, argtrunc);
+      if (op.b < 0) {
+        return -1;
+      }
+    }
   }
-  return -1;
+  if (*n == GLITCH_INT_OPS) {
+    return -1;
+  }
+  ops[*n] = op;
+  return (*n)++;
 }
 
-int glitch_remove_sample(const char *name) {
-  for (int i = FIRST_USER_FUNC; i < MAX_FUNCS; i++) {
-    if (glitch_funcs[i].name == NULL) {
+/* Computes the range [lo, hi] of an operator on operands in the ranges of a
+ * and b. Returns zero unless it is proven to stay below 2^24. */
+static int glitch_int_range(enum expr_type type, long long alo, long long ahi,
+                            long long blo, long long bhi, long long *lo,
+                            long long *hi) {
+  long long c[4], m;
+  switch (type) {
+  case OP_UNARY_MINUS:
+    *lo = -ahi;
+    *hi = -alo;
+    break;
+  case OP_UNARY_BITWISE_NOT:
+    *lo = -ahi - 1;
+    *hi = -alo - 1;
+    break;
+  case OP_PLUS:
+    *lo = alo + blo;
+    *hi = ahi + bhi;
+    break;
+  case OP_MINUS:
+    *lo = alo - bhi;
+    *hi = ahi - blo;
+    break;
+  case OP_SHL:
+  case OP_SHR:
+    if (blo < 0 || bhi > 31) {
+      return 0;
+    }
+    /* Shifts are monotonic in both operands for a fixed sign of a */
+    c[0] = (type == OP_SHL ? alo * (1LL << blo) : alo >> blo);
+    c[1] = (type == OP_SHL ? alo * (1LL << bhi) : alo >> bhi);
+    c[2] = (type == OP_SHL ? ahi * (1LL << blo) : ahi >> blo);
+    c[3] = (type == OP_SHL ? ahi * (1LL << bhi) : ahi >> bhi);
+    goto corners;
+  case OP_MULTIPLY:
+    c[0] = alo * blo;
+    c[1] = alo * bhi;
+    c[2] = ahi * blo;
+    c[3] = ahi * bhi;
+  corners:
+    *lo = MIN(MIN(c[0], c[1]), MIN(c[2], c[3]));
+    *hi = MAX(MAX(c[0], c[1]), MAX(c[2], c[3]));
+    break;
+  case OP_DIVIDE:
+  case OP_REMAINDER:
+    if (blo <= 0 && bhi >= 0) {
+      return 0;
+    }
+    m = MAX(MAX(-alo, ahi), 0);
+    if (type == OP_DIVIDE) {
+      *lo = -m;
+      *hi = m;
       break;
     }
-    if (strcmp(glitch_funcs[i].name, name) == 0) {
-      free((void *)(glitch_funcs[i].name));
-      glitch_funcs[i].name = "";
+    /* The remainder has the sign of the dividend */
+    m = MIN(m, MAX(-blo, bhi) - 1);
+    *lo = (alo < 0 ? -m : 0);
+    *hi = (ahi > 0 ? m : 0);
+    break;
+  case OP_BITWISE_AND:
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    /* Two's complement values below 2^n give results below 2^n */
+    m = 1;
+    while (m <= MAX(MAX(-alo, ahi), MAX(-blo, bhi))) {
+      m = m * 2;
+    }
+    *lo = (alo < 0 || blo < 0 ? -m : 0);
+    *hi = m - 1;
+    if (type == OP_BITWISE_AND) {
+      /* Masking with a non-negative value keeps it in its range */
+      *lo = (alo < 0 && blo < 0 ? -m : 0);
+      *hi = (alo >= 0 ? (blo >= 0 ? MIN(ahi, bhi) : ahi)
+                      : (blo >= 0 ? bhi : m - 1));
     }
+    break;
+  default:
+    *lo = 0;
+    *hi = 1;
+    break;
   }
-  return -1;
+  return *lo > -GLITCH_INT_MAX && *hi < GLITCH_INT_MAX;
 }
 
-void glitch_destroy(struct glitch *g) {
-  expr_destroy(g->e, &g->vars);
-  free(g);
+/* Proves that all values in the block starting at t0 stay below 2^24 */
+static int glitch_int_bounds(struct int_context *ic, long long t0) {
+  long long lo[GLITCH_INT_OPS] = {0}, hi[GLITCH_INT_OPS] = {0};
+  for (int k = 0; k < ic->nops; k++) {
+    struct int_op *op = &ic->ops[k];
+    if (op->type == OP_CONST) {
+      lo[k] = hi[k] = op->value;
+    } else if (op->type == OP_VAR) {
+      lo[k] = t0;
+      hi[k] = t0 + GLITCH_INT_BLOCK - 1;
+    } else if (!glitch_int_range(op->type, lo[op->a], hi[op->a], lo[op->b],
+                                 hi[op->b], &lo[k], &hi[k])) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
-void glitch_set(struct glitch *g, const char *name, float x) {
-  expr_var(&g->vars, name, strlen(name))->value = x;
+/* Evaluates the block in int arithmetic, values are known to be in range */
+static void glitch_int_run(struct int_context *ic, int t0) {
+  int r[GLITCH_INT_OPS][GLITCH_INT_BLOCK];
+  for (int k = 0; k < ic->nops; k++) {
+    struct int_op *op = &ic->ops[k];
+    int *x = r[k], *a = r[op->a], *b = r[op->b];
+    int i;
+#define INT_LOOP(expr)                                                         \
+  for (i = 0; i < GLITCH_INT_BLOCK; i++) {                                     \
+    x[i] = (expr);                                                             \
+  }                                                                            \
+  break
+    switch (op->type) {
+    case OP_CONST: INT_LOOP(op->value);
+    case OP_VAR: INT_LOOP(t0 + i);
+    case OP_UNARY_MINUS: INT_LOOP(-a[i]);
+    case OP_UNARY_LOGICAL_NOT: INT_LOOP(!a[i]);
+    case OP_UNARY_BITWISE_NOT: INT_LOOP(~a[i]);
+    case OP_MULTIPLY: INT_LOOP(a[i] * b[i]);
+    case OP_DIVIDE: INT_LOOP(a[i] / b[i]);
+    case OP_REMAINDER: INT_LOOP(a[i] % b[i]);
+    case OP_PLUS: INT_LOOP(a[i] + b[i]);
+    case OP_MINUS: INT_LOOP(a[i] - b[i]);
+    case OP_SHL: INT_LOOP((int)((unsigned)a[i] << b[i]));
+    case OP_SHR: INT_LOOP(a[i] >> b[i]);
+    case OP_LT: INT_LOOP(a[i] < b[i]);
+    case OP_LE: INT_LOOP(a[i] <= b[i]);
+    case OP_GT: INT_LOOP(a[i] > b[i]);
+    case OP_GE: INT_LOOP(a[i] >= b[i]);
+    case OP_EQ: INT_LOOP(a[i] == b[i]);
+    case OP_NE: INT_LOOP(a[i] != b[i]);
+    case OP_BITWISE_AND: INT_LOOP(a[i] & b[i]);
+    case OP_BITWISE_OR: INT_LOOP(a[i] | b[i]);
+    case OP_BITWISE_XOR: INT_LOOP(a[i] ^ b[i]);
+    default: INT_LOOP(0);
+    }
+#undef INT_LOOP
+  }
+  for (int i = 0; i < GLITCH_INT_BLOCK; i++) {
+    ic->block[i] = (float)r[ic->nops - 1][i];
+  }
 }
 
-float glitch_get(struct glitch *g, const char *name) {
-  return expr_var(&g->vars, name, strlen(name))->value;
+/* Evaluates the block in float arithmetic the same way expr_eval() does */
+static void glitch_int_run_float(struct int_context *ic, int t0) {
+  float r[GLITCH_INT_OPS][GLITCH_INT_BLOCK];
+  for (int k = 0; k < ic->nops; k++) {
+    struct int_op *op = &ic->ops[k];
+    float *x = r[k], *a = r[op->a], *b = r[op->b];
+    int i;
+#define FLOAT_LOOP(expr)                                                       \
+  for (i = 0; i < GLITCH_INT_BLOCK; i++) {                                     \
+    x[i] = (expr);                                                             \
+  }                                                                            \
+  break
+    switch (op->type) {
+    case OP_CONST: FLOAT_LOOP((float)op->value);
+    case OP_VAR: FLOAT_LOOP((float)(t0 + i));
+    case OP_UNARY_MINUS: FLOAT_LOOP(-a[i]);
+    case OP_UNARY_LOGICAL_NOT: FLOAT_LOOP(!a[i]);
+    case OP_UNARY_BITWISE_NOT: FLOAT_LOOP(~to_int(a[i]));
+    case OP_MULTIPLY: FLOAT_LOOP(a[i] * b[i]);
+    case OP_DIVIDE: FLOAT_LOOP(a[i] / b[i]);
+    case OP_REMAINDER: FLOAT_LOOP(fmodf(a[i], b[i]));
+    case OP_PLUS: FLOAT_LOOP(a[i] + b[i]);
+    case OP_MINUS: FLOAT_LOOP(a[i] - b[i]);
+    case OP_SHL: FLOAT_LOOP(to_int(a[i]) << (to_int(b[i]) & 31));
+    case OP_SHR: FLOAT_LOOP(to_int(a[i]) >> (to_int(b[i]) & 31));
+    case OP_LT: FLOAT_LOOP(a[i] < b[i]);
+    case OP_LE: FLOAT_LOOP(a[i] <= b[i]);
+    case OP_GT: FLOAT_LOOP(a[i] > b[i]);
+    case OP_GE: FLOAT_LOOP(a[i] >= b[i]);
+    case OP_EQ: FLOAT_LOOP(a[i] == b[i]);
+    case OP_NE: FLOAT_LOOP(a[i] != b[i]);
+    case OP_BITWISE_AND: FLOAT_LOOP(to_int(a[i]) & to_int(b[i]));
+    case OP_BITWISE_OR: FLOAT_LOOP(to_int(a[i]) | to_int(b[i]));
+    case OP_BITWISE_XOR: FLOAT_LOOP(to_int(a[i]) ^ to_int(b[i]));
+    default: FLOAT_LOOP(NAN);
+    }
+#undef FLOAT_LOOP
+  }
+  memcpy(ic->block, r[ic->nops - 1], sizeof(ic->block));
 }
 
-void glitch_midi(struct glitch *g, unsigned char cmd, unsigned char a,
-                 unsigned char b) {
-  cmd = cmd >> 4;
-  if (cmd == 0x9 && b > 0) {
-    // Note pressed: insert to the head of the "list"
-    for (int i = 0; i < MAX_POLYPHONY; i++) {
-      if (isnan(g->k[i]->value)) {
-        g->k[i]->value = a - 69;
-        g->g[i]->value = b / 128.0;
-        g->v[i]->value = b / 128.0;
-        break;
-      }
-    }
-  } else if ((cmd == 0x9 && b == 0) || cmd == 0x8) {
-    // Note released: remove from the "list" and shift the rest
-    float key = a - 69;
-    for (int i = 0; i < MAX_POLYPHONY; i++) {
-      if (g->k[i]->value == key) {
-        g->g[i]->value = NAN;
-        break;
-      }
+static float lib_int(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct int_context *ic = (struct int_context *)context;
+  struct glitch *g = glitch_current;
+  struct expr *e = &vec_nth(args, 0);
+  if (g == NULL || g->tick == GLITCH_TICK_OFF) {
+    return expr_eval(e);
+  }
+  if (!ic->init) {
+    /* The wrapper is only placed where truncation of the result is safe */
+    ic->init = 1;
+    if (glitch_int_compile(g, e, ic->ops, &ic->nops, 1) < 0) {
+      ic->nops = 0;
     }
-  } else if (cmd == 0xe) {
-    // Pitch bend wheel
-    g->x->value = (b - 64.f) / 65.f;
-  } else if (cmd == 0xb && a == 1) {
-    // Control change message: mod wheel
-    g->y->value = (b - 64.f) / 65.f;
+  }
+  float t = g->t->value;
+  float i = t - ic->t0;
+  if (i >= 0 && i < ic->len && i == (int)i) {
+    return ic->block[(int)i];
+  }
+  /* Ticks past 2^24 are no longer exact integers in float */
+  if (ic->nops == 0 || !(t >= 0 && t < GLITCH_INT_MAX - GLITCH_INT_BLOCK) ||
+      t != (int)t) {
+    ic->len = 0;
+    return expr_eval(e);
+  }
+  if (glitch_int_bounds(ic, (long long)t)) {
+    glitch_int_run(ic, (int)t);
   } else {
-    fprintf(stderr, "MIDI command %d %d %d\n", cmd, a, b);
+    glitch_int_run_float(ic, (int)t);
   }
+  ic->t0 = t;
+  ic->len = GLITCH_INT_BLOCK;
+  return ic->block[0];
 }
 
-void glitch_reset(struct glitch *g) {
-  g->t = expr_var(&g->vars, "t", 1);
-  g->x = expr_var(&g->vars, "x", 1);
-  g->y = expr_var(&g->vars, "y", 1);
-  g->bpm = expr_var(&g->vars, "bpm", 3);
+static struct expr_func glitch_int_func = {"", lib_int, NULL,
+                                           sizeof(struct int_context)};
 
-  g->t->value = g->x->value = g->y->value = g->bpm->value = 0;
+/* Returns the subtree of an integer kernel wrapper */
+static struct expr *glitch_int_unwrap(struct expr *e) {
+  if (e->type == OP_FUNC && e->param.func.f == &glitch_int_func) {
+    return &vec_nth(&e->param.func.args, 0);
+  }
+  return e;
+}
 
-  for (int i = 0; i < MAX_POLYPHONY; i++) {
-    char name[4];
-    snprintf(name, sizeof(name), "k%d", i);
-    g->k[i] = expr_var(&g->vars, name, strlen(name));
-    snprintf(name, sizeof(name), "v%d", i);
-    g->v[i] = expr_var(&g->vars, name, strlen(name));
-    snprintf(name, sizeof(name), "g%d", i);
-    g->g[i] = expr_var(&g->vars, name, strlen(name));
-    g->k[i]->value = g->v[i]->value = g->g[i]->value = NAN;
+/* Wraps maximal integer subtrees that read t and do at least one operation */
+static void glitch_int_wrap(struct glitch *g, struct expr *e, int trunc) {
+  struct int_op ops[GLITCH_INT_OPS];
+  int n = 0;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  }
+  if (glitch_int_compile(g, e, ops, &n, trunc) >= 0) {
+    int t = 0;
+    for (int i = 0; i < n; i++) {
+      t = t || (ops[i].type == OP_VAR);
+    }
+    if (t) {
+      struct expr w = expr_init();
+      w.type = OP_FUNC;
+      w.param.func.f = &glitch_int_func;
+      w.param.func.context = calloc(1, sizeof(struct int_context));
+      if (w.param.func.context == NULL ||
+          vec_push(&w.param.func.args, *e) != 0) {
+        free(w.param.func.context);
+        return;
+      }
+      *e = w;
+    }
+    return;
+  }
+  vec_expr_t *args =
+      (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  int argtrunc = (e->type != OP_FUNC && glitch_int_trunc(e->type));
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_int_wrap(g, &vec_nth(args, i), argtrunc);
   }
+}
 
-  /* Note constants */
-  const struct {
-    char *name;
-    int pitch;
-  } notes[] = {
-      {"C0", -9},  {"C#0", -8}, {"Cb0", -10}, {"D0", -7},  {"D#0", -6},
-      {"Db0", -8}, {"E0", -5},  {"E#0", -4},  {"Eb0", -6}, {"F0", -4},
-      {"F#0", -3}, {"Fb0", -5}, {"G0", -2},   {"G#0", -1}, {"Gb0", -3},
-      {"A0", 0},   {"A#0", 1},  {"Ab0", -1},  {"B0", 2},   {"B#0", 3},
-      {"Bb0", 1},
+/*
+ * Tick-rate evaluation: t advances at 8 kHz, so a side-effect free subtree
+ * of pure functions that reads t changes only when t or another variable it
+ * reads does. Such subtrees are wrapped at compile time and evaluated once
+ * per change, in between the value is held or interpolated between ticks.
+ */
+#define GLITCH_PURE_VARS 16
+
+struct tick_context {
+  int init;
+  int nvars;
+  float *vars[GLITCH_PURE_VARS];
+  float values[GLITCH_PURE_VARS];
+  float t;     /* t of the last evaluation */
+  float value;
+  float prev;  /* Value at the previous tick */
+};
+
+/* Collects variables of a pure subtree, returns the number of operators in
+ * it, or -1 if it has state or side effects or reads too many variables */
+static int glitch_pure_collect(struct expr *e, float **vars, int *n) {
+  vec_expr_t *args;
+  int ops = 1;
+  if (e->type == OP_CONST) {
+    return 0;
+  } else if (e->type == OP_VAR) {
+    for (int i = 0; i < *n; i++) {
+      if (vars[i] == e->param.var.value) {
+        return 0;
+      }
+    }
+    if (*n == GLITCH_PURE_VARS) {
+      return -1;
+    }
+    vars[(*n)++] = e->param.var.value;
+    return 0;
+  } else if (e->type == OP_ASSIGN) {
+    return -1;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    if ((f->ctxsz > 0 && f != &glitch_int_func) || f->cleanup != NULL ||
+        f->f == lib_out || f->f == lib_pan) {
+      return -1;
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    int k = glitch_pure_collect(&vec_nth(args, i), vars, n);
+    if (k < 0) {
+      return -1;
+    }
+    ops = ops + k;
+  }
+  return ops;
+}
+
+static float lib_tick(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct tick_context *tc = (struct tick_context *)context;
+  struct glitch *g = glitch_current;
+  struct expr *e = &vec_nth(args, 0);
+  if (g == NULL || g->tick == GLITCH_TICK_OFF) {
+    return expr_eval(e);
+  }
+  int first = !tc->init;
+  int same = !first;
+  if (first) {
+    tc->init = 1;
+    glitch_pure_collect(e, tc->vars, &tc->nvars);
+  }
+  for (int i = 0; i < tc->nvars && same; i++) {
+    same = (memcmp(tc->vars[i], &tc->values[i], sizeof(float)) == 0);
+  }
+  if (!same) {
+    float v = expr_eval(e);
+    if (first) {
+      tc->prev = v;
+    } else if (tc->t != g->t->value) {
+      tc->prev = tc->value;
+    }
+    tc->value = v;
+    tc->t = g->t->value;
+    for (int i = 0; i < tc->nvars; i++) {
+      tc->values[i] = *tc->vars[i];
+    }
+  }
+  if (g->tick == GLITCH_TICK_LINEAR && !isnan(tc->prev)) {
+    /* Position of the frame between the last tick and the next one */
+    float x = (float)((double)(g->frame - 1) * 8000 / libglitch_sample_rate -
+                      tc->t);
+    if (x >= 0 && x < 1) {
+      return tc->prev + (tc->value - tc->prev) * x;
+    }
+  }
+  return tc->value;
+}
+
+static struct expr_func glitch_tick_func = {"", lib_tick, NULL,
+                                            sizeof(struct tick_context)};
+
+/* Wraps maximal pure subtrees that read t and do more than one operation,
+ * tuples are left intact */
+static void glitch_tick_wrap(struct glitch *g, struct expr *e) {
+  vec_expr_t *args;
+  float *vars[GLITCH_PURE_VARS];
+  int n = 0;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  }
+  int ops = (e->type == OP_COMMA ? -1 : glitch_pure_collect(e, vars, &n));
+  if (ops >= 0) {
+    int t = 0;
+    for (int i = 0; i < n; i++) {
+      t = t || (vars[i] == &g->t->value);
+    }
+    if (t && ops > 1) {
+      struct expr w = expr_init();
+      w.type = OP_FUNC;
+      w.param.func.f = &glitch_tick_func;
+      w.param.func.context = calloc(1, sizeof(struct tick_context));
+      if (w.param.func.context == NULL ||
+          vec_push(&w.param.func.args, *e) != 0) {
+        free(w.param.func.context);
+        return;
+      }
+      glitch_int_wrap(g, &vec_nth(&w.param.func.args, 0), 0);
+      *e = w;
+    }
+    return;
+  }
+  args = (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_tick_wrap(g, &vec_nth(args, i));
+  }
+}
+
+/* Returns t as set after rendering the frame */
+static inline float glitch_time(long frame) {
+  return (float)((long long)frame * 8000 / libglitch_sample_rate);
+}
+
+/*
+ * Render cache: a program that reads t only through integer arithmetic with
+ * bounded bit width, reads variables it never assigns and drives sequencers
+ * of constant tempo and step durations repeats itself with a period that is
+ * proven at compile time. One period is rendered as usual and recorded, the
+ * following periods are played from the buffer. The analysis treats t and
+ * bitwise operators as exact integers, which float arithmetic only is below
+ * 2^24, so the period is only played up to the t where every value it
+ * reasons about is bounded by that. Recording starts over when the sample
+ * rate or a variable the program reads changes.
+ */
+#define GLITCH_CACHE_MAX (1L << 21)  /* longest cached period, in frames */
+#define GLITCH_CACHE_TMAX (1L << 24) /* longest period in t */
+#define GLITCH_CACHE_VARS 32
+#define GLITCH_CACHE_SEQS 16
+
+struct glitch_cache {
+  struct expr *e;
+  int sample_rate; /* Zero forces the recording to start over */
+  enum glitch_tick tick;
+  int nvars;
+  int nseqs;
+  float *vars[GLITCH_CACHE_VARS];
+  float values[GLITCH_CACHE_VARS]; /* Variable values of the recording */
+  struct seq_context *seqs[GLITCH_CACHE_SEQS];
+  long tperiod; /* Period in t, zero if none could be proven */
+  long tmax;    /* Largest t the period holds for */
+  long period;  /* Period in frames, zero until known */
+  long start;   /* Frame of the first recorded sample */
+  long len;     /* Recorded samples */
+  long cap;
+  float *buf;
+};
+
+static long glitch_lcm(long a, long b, long max) {
+  if (a <= 0 || b <= 0) {
+    return 0;
+  }
+  long x = a, y = b;
+  while (y != 0) {
+    long r = x % y;
+    x = y;
+    y = r;
+  }
+  long long m = (long long)(a / x) * b;
+  return (m <= max ? (long)m : 0);
+}
+
+/* Returns non-zero if e always evaluates to an integer */
+static int glitch_integral(struct expr *e) {
+  e = glitch_int_unwrap(e);
+  vec_expr_t *args = &e->param.op.args;
+  switch (e->type) {
+  case OP_CONST:
+    return floorf(e->param.num.value) == e->param.num.value;
+  case OP_VAR:
+    return floorf(*e->param.var.value) == *e->param.var.value;
+  case OP_UNARY_MINUS:
+    return glitch_integral(&vec_nth(args, 0));
+  case OP_PLUS:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+  case OP_REMAINDER:
+  case OP_LOGICAL_OR:
+    return glitch_integral(&vec_nth(args, 0)) &&
+           glitch_integral(&vec_nth(args, 1));
+  case OP_LOGICAL_AND:
+  case OP_COMMA:
+    return glitch_integral(&vec_nth(args, 1));
+  case OP_UNARY_LOGICAL_NOT:
+  case OP_UNARY_BITWISE_NOT:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+  case OP_BITWISE_AND:
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Returns non-zero if e never evaluates to a negative number */
+static int glitch_nonneg(struct expr *e) {
+  e = glitch_int_unwrap(e);
+  vec_expr_t *args = &e->param.op.args;
+  switch (e->type) {
+  case OP_CONST:
+    return e->param.num.value >= 0;
+  case OP_VAR:
+    return *e->param.var.value >= 0;
+  case OP_PLUS:
+  case OP_MULTIPLY:
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    return glitch_nonneg(&vec_nth(args, 0)) && glitch_nonneg(&vec_nth(args, 1));
+  case OP_BITWISE_AND:
+    return glitch_nonneg(&vec_nth(args, 0)) || glitch_nonneg(&vec_nth(args, 1));
+  case OP_REMAINDER:
+  case OP_SHR:
+    return glitch_nonneg(&vec_nth(args, 0));
+  case OP_LOGICAL_AND:
+    return glitch_nonneg(&vec_nth(args, 1));
+  case OP_UNARY_LOGICAL_NOT:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Returns the largest integer value of e if it is known to be non-negative
+ * and bounded, or -1 */
+static long glitch_bound(struct expr *e) {
+  e = glitch_int_unwrap(e);
+  vec_expr_t *args = &e->param.op.args;
+  long a, b;
+  switch (e->type) {
+  case OP_CONST:
+    if (e->param.num.value >= 0 && e->param.num.value < INT_MAX &&
+        glitch_integral(e)) {
+      return (long)e->param.num.value;
+    }
+    return -1;
+  case OP_BITWISE_AND:
+    a = glitch_bound(&vec_nth(args, 0));
+    b = glitch_bound(&vec_nth(args, 1));
+    return (a < 0 ? b : (b < 0 ? a : MIN(a, b)));
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    a = glitch_bound(&vec_nth(args, 0));
+    b = glitch_bound(&vec_nth(args, 1));
+    if (a < 0 || b < 0) {
+      return -1;
+    }
+    for (a = a | b; (a & (a + 1)) != 0; a = a | (a >> 1)) {
+    }
+    return a;
+  case OP_SHR:
+    return glitch_bound(&vec_nth(args, 0));
+  case OP_REMAINDER:
+    b = glitch_bound(&vec_nth(args, 1));
+    if (b > 0 && glitch_integral(&vec_nth(args, 0)) &&
+        glitch_nonneg(&vec_nth(args, 0))) {
+      return b - 1;
+    }
+    return -1;
+  case OP_UNARY_LOGICAL_NOT:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+static int glitch_bits(long x) {
+  int n = 0;
+  for (; x > 0; x = x >> 1) {
+    n++;
+  }
+  return n;
+}
+
+/* Computes the range of an integer operator subtree for t up to tmax and
+ * other variables at their current values. Returns zero unless it is proven
+ * to stay below 2^24, where float arithmetic is exact. */
+static int glitch_cache_range(struct glitch *g, struct expr *e, long tmax,
+                              long long *lo, long long *hi) {
+  while (e->type == OP_FUNC && (e->param.func.f == &glitch_tick_func ||
+                                e->param.func.f == &glitch_int_func)) {
+    e = &vec_nth(&e->param.func.args, 0);
+  }
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    float v = (e->type == OP_CONST ? e->param.num.value : *e->param.var.value);
+    if (e->type == OP_VAR && e->param.var.value == &g->t->value) {
+      *lo = 0;
+      *hi = tmax;
+      return 1;
+    } else if (v > -GLITCH_INT_MAX && v < GLITCH_INT_MAX && v == (int)v) {
+      *lo = *hi = (long long)v;
+      return 1;
+    }
+    return 0;
+  }
+  switch (e->type) {
+  case OP_UNARY_MINUS:
+  case OP_UNARY_LOGICAL_NOT:
+  case OP_UNARY_BITWISE_NOT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_REMAINDER:
+  case OP_PLUS:
+  case OP_MINUS:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+  case OP_BITWISE_AND:
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    break;
+  default:
+    return 0;
+  }
+  vec_expr_t *args = &e->param.op.args;
+  long long alo, ahi, blo = 0, bhi = 0;
+  if (!glitch_cache_range(g, &vec_nth(args, 0), tmax, &alo, &ahi) ||
+      (vec_len(args) > 1 &&
+       !glitch_cache_range(g, &vec_nth(args, 1), tmax, &blo, &bhi))) {
+    return 0;
+  }
+  return glitch_int_range(e->type, alo, ahi, blo, bhi, lo, hi);
+}
+
+static long glitch_period(struct glitch *g, struct glitch_cache *c,
+                          struct expr *e, int bits, int cond);
+
+/* Period of an operand converted to int, which truncates non-integers */
+static long glitch_period_int(struct glitch *g, struct glitch_cache *c,
+                              struct expr *e, int bits, int cond) {
+  e = glitch_int_unwrap(e);
+  if (e->type == OP_DIVIDE && bits < 32) {
+    /* Truncated division by a power of two is a right shift */
+    struct expr *x = &vec_nth(&e->param.op.args, 0);
+    struct expr *y = &vec_nth(&e->param.op.args, 1);
+    long k = glitch_bound(y);
+    if (k > 0 && (k & (k - 1)) == 0 && glitch_integral(x) && glitch_nonneg(x)) {
+      return glitch_period(g, c, x, MIN(32, bits + glitch_bits(k - 1)), cond);
+    }
+  }
+  return glitch_period(g, c, e, glitch_integral(e) ? bits : 64, cond);
+}
+
+/* Sequencer steps may depend on t, tempo and durations must be constant.
+ * Steps are evaluated at the start of the loop (seq) or only while they
+ * play (loop), so sequencers nested in steps are not periodic. */
+static long glitch_period_seq(struct glitch *g, struct glitch_cache *c,
+                              struct expr *e, int cond) {
+  vec_expr_t *args = &e->param.func.args;
+  struct expr *bpm = &vec_nth(args, 0);
+  if (cond || vec_len(args) < 2) {
+    return 0;
+  }
+  if ((bpm->type == OP_COMMA &&
+       glitch_period(g, c, &vec_nth(&bpm->param.op.args, 0), 64, 1) != 1) ||
+      glitch_period(g, c, bpm, 64, 1) != 1) {
+    return 0;
+  }
+  long q = 1;
+  for (int i = 1; i < vec_len(args) && q > 0; i++) {
+    struct expr *step = &vec_nth(args, i);
+    if (step->type == OP_COMMA) {
+      if (glitch_period(g, c, &vec_nth(&step->param.op.args, 0), 64, 1) != 1) {
+        return 0;
+      }
+      step = &vec_nth(&step->param.op.args, 1);
+    }
+    for (; step->type == OP_COMMA; step = &vec_nth(&step->param.op.args, 1)) {
+      q = glitch_lcm(q, glitch_period(g, c, &vec_nth(&step->param.op.args, 0),
+                                      64, 1),
+                     GLITCH_CACHE_TMAX);
+    }
+    q = glitch_lcm(q, glitch_period(g, c, step, 64, 1), GLITCH_CACHE_TMAX);
+  }
+  int i = 0;
+  while (i < c->nseqs && c->seqs[i] != e->param.func.context) {
+    i++;
+  }
+  if (i == GLITCH_CACHE_SEQS) {
+    return 0;
+  }
+  c->seqs[i] = (struct seq_context *)e->param.func.context;
+  c->nseqs = (i == c->nseqs ? i + 1 : c->nseqs);
+  return q;
+}
+
+static long glitch_period_func(struct glitch *g, struct glitch_cache *c,
+                               struct expr *e, int cond) {
+  exprfn_t f = e->param.func.f->f;
+  vec_expr_t *args = &e->param.func.args;
+  if (f == lib_byte) {
+    /* Only the lowest 8 bits of the argument select the value */
+    return (vec_len(args) > 0
+                ? glitch_period_int(g, c, &vec_nth(args, 0), 8, cond)
+                : 1);
+  } else if (f == lib_seq) {
+    return glitch_period_seq(g, c, e, cond);
+  } else if (f == lib_s || f == lib_l || f == lib_a || f == lib_scale ||
+             f == lib_hz) {
+    long q = 1;
+    for (int i = 0; i < vec_len(args); i++) {
+      int argcond = cond || (f == lib_a && i > 0);
+      q = glitch_lcm(q, glitch_period(g, c, &vec_nth(args, i), 64, argcond),
+                     GLITCH_CACHE_TMAX);
+    }
+    return q;
+  }
+  return 0;
+}
+
+/* Returns the period in t of the value of e modulo 2^bits, or of its exact
+ * value if bits is 64, or zero if no period can be proven. Variables and
+ * sequencers the program depends on are collected into the cache. */
+static long glitch_period(struct glitch *g, struct glitch_cache *c,
+                          struct expr *e, int bits, int cond) {
+  if (e->type == OP_CONST) {
+    return 1;
+  } else if (e->type == OP_VAR) {
+    float *v = e->param.var.value;
+    if (v == &g->t->value) {
+      return (bits < 24 ? 1L << bits : 0);
+    }
+    int i = 0;
+    while (i < c->nvars && c->vars[i] != v) {
+      i++;
+    }
+    if (i == GLITCH_CACHE_VARS) {
+      return 0;
+    }
+    c->vars[i] = v;
+    c->nvars = (i == c->nvars ? i + 1 : c->nvars);
+    return 1;
+  } else if (e->type == OP_FUNC && (e->param.func.f == &glitch_tick_func ||
+                                     e->param.func.f == &glitch_int_func)) {
+    return glitch_period(g, c, &vec_nth(&e->param.func.args, 0), bits, cond);
+  } else if (e->type == OP_FUNC) {
+    long q = glitch_period_func(g, c, e, cond);
+    return (bits >= 64 || q == 1 ? q : 0);
+  } else if (bits < 64 && !glitch_integral(e)) {
+    /* Low bits of a fraction are meaningless unless it is constant */
+    return (glitch_period(g, c, e, 64, cond) == 1 ? 1 : 0);
+  }
+
+  vec_expr_t *args = &e->param.op.args;
+  struct expr *a = &vec_nth(args, 0);
+  struct expr *b = (vec_len(args) > 1 ? &vec_nth(args, 1) : NULL);
+  int w = MIN(bits, 32); /* Bits of an int result that matter */
+  long long lo, hi;
+  long k;
+  if (bits > 0 && bits < 64 && e->type != OP_COMMA &&
+      !glitch_cache_range(g, e, c->tmax, &lo, &hi)) {
+    /* Low bits are only periodic while the value is exact */
+    return 0;
+  }
+  switch (e->type) {
+  case OP_UNARY_MINUS:
+    return glitch_period(g, c, a, bits, cond);
+  case OP_UNARY_LOGICAL_NOT:
+    return glitch_period(g, c, a, 64, cond);
+  case OP_UNARY_BITWISE_NOT:
+    return glitch_period_int(g, c, a, w, cond);
+  case OP_PLUS:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+    return glitch_lcm(glitch_period(g, c, a, bits, cond),
+                      glitch_period(g, c, b, bits, cond), GLITCH_CACHE_TMAX);
+  case OP_REMAINDER:
+    if (b->type == OP_CONST && b->param.num.value >= 1 &&
+        b->param.num.value <= GLITCH_CACHE_TMAX && glitch_integral(b) &&
+        glitch_integral(a) && glitch_nonneg(a)) {
+      k = (long)b->param.num.value;
+      if ((k & (k - 1)) == 0) {
+        return glitch_period(g, c, a, MIN(bits, glitch_bits(k - 1)), cond);
+      } else if (a->type == OP_VAR && a->param.var.value == &g->t->value) {
+        return k;
+      }
+    }
+    return glitch_lcm(glitch_period(g, c, a, 64, cond),
+                      glitch_period(g, c, b, 64, cond), GLITCH_CACHE_TMAX);
+  case OP_SHL:
+    if (b->type == OP_CONST && glitch_integral(b) && b->param.num.value >= 0 &&
+        b->param.num.value < 32) {
+      k = (long)b->param.num.value;
+      return glitch_period_int(g, c, a, (w > k ? w - k : 0), cond);
+    }
+    return glitch_lcm(glitch_period_int(g, c, a, w, cond),
+                      glitch_period(g, c, b, 64, cond), GLITCH_CACHE_TMAX);
+  case OP_SHR:
+    /* Bits shifted in from above are needed unless the result is exact */
+    k = glitch_bound(b);
+    k = (k < 0 || bits >= 64 ? 32 : MIN(32, w + k));
+    return glitch_lcm(glitch_period_int(g, c, a, (int)k, cond),
+                      glitch_period(g, c, b, 64, cond), GLITCH_CACHE_TMAX);
+  case OP_BITWISE_AND:
+    k = glitch_bound(e);
+    if (k >= 0) {
+      w = MIN(w, glitch_bits(k));
+    }
+    return glitch_lcm(glitch_period_int(g, c, a, w, cond),
+                      glitch_period_int(g, c, b, w, cond), GLITCH_CACHE_TMAX);
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    return glitch_lcm(glitch_period_int(g, c, a, w, cond),
+                      glitch_period_int(g, c, b, w, cond), GLITCH_CACHE_TMAX);
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE:
+    return glitch_lcm(glitch_period(g, c, a, 64, cond),
+                      glitch_period(g, c, b, 64, cond), GLITCH_CACHE_TMAX);
+  case OP_POWER:
+  case OP_DIVIDE:
+    return glitch_lcm(glitch_period(g, c, a, 64, cond),
+                      glitch_period(g, c, b, 64, cond), GLITCH_CACHE_TMAX);
+  case OP_LOGICAL_AND:
+  case OP_LOGICAL_OR:
+    return glitch_lcm(glitch_period(g, c, a, 64, cond),
+                      glitch_period(g, c, b, bits, 1), GLITCH_CACHE_TMAX);
+  case OP_COMMA:
+    return glitch_lcm(glitch_period(g, c, a, 0, cond),
+                      glitch_period(g, c, b, bits, cond), GLITCH_CACHE_TMAX);
+  default:
+    return 0;
+  }
+}
+
+static void glitch_cache_destroy(struct glitch_cache *c) {
+  if (c != NULL) {
+    free(c->buf);
+    free(c);
+  }
+}
+
+/* Returns the period in t and sets tmax to the largest t it is proven for,
+ * proofs only fail more often as the ranges of values grow with tmax */
+static long glitch_cache_prove(struct glitch *g, struct glitch_cache *c) {
+  long lo = 0, hi = GLITCH_INT_MAX - 1;
+  c->tmax = hi;
+  long q = glitch_period(g, c, c->e, 64, 0);
+  if (q != 0) {
+    return q;
+  }
+  c->tmax = lo;
+  if (glitch_period(g, c, c->e, 64, 0) == 0) {
+    return 0;
+  }
+  while (hi - lo > 1) {
+    c->tmax = lo + (hi - lo) / 2;
+    if (glitch_period(g, c, c->e, 64, 0) != 0) {
+      lo = c->tmax;
+    } else {
+      hi = c->tmax;
+    }
+  }
+  c->tmax = lo;
+  return glitch_period(g, c, c->e, 64, 0);
+}
+
+/* Returns the render cache for a program, or NULL if it is not periodic */
+static struct glitch_cache *glitch_cache_create(struct glitch *g,
+                                                struct expr *e) {
+  struct glitch_cache *c = calloc(1, sizeof(struct glitch_cache));
+  if (c != NULL) {
+    c->e = e;
+    if (glitch_cache_prove(g, c) == 0) {
+      glitch_cache_destroy(c);
+      return NULL;
+    }
+  }
+  return c;
+}
+
+/* Drops the recording, a new one starts once running sequencers have looped
+ * with the current variables */
+static void glitch_cache_restart(struct glitch *g, struct glitch_cache *c) {
+  c->sample_rate = libglitch_sample_rate;
+  c->tick = g->tick;
+  for (int i = 0; i < c->nvars; i++) {
+    c->values[i] = *c->vars[i];
+  }
+  c->tperiod = glitch_cache_prove(g, c);
+  /* The first frame is rendered before t is ever updated */
+  c->start = MAX(g->frame, 1);
+  for (int i = 0; i < c->nseqs; i++) {
+    c->start = MAX(c->start, g->frame + c->seqs[i]->duration);
+  }
+  c->period = c->len = 0;
+}
+
+/* Returns the period in frames: t repeats after a whole number of t periods
+ * and every sequencer after a whole number of loops */
+static long glitch_cache_period(struct glitch_cache *c) {
+  long long n = (long long)c->tperiod * libglitch_sample_rate;
+  long long x = n, y = 8000;
+  while (y != 0) {
+    long long r = x % y;
+    x = y;
+    y = r;
+  }
+  long p = (n / x <= GLITCH_CACHE_MAX ? (long)(n / x) : 0);
+  for (int i = 0; i < c->nseqs; i++) {
+    if (!c->seqs[i]->init) {
+      return 0;
+    }
+    p = glitch_lcm(p, c->seqs[i]->duration, GLITCH_CACHE_MAX);
+  }
+  return p;
+}
+
+/* Plays a segment from the cache once a whole period has been recorded.
+ * Returns zero if the segment has to be rendered. */
+static int glitch_cache_play(struct glitch *g, float *buf, size_t frames,
+                             size_t channels) {
+  struct glitch_cache *c = g->cache;
+  if (c == NULL) {
+    return 0;
+  }
+  int changed = (c->sample_rate != libglitch_sample_rate || c->tick != g->tick);
+  for (int i = 0; i < c->nvars && !changed; i++) {
+    changed = (*c->vars[i] != c->values[i]);
+  }
+  if (changed) {
+    glitch_cache_restart(g, c);
+  }
+  if (c->tperiod == 0) {
+    return 0;
+  }
+  if (c->period == 0) {
+    long p = (g->frame >= c->start ? glitch_cache_period(c) : 0);
+    if (p > c->cap) {
+      float *buf = realloc(c->buf, p * sizeof(float));
+      if (buf == NULL) {
+        return 0;
+      }
+      c->buf = buf;
+      c->cap = p;
+    }
+    if (p > 0) {
+      c->period = p;
+      c->start = g->frame;
+    }
+    return 0;
+  }
+  if (c->len < c->period || glitch_time(g->frame + frames) > c->tmax) {
+    return 0;
+  }
+  long i = (g->frame - c->start) % c->period;
+  for (size_t n = 0; n < frames; n++) {
+    float v = c->buf[i];
+    if (!isnan(v)) {
+      g->last_sample = v;
+    }
+    for (size_t j = 0; j < channels; j++) {
+      *buf++ = g->last_sample;
+    }
+    i = (i + 1 < c->period ? i + 1 : 0);
+  }
+  g->frame = g->frame + frames;
+  g->t->value = glitch_time(g->frame - 1);
+  /* Sequencers keep time to resume rendering when the cache is dropped, the
+   * next step is looked up from the first one */
+  for (int k = 0; k < c->nseqs; k++) {
+    struct seq_context *seq = c->seqs[k];
+    seq->t = (seq->t + frames) % seq->duration;
+    seq->step = 0;
+  }
+  return 1;
+}
+
+/* Makes g the instance rendered by the current thread */
+static inline void glitch_enter(struct glitch *g) {
+  glitch_current = g;
+  libglitch_sample_rate =
+      (g->sample_rate > 0 ? g->sample_rate : libglitch_default_sample_rate);
+}
+
+/*
+ * Parallel mix: with worker threads enabled, arguments of the final top-level
+ * mix() that share no assigned variables are rendered as tracks, a block
+ * ahead, on the worker pool of the instance, and mix() reads the rendered
+ * blocks. Top-level statements needed by one track only are moved into it.
+ * Statements needed by several tracks stay in place as feeds: they are
+ * evaluated for the whole block before the tracks, and each track pulls the
+ * recorded values into private copies of the variables at the position of
+ * the statement. Each track has its own t and a shadow instance, so that
+ * built-ins reading the engine state see the frame the track is rendering.
+ */
+#define GLITCH_BRANCHES 32      /* max tracks of a mix, at most 255 */
+#define GLITCH_BRANCH_BLOCK 256 /* frames rendered per dispatch */
+#define GLITCH_BRANCH_STMTS 64  /* top-level statements analysed */
+#define GLITCH_BRANCH_VARS 64   /* variables read or written by a unit */
+#define GLITCH_FEED_VARS 4      /* variables recorded per feed */
+
+struct branch_context {
+  int warm;                  /* Evaluated once in serial order */
+  struct glitch *shadow;     /* Engine state seen by the track */
+  struct expr_var_list vars; /* Private t and copies of shared variables */
+  unsigned long streams;     /* Random streams seeded by workers */
+  long start;                /* First frame of the rendered block */
+  size_t len;
+  float buf[GLITCH_BRANCH_BLOCK];
+};
+
+struct feed_context {
+  int nvars;
+  float *vars[GLITCH_FEED_VARS];
+  float current[GLITCH_FEED_VARS]; /* Values of the last evaluation */
+  long start;                      /* First frame of the recorded block */
+  size_t len;
+  float record[GLITCH_FEED_VARS][GLITCH_BRANCH_BLOCK];
+};
+
+struct pull_context {
+  struct feed_context *feed;
+};
+
+/* Copies the settings of g into a shadow instance before rendering */
+static void glitch_branch_sync(struct glitch *g, struct glitch *s) {
+  s->sample_rate = g->sample_rate;
+  s->tick = g->tick;
+  s->control = g->control;
+  s->seed = g->seed;
+}
+
+/* Serves a frame from the rendered block, or evaluates the track in place */
+static float lib_branch(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct branch_context *bc = (struct branch_context *)context;
+  struct glitch *g = glitch_current;
+  struct glitch *s = bc->shadow;
+  struct expr *e = &vec_nth(args, 0);
+  if (g == NULL || s == NULL) {
+    return expr_eval(e);
+  }
+  long i = g->frame - bc->start;
+  if (i >= 0 && i < (long)bc->len) {
+    return bc->buf[i];
+  }
+  glitch_branch_sync(g, s);
+  s->frame = g->frame;
+  s->t->value = g->t->value;
+  s->streams = g->streams;
+  glitch_current = s;
+  float v = expr_eval(e);
+  glitch_current = g;
+  g->streams = s->streams;
+  bc->warm = 1;
+  return v;
+}
+
+static void lib_branch_cleanup(struct expr_func *f, void *context) {
+  (void)f;
+  struct branch_context *bc = (struct branch_context *)context;
+  free(bc->shadow);
+  expr_destroy(NULL, &bc->vars);
+}
+
+/* Replays a frame of the recorded block, or evaluates the statement */
+static float lib_feed(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct feed_context *fc = (struct feed_context *)context;
+  struct glitch *g = glitch_current;
+  long i = (g != NULL ? g->frame - fc->start : -1);
+  if (i >= 0 && i < (long)fc->len) {
+    for (int j = 0; j < fc->nvars; j++) {
+      *fc->vars[j] = fc->current[j] = fc->record[j][i];
+    }
+    return 0;
+  }
+  float r = expr_eval(&vec_nth(args, 0));
+  for (int j = 0; j < fc->nvars; j++) {
+    fc->current[j] = *fc->vars[j];
+  }
+  return r;
+}
+
+/* Copies values of a feed into the variables given as arguments */
+static float lib_pull(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct feed_context *fc = ((struct pull_context *)context)->feed;
+  struct glitch *g = glitch_current;
+  long i = (g != NULL ? g->frame - fc->start : -1);
+  for (int j = 0; j < vec_len(args) && j < fc->nvars; j++) {
+    *vec_nth(args, j).param.var.value =
+        (i >= 0 && i < (long)fc->len ? fc->record[j][i] : fc->current[j]);
+  }
+  return 0;
+}
+
+static struct expr_func glitch_branch_func = {"", lib_branch,
+                                              lib_branch_cleanup,
+                                              sizeof(struct branch_context)};
+static struct expr_func glitch_feed_func = {"", lib_feed, NULL,
+                                            sizeof(struct feed_context)};
+static struct expr_func glitch_pull_func = {"", lib_pull, NULL,
+                                            sizeof(struct pull_context)};
+
+/* Renders n frames of a track starting at the given frame of g */
+static void glitch_branch_render(struct glitch *g, struct expr *w, long frame,
+                                 size_t n) {
+  struct branch_context *bc = (struct branch_context *)w->param.func.context;
+  struct glitch *s = bc->shadow;
+  struct expr *e = &vec_nth(&w->param.func.args, 0);
+  glitch_branch_sync(g, s);
+  s->streams = bc->streams;
+  glitch_enter(s);
+  for (size_t i = 0; i < n; i++) {
+    s->frame = frame + i;
+    s->t->value = (i == 0 ? g->t->value : glitch_time(frame + i - 1));
+    bc->buf[i] = expr_eval(e);
+  }
+  bc->streams = s->streams;
+  bc->start = frame;
+  bc->len = n;
+}
+
+/* Records n frames of the feeds of g, leaving the variables they assign as
+ * they were */
+static void glitch_feed_render(struct glitch *g, struct expr **feeds,
+                               int nfeeds, size_t n) {
+  long frame = g->frame;
+  float t = g->t->value;
+  float saved[GLITCH_BRANCH_STMTS][GLITCH_FEED_VARS];
+  for (int k = 0; k < nfeeds; k++) {
+    struct feed_context *fc = (struct feed_context *)feeds[k]->param.func.context;
+    for (int j = 0; j < fc->nvars; j++) {
+      saved[k][j] = *fc->vars[j];
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    g->frame = frame + i;
+    g->t->value = (i == 0 ? t : glitch_time(frame + i - 1));
+    for (int k = 0; k < nfeeds; k++) {
+      struct feed_context *fc =
+          (struct feed_context *)feeds[k]->param.func.context;
+      expr_eval(&vec_nth(&feeds[k]->param.func.args, 0));
+      for (int j = 0; j < fc->nvars; j++) {
+        fc->record[j][i] = *fc->vars[j];
+      }
+    }
+  }
+  g->frame = frame;
+  g->t->value = t;
+  for (int k = 0; k < nfeeds; k++) {
+    struct feed_context *fc = (struct feed_context *)feeds[k]->param.func.context;
+    for (int j = 0; j < fc->nvars; j++) {
+      *fc->vars[j] = saved[k][j];
+    }
+    fc->start = frame;
+    fc->len = n;
+  }
+}
+
+/* Variables read and written by a top-level statement or a track */
+struct branch_deps {
+  float *reads[GLITCH_BRANCH_VARS]; /* Read before assigned */
+  float *writes[GLITCH_BRANCH_VARS];
+  float *defs[GLITCH_BRANCH_VARS]; /* Always assigned before read */
+  int nreads;
+  int nwrites;
+  int ndefs;
+  int shared; /* Uses engine state that is not per track */
+  int random; /* Draws random numbers */
+};
+
+static void glitch_deps_add(struct branch_deps *d, float **vars, int *n,
+                            float *v) {
+  for (int i = 0; i < *n; i++) {
+    if (vars[i] == v) {
+      return;
+    }
+  }
+  if (*n == GLITCH_BRANCH_VARS) {
+    d->shared = 1;
+    return;
+  }
+  vars[(*n)++] = v;
+}
+
+static int glitch_deps_has(float **vars, int n, float *v) {
+  for (int i = 0; i < n; i++) {
+    if (vars[i] == v) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Collects variables of e, cond is set below arguments that may be skipped,
+ * repeated or evaluated later. Reads of variables assigned earlier in the
+ * same unit are local and not collected. */
+static void glitch_deps(struct branch_deps *d, struct expr *e, int cond) {
+  vec_expr_t *args;
+  int i = 0;
+  if (e->type == OP_CONST) {
+    return;
+  } else if (e->type == OP_VAR) {
+    if (!glitch_deps_has(d->defs, d->ndefs, e->param.var.value)) {
+      glitch_deps_add(d, d->reads, &d->nreads, e->param.var.value);
+    }
+    return;
+  } else if (e->type == OP_ASSIGN) {
+    float *v = vec_nth(&e->param.op.args, 0).param.var.value;
+    glitch_deps(d, &vec_nth(&e->param.op.args, 1), cond);
+    glitch_deps_add(d, d->writes, &d->nwrites, v);
+    if (!cond) {
+      glitch_deps_add(d, d->defs, &d->ndefs, v);
+    }
+    return;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    args = &e->param.func.args;
+    cond = 1;
+    if (f->f == lib_poly || f->f == lib_out || f->f == lib_pan ||
+        f->f == lib_sample) {
+      d->shared = 1;
+    }
+    if (f->f == lib_r || f->f == lib_pluck) {
+      d->random = 1;
+    }
+    if (f->f == lib_each && vec_len(args) > 0) {
+      /* Loop variables are assigned */
+      struct expr *v = &vec_nth(args, 0);
+      for (; v->type == OP_COMMA; v = &vec_nth(&v->param.op.args, 1)) {
+        struct expr *car = &vec_nth(&v->param.op.args, 0);
+        if (car->type == OP_VAR) {
+          glitch_deps_add(d, d->writes, &d->nwrites, car->param.var.value);
+        }
+      }
+      if (v->type == OP_VAR) {
+        glitch_deps_add(d, d->writes, &d->nwrites, v->param.var.value);
+      }
+      i = 1;
+    }
+  } else {
+    args = &e->param.op.args;
+  }
+  for (; i < vec_len(args); i++) {
+    int skip =
+        (i > 0 && (e->type == OP_LOGICAL_AND || e->type == OP_LOGICAL_OR));
+    glitch_deps(d, &vec_nth(args, i), cond || skip);
+  }
+}
+
+/* Replaces variable from with variable to below e */
+static void glitch_branch_rebind(struct expr *e, float *from, float *to) {
+  if (e->type == OP_CONST) {
+    return;
+  } else if (e->type == OP_VAR) {
+    if (e->param.var.value == from) {
+      e->param.var.value = to;
+    }
+    return;
+  }
+  vec_expr_t *args =
+      (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_branch_rebind(&vec_nth(args, i), from, to);
+  }
+}
+
+/* Returns the private copy of a variable of g in a track */
+static float *glitch_branch_var(struct glitch *g, struct expr_var_list *vars,
+                                float *v) {
+  for (struct expr_var *var = g->vars.head; var != NULL; var = var->next) {
+    if (&var->value == v) {
+      struct expr_var *copy = expr_var(vars, var->name, strlen(var->name));
+      return (copy != NULL ? &copy->value : NULL);
+    }
+  }
+  return NULL;
+}
+
+/* Analysis state of a program split into tracks */
+struct branch_split {
+  int nstmts;
+  int first;  /* Unit of the first track */
+  int nunits; /* Statements, then mix() arguments */
+  int host[GLITCH_BRANCHES]; /* Statement evaluating a track, or nstmts */
+  struct expr *units[GLITCH_BRANCH_STMTS + GLITCH_BRANCHES + 1];
+  struct branch_deps deps[GLITCH_BRANCH_STMTS + GLITCH_BRANCHES + 1];
+  unsigned char need[GLITCH_BRANCHES][GLITCH_BRANCH_STMTS]; /* By track */
+  int owners[GLITCH_BRANCH_STMTS]; /* Number of tracks needing a statement */
+};
+
+/* Returns non-zero if a variable holds the same value for the whole frame
+ * from the first statement that reads it: it is either never assigned, or
+ * assigned the same constant before it is read */
+static int glitch_branch_stable(struct branch_split *sp, float *v) {
+  int assigned = 0, read = 0;
+  float value = 0;
+  for (int k = 0; k < sp->nunits; k++) {
+    struct expr *u = sp->units[k];
+    if (!glitch_deps_has(sp->deps[k].writes, sp->deps[k].nwrites, v)) {
+      read = read || (!assigned && glitch_deps_has(sp->deps[k].reads,
+                                                   sp->deps[k].nreads, v));
+      continue;
+    }
+    if (read || k >= sp->nstmts || u->type != OP_ASSIGN ||
+        vec_nth(&u->param.op.args, 1).type != OP_CONST) {
+      return 0;
+    }
+    float c = vec_nth(&u->param.op.args, 1).param.num.value;
+    if (assigned && c != value) {
+      return 0;
+    }
+    assigned = 1;
+    value = c;
+  }
+  return 1;
+}
+
+/* Returns non-zero if no unit reads v before assigning it, so that its value
+ * is never passed from one unit or frame to another */
+static int glitch_branch_temp(struct branch_split *sp, float *v) {
+  for (int k = 0; k < sp->nunits; k++) {
+    if (glitch_deps_has(sp->deps[k].reads, sp->deps[k].nreads, v)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns non-zero if only track b and statements needed by it alone use v,
+ * or if v is a temporary */
+static int glitch_branch_exclusive(struct branch_split *sp, int b, float *v) {
+  if (glitch_branch_temp(sp, v)) {
+    return 1;
+  }
+  for (int k = 0; k < sp->nunits; k++) {
+    struct branch_deps *d = &sp->deps[k];
+    if (k == sp->first + b || (!glitch_deps_has(d->reads, d->nreads, v) &&
+                                !glitch_deps_has(d->writes, d->nwrites, v))) {
+      continue;
+    }
+    if (k >= sp->nstmts || !sp->need[b][k] || sp->owners[k] != 1) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns non-zero if statement k is moved into track b rather than fed */
+static int glitch_branch_moved(struct branch_split *sp, int b, int k) {
+  struct branch_deps *d = &sp->deps[k];
+  for (int i = 0; i < d->nwrites; i++) {
+    if (!glitch_branch_exclusive(sp, b, d->writes[i])) {
+      return 0;
+    }
+  }
+  return sp->owners[k] == 1;
+}
+
+/* Returns non-zero if v is assigned outside of track b and the statements
+ * moved into it */
+static int glitch_branch_private(struct branch_split *sp, int b, float *v) {
+  for (int k = 0; k < sp->nunits; k++) {
+    if (k == sp->first + b ||
+        (k < sp->nstmts && sp->need[b][k] && glitch_branch_moved(sp, b, k))) {
+      continue;
+    }
+    if (glitch_deps_has(sp->deps[k].writes, sp->deps[k].nwrites, v)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Returns the number of variables a feed of statement k records, or -1 if
+ * there are too many of them */
+static int glitch_branch_feeds(struct branch_split *sp, int k, float **vars) {
+  struct branch_deps *d = &sp->deps[k];
+  int n = 0;
+  for (int i = 0; i < d->nwrites; i++) {
+    if (glitch_branch_temp(sp, d->writes[i])) {
+      continue;
+    } else if (n == GLITCH_FEED_VARS) {
+      return -1;
+    }
+    vars[n++] = d->writes[i];
+  }
+  return n;
+}
+
+/* Returns non-zero if track b may read v without the statements assigning
+ * it: v is t, or stable and not assigned after the track is evaluated */
+static int glitch_branch_input(struct glitch *g, struct branch_split *sp, int b,
+                               float *v) {
+  if (v == &g->t->value) {
+    return 1;
+  } else if (!glitch_branch_stable(sp, v)) {
+    return 0;
+  }
+  for (int k = sp->host[b]; k < sp->nstmts; k++) {
+    if (glitch_deps_has(sp->deps[k].writes, sp->deps[k].nwrites, v)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Collects statements needed by track b, returns non-zero if all variables
+ * it reads are either stable or assigned by these statements */
+static int glitch_branch_closure(struct glitch *g, struct branch_split *sp,
+                                 int b) {
+  int u = sp->first + b;
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int k = 0; k < sp->nunits; k++) {
+      if (k != u && (k >= sp->nstmts || !sp->need[b][k])) {
+        continue;
+      }
+      struct branch_deps *d = &sp->deps[k];
+      for (int i = 0; i < d->nreads; i++) {
+        float *v = d->reads[i];
+        if (glitch_branch_input(g, sp, b, v)) {
+          continue;
+        }
+        for (int j = 0; j < sp->nunits; j++) {
+          if (j == u || (j < sp->nstmts && sp->need[b][j]) ||
+              !glitch_deps_has(sp->deps[j].writes, sp->deps[j].nwrites, v)) {
+            continue;
+          }
+          if (j >= sp->nstmts) {
+            return 0; /* Assigned by another track */
+          }
+          sp->need[b][j] = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+  return !sp->deps[u].shared;
+}
+
+/* Finds the tracks of the final top-level mix() that can be rendered in
+ * parallel, returns their number */
+static int glitch_branch_analyse(struct glitch *g, struct expr *e,
+                                 struct branch_split *sp, int *ok) {
+  int ntracks = 0;
+  struct expr *mix = e;
+  for (; mix->type == OP_COMMA; mix = &vec_nth(&mix->param.op.args, 1)) {
+    if (sp->nstmts == GLITCH_BRANCH_STMTS) {
+      return 0;
+    }
+    sp->units[sp->nstmts++] = &vec_nth(&mix->param.op.args, 0);
+  }
+  if (mix->type != OP_FUNC || mix->param.func.f->f != lib_mix ||
+      vec_len(&mix->param.func.args) < 2 ||
+      vec_len(&mix->param.func.args) > GLITCH_BRANCHES) {
+    return 0;
+  }
+  sp->first = sp->nunits = sp->nstmts;
+  for (int i = 0; i < vec_len(&mix->param.func.args); i++) {
+    sp->host[i] = sp->nstmts;
+    sp->units[sp->nunits++] = &vec_nth(&mix->param.func.args, i);
+  }
+  for (int k = 0; k < sp->nunits; k++) {
+    glitch_deps(&sp->deps[k], sp->units[k], 0);
+    if (glitch_deps_has(sp->deps[k].writes, sp->deps[k].nwrites,
+                        &g->t->value)) {
+      return 0;
+    }
+  }
+  for (int b = 0; b < sp->nunits - sp->first; b++) {
+    ok[b] = glitch_branch_closure(g, sp, b);
+    for (int k = 0; k < sp->nstmts; k++) {
+      sp->owners[k] += sp->need[b][k];
+    }
+  }
+  for (int b = 0; b < sp->nunits - sp->first; b++) {
+    struct branch_deps *d = &sp->deps[sp->first + b];
+    float *vars[GLITCH_FEED_VARS];
+    for (int i = 0; i < d->nwrites && ok[b]; i++) {
+      ok[b] = glitch_branch_exclusive(sp, b, d->writes[i]);
+    }
+    for (int k = 0; k < sp->nstmts && ok[b]; k++) {
+      if (sp->need[b][k]) {
+        ok[b] = !sp->deps[k].shared && (glitch_branch_moved(sp, b, k) ||
+                                        glitch_branch_feeds(sp, k, vars) >= 0);
+      }
+    }
+    ntracks += ok[b];
+  }
+  return ntracks;
+}
+
+/* Unlinks moved statements from the top level, last first so that the
+ * positions of the others do not change */
+static void glitch_branch_unlink(struct expr *e, const int *removed, int n) {
+  for (int k = n - 1; k >= 0; k--) {
+    if (!removed[k]) {
+      continue;
+    }
+    struct expr *c = e;
+    for (int i = 0; i < k; i++) {
+      c = &vec_nth(&c->param.op.args, 1);
+    }
+    struct expr rest = vec_nth(&c->param.op.args, 1);
+    vec_free(&c->param.op.args);
+    *c = rest;
+  }
+}
+
+/* Replaces statements needed by several tracks with feeds and the tracks
+ * with branch nodes that hold the statements they need */
+static void glitch_branch_move(struct glitch *g, struct expr *e,
+                               struct branch_split *sp, int *ok) {
+  int removed[GLITCH_BRANCH_STMTS] = {0};
+  for (int k = 0; k < sp->nstmts; k++) {
+    struct expr w = expr_init();
+    struct feed_context *fc;
+    int fed = 0;
+    for (int b = 0; b < sp->nunits - sp->first; b++) {
+      fed = fed || (ok[b] && sp->need[b][k] && !glitch_branch_moved(sp, b, k));
+    }
+    if (!fed) {
+      continue;
+    }
+    fc = (struct feed_context *)calloc(1, sizeof(struct feed_context));
+    w.type = OP_FUNC;
+    w.param.func.f = &glitch_feed_func;
+    w.param.func.context = fc;
+    if (fc == NULL || vec_push(&w.param.func.args, *sp->units[k]) != 0) {
+      free(fc);
+      for (int b = 0; b < sp->nunits - sp->first; b++) {
+        ok[b] = ok[b] && !sp->need[b][k];
+      }
+      continue;
+    }
+    fc->nvars = glitch_branch_feeds(sp, k, fc->vars);
+    fc->start = -1;
+    *sp->units[k] = w;
+  }
+  for (int b = 0; b < sp->nunits - sp->first; b++) {
+    struct expr *arg = sp->units[sp->first + b];
+    struct expr w = expr_init();
+    struct branch_context *bc;
+    if (!ok[b]) {
+      continue;
+    }
+    bc = (struct branch_context *)calloc(1, sizeof(struct branch_context));
+    if (bc == NULL) {
+      continue;
+    }
+    bc->shadow = (struct glitch *)calloc(1, sizeof(struct glitch));
+    bc->start = -1;
+    bc->streams = (unsigned long)(b + 1) << 20;
+    if (bc->shadow == NULL ||
+        (bc->shadow->t = expr_var(&bc->vars, "t", 1)) == NULL) {
+      lib_branch_cleanup(NULL, bc);
+      free(bc);
+      continue;
+    }
+    /* Statements in the original order, followed by the track */
+    struct expr body = *arg;
+    for (int k = sp->nstmts - 1; k >= 0; k--) {
+      struct expr stmt = expr_init();
+      if (!sp->need[b][k]) {
+        continue;
+      } else if (glitch_branch_moved(sp, b, k)) {
+        stmt = *sp->units[k];
+        removed[k] = 1;
+      } else {
+        struct feed_context *fc =
+            (struct feed_context *)sp->units[k]->param.func.context;
+        stmt.type = OP_FUNC;
+        stmt.param.func.f = &glitch_pull_func;
+        stmt.param.func.context = calloc(1, sizeof(struct pull_context));
+        if (stmt.param.func.context != NULL) {
+          ((struct pull_context *)stmt.param.func.context)->feed = fc;
+        }
+        for (int j = 0; j < fc->nvars; j++) {
+          struct expr v = expr_init();
+          v.type = OP_VAR;
+          v.param.var.value = fc->vars[j];
+          vec_push(&stmt.param.func.args, v);
+        }
+      }
+      body = expr_binary(OP_COMMA, stmt, body);
+    }
+    /* Variables also assigned outside of the track become private to it */
+    for (int k = 0; k < sp->nunits; k++) {
+      struct branch_deps *d = &sp->deps[k];
+      if (k != sp->first + b && (k >= sp->nstmts || !sp->need[b][k])) {
+        continue;
+      }
+      for (int i = 0; i < d->nwrites; i++) {
+        float *v;
+        if (glitch_branch_private(sp, b, d->writes[i]) &&
+            (v = glitch_branch_var(g, &bc->vars, d->writes[i])) != NULL) {
+          glitch_branch_rebind(&body, d->writes[i], v);
+        }
+      }
+    }
+    w.type = OP_FUNC;
+    w.param.func.f = &glitch_branch_func;
+    w.param.func.context = bc;
+    vec_push(&w.param.func.args, body);
+    *arg = w;
+  }
+  glitch_branch_unlink(e, removed, sp->nstmts);
+}
+
+/* Moves independent tracks of the final top-level mix() into branch nodes */
+static void glitch_branch_split(struct glitch *g, struct expr *e) {
+  struct branch_split *sp = (struct branch_split *)calloc(1, sizeof(*sp));
+  int ok[GLITCH_BRANCHES] = {0};
+  if (sp != NULL && glitch_branch_analyse(g, e, sp, ok) >= 2) {
+    glitch_branch_move(g, e, sp, ok);
+  }
+  free(sp);
+}
+
+/* Collects the branch nodes of the final top-level mix() and the feeds
+ * before it, returns the number of branch nodes */
+static int glitch_branch_tracks(struct expr *e, struct expr **tracks,
+                                struct expr **feeds, int *nfeeds) {
+  int n = 0;
+  *nfeeds = 0;
+  if (e == NULL) {
+    return 0;
+  }
+  for (; e->type == OP_COMMA; e = &vec_nth(&e->param.op.args, 1)) {
+    struct expr *s = &vec_nth(&e->param.op.args, 0);
+    if (s->type == OP_FUNC && s->param.func.f == &glitch_feed_func &&
+        *nfeeds < GLITCH_BRANCH_STMTS) {
+      feeds[(*nfeeds)++] = s;
+    }
+  }
+  if (e->type != OP_FUNC || e->param.func.f->f != lib_mix) {
+    return 0;
+  }
+  for (int i = 0; i < vec_len(&e->param.func.args); i++) {
+    struct expr *w = &vec_nth(&e->param.func.args, i);
+    if (w->type == OP_FUNC && w->param.func.f == &glitch_branch_func) {
+      tracks[n++] = w;
+    }
+  }
+  return n;
+}
+
+/* Points t of every track to its private copy, after the wrappers that look
+ * for t have been placed */
+static void glitch_branch_bind(struct glitch *g, struct expr *e) {
+  struct expr *tracks[GLITCH_BRANCHES], *feeds[GLITCH_BRANCH_STMTS];
+  int nfeeds;
+  int n = glitch_branch_tracks(e, tracks, feeds, &nfeeds);
+  for (int i = 0; i < n; i++) {
+    struct branch_context *bc =
+        (struct branch_context *)tracks[i]->param.func.context;
+    glitch_branch_rebind(&vec_nth(&tracks[i]->param.func.args, 0),
+                         &g->t->value, &bc->shadow->t->value);
+  }
+}
+
+/* Drops rendered blocks, which no longer match the frame numbers */
+static void glitch_branch_flush(struct expr *e) {
+  struct expr *tracks[GLITCH_BRANCHES], *feeds[GLITCH_BRANCH_STMTS];
+  int nfeeds;
+  int n = glitch_branch_tracks(e, tracks, feeds, &nfeeds);
+  for (int i = 0; i < n; i++) {
+    ((struct branch_context *)tracks[i]->param.func.context)->len = 0;
+  }
+  for (int k = 0; k < nfeeds; k++) {
+    ((struct feed_context *)feeds[k]->param.func.context)->len = 0;
+  }
+}
+
+/*
+ * Pipeline: with worker threads and the pipeline enabled, inputs of delay()
+ * and filters that are evaluated on every frame and share no assigned
+ * variables with the rest of the program become stages. The workers render
+ * each stage one block ahead of the frames being evaluated, into a ring of
+ * blocks that the effect reads from. Top-level statements needed by one stage
+ * alone are moved into it, others are copied into it unless they draw random
+ * numbers. Variables a stage reads but does not assign are copied into it
+ * when its block is started, so that x, y and notes reach stages one block
+ * late. Output is otherwise that of serial evaluation.
+ */
+#define GLITCH_STAGE_SLOTS 2 /* blocks in the ring of a stage */
+
+struct stage_context {
+  int warm;                  /* Evaluated once in serial order */
+  int busy;                  /* Set while a worker renders the next block */
+  long next;                 /* Block given to the workers, or -1 */
+  struct glitch *shadow;     /* Engine state seen by the stage */
+  struct expr_var_list vars; /* Private t and copies of variables */
+  unsigned long streams;     /* Random streams seeded by workers */
+  int nsnaps;
+  float *snaps[GLITCH_BRANCH_VARS][2]; /* Variables and their copies */
+  long block[GLITCH_STAGE_SLOTS];      /* Block held by a slot, or -1 */
+  float buf[GLITCH_STAGE_SLOTS][GLITCH_BRANCH_BLOCK];
+};
+
+/* Copies the settings of g and the variables a stage reads into it */
+static void glitch_stage_prepare(struct glitch *g, struct stage_context *sc) {
+  glitch_branch_sync(g, sc->shadow);
+  for (int i = 0; i < sc->nsnaps; i++) {
+    *sc->snaps[i][1] = *sc->snaps[i][0];
+  }
+}
+
+static void glitch_stage_wait(struct stage_context *sc) {
+  while (__atomic_load_n(&sc->busy, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+/* Serves a frame from the ring, or evaluates the stage in place */
+static float lib_stage(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct stage_context *sc = (struct stage_context *)context;
+  struct glitch *g = glitch_current;
+  struct glitch *s = sc->shadow;
+  struct expr *e = &vec_nth(args, 0);
+  if (g == NULL || s == NULL) {
+    return expr_eval(e);
+  }
+  long j = g->frame / GLITCH_BRANCH_BLOCK;
+  if (j + 1 != sc->next) {
+    glitch_stage_wait(sc);
+  }
+  if (sc->block[j % GLITCH_STAGE_SLOTS] == j) {
+    return sc->buf[j % GLITCH_STAGE_SLOTS][g->frame % GLITCH_BRANCH_BLOCK];
+  }
+  glitch_stage_prepare(g, sc);
+  s->frame = g->frame;
+  s->t->value = g->t->value;
+  s->streams = g->streams;
+  glitch_current = s;
+  float v = expr_eval(e);
+  glitch_current = g;
+  g->streams = s->streams;
+  sc->warm = 1;
+  return v;
+}
+
+static void lib_stage_cleanup(struct expr_func *f, void *context) {
+  (void)f;
+  struct stage_context *sc = (struct stage_context *)context;
+  free(sc->shadow);
+  expr_destroy(NULL, &sc->vars);
+}
+
+static struct expr_func glitch_stage_func = {"", lib_stage, lib_stage_cleanup,
+                                             sizeof(struct stage_context)};
+
+/* Renders n frames of a stage starting at the given frame, which is the
+ * first frame of a block */
+static void glitch_stage_render(struct expr *w, long frame, size_t n) {
+  struct stage_context *sc = (struct stage_context *)w->param.func.context;
+  struct glitch *s = sc->shadow;
+  struct expr *e = &vec_nth(&w->param.func.args, 0);
+  long j = frame / GLITCH_BRANCH_BLOCK;
+  s->streams = sc->streams;
+  glitch_enter(s);
+  for (size_t i = 0; i < n; i++) {
+    s->frame = frame + i;
+    s->t->value = glitch_time(frame + i - 1);
+    sc->buf[j % GLITCH_STAGE_SLOTS][i] = expr_eval(e);
+  }
+  sc->streams = s->streams;
+  sc->block[j % GLITCH_STAGE_SLOTS] = j;
+  __atomic_store_n(&sc->busy, 0, __ATOMIC_RELEASE);
+}
+
+static int glitch_stage_has(struct expr **list, int n, struct expr *e) {
+  for (int i = 0; i < n; i++) {
+    if (list[i] == e) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Collects inputs of effects below e that are evaluated on every frame:
+ * first arguments of delay() and filters reached through operators, mix(),
+ * out(), pan() and other effects. Nested effects are searched for inputs
+ * below rejected ones. */
+static void glitch_stage_inputs(struct expr *e, struct expr **rejected,
+                                int nrejected, struct expr **inputs, int *n) {
+  vec_expr_t *args;
+  int effect = 0;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    effect = (f->f == lib_delay || f->f == lib_filter);
+    if (!effect && f->f != lib_mix && f->f != lib_out && f->f != lib_pan) {
+      return;
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    struct expr *arg = &vec_nth(args, i);
+    if (i > 0 && (e->type == OP_LOGICAL_AND || e->type == OP_LOGICAL_OR)) {
+      return;
+    } else if (effect && i == 0 && arg->type != OP_CONST &&
+               !glitch_stage_has(rejected, nrejected, arg)) {
+      if (*n < GLITCH_BRANCHES) {
+        inputs[(*n)++] = arg;
+      }
+    } else {
+      glitch_stage_inputs(arg, rejected, nrejected, inputs, n);
+    }
+  }
+}
+
+/* Finds inputs of effects and clears ok for those that cannot be rendered
+ * ahead, returns their number */
+static int glitch_stage_analyse(struct glitch *g, struct expr *e,
+                                struct branch_split *sp, struct expr **rejected,
+                                int nrejected, int *ok) {
+  struct expr saved[GLITCH_BRANCHES];
+  struct expr *last = e;
+  int n = 0;
+  for (; last->type == OP_COMMA; last = &vec_nth(&last->param.op.args, 1)) {
+    if (sp->nstmts == GLITCH_BRANCH_STMTS) {
+      return 0;
+    }
+    sp->units[sp->nstmts++] = &vec_nth(&last->param.op.args, 0);
+  }
+  sp->units[sp->nstmts] = last;
+  sp->first = sp->nstmts + 1;
+  for (int k = 0; k < sp->first; k++) {
+    int m = n;
+    glitch_stage_inputs(sp->units[k], rejected, nrejected,
+                        &sp->units[sp->first], &n);
+    for (; m < n; m++) {
+      sp->host[m] = k;
+    }
+  }
+  sp->nunits = sp->first + n;
+  /* The rest of the program is analysed with the inputs cut out */
+  for (int b = 0; b < n; b++) {
+    saved[b] = *sp->units[sp->first + b];
+    *sp->units[sp->first + b] = expr_const(0);
+  }
+  for (int k = 0; k < sp->first; k++) {
+    glitch_deps(&sp->deps[k], sp->units[k], 0);
+  }
+  for (int b = 0; b < n; b++) {
+    *sp->units[sp->first + b] = saved[b];
+    glitch_deps(&sp->deps[sp->first + b], sp->units[sp->first + b], 0);
+  }
+  for (int k = 0; k < sp->nunits; k++) {
+    if (glitch_deps_has(sp->deps[k].writes, sp->deps[k].nwrites,
+                        &g->t->value)) {
+      return 0;
+    }
+  }
+  for (int b = 0; b < n; b++) {
+    ok[b] = glitch_branch_closure(g, sp, b);
+    for (int k = 0; k < sp->nstmts; k++) {
+      sp->owners[k] += sp->need[b][k];
+    }
+  }
+  for (int b = 0; b < n; b++) {
+    struct branch_deps *d = &sp->deps[sp->first + b];
+    int moved = 0;
+    for (int i = 0; i < d->nwrites && ok[b]; i++) {
+      ok[b] = glitch_branch_exclusive(sp, b, d->writes[i]);
+    }
+    /* Needed statements must come before the effect and hold no stages */
+    for (int k = 0; k < sp->nstmts && ok[b]; k++) {
+      int hosts = 0;
+      if (!sp->need[b][k]) {
+        continue;
+      }
+      for (int i = 0; i < n; i++) {
+        hosts = hosts || sp->host[i] == k;
+      }
+      moved += glitch_branch_moved(sp, b, k);
+      ok[b] = k < sp->host[b] && !hosts && !sp->deps[k].shared &&
+              (glitch_branch_moved(sp, b, k) || !sp->deps[k].random);
+    }
+    /* A variable is only worth a stage with the statement assigning it */
+    if (sp->units[sp->first + b]->type == OP_VAR && moved == 0) {
+      ok[b] = 0;
+    }
+  }
+  return n;
+}
+
+/* Replaces the inputs with stages that hold the statements they need */
+static void glitch_stage_move(struct glitch *g, struct expr *e,
+                              struct branch_split *sp) {
+  int removed[GLITCH_BRANCH_STMTS] = {0};
+  for (int b = 0; b < sp->nunits - sp->first; b++) {
+    struct expr *in = sp->units[sp->first + b];
+    struct expr w = expr_init();
+    struct stage_context *sc =
+        (struct stage_context *)calloc(1, sizeof(struct stage_context));
+    if (sc == NULL) {
+      continue;
+    }
+    sc->shadow = (struct glitch *)calloc(1, sizeof(struct glitch));
+    sc->next = -1;
+    sc->streams = (unsigned long)(GLITCH_BRANCHES + b + 1) << 20;
+    for (int i = 0; i < GLITCH_STAGE_SLOTS; i++) {
+      sc->block[i] = -1;
+    }
+    if (sc->shadow == NULL ||
+        (sc->shadow->t = expr_var(&sc->vars, "t", 1)) == NULL) {
+      lib_stage_cleanup(NULL, sc);
+      free(sc);
+      continue;
+    }
+    /* Inputs assigned by no statement of the stage are copied per block */
+    int full = 0;
+    for (int k = 0; k < sp->nunits; k++) {
+      struct branch_deps *d = &sp->deps[k];
+      if (k != sp->first + b && (k >= sp->nstmts || !sp->need[b][k])) {
+        continue;
+      }
+      for (int i = 0; i < d->nreads; i++) {
+        float *v = d->reads[i];
+        int j = 0;
+        if (v == &g->t->value || !glitch_branch_input(g, sp, b, v)) {
+          continue;
+        }
+        for (; j < sc->nsnaps && sc->snaps[j][0] != v; j++) {
+        }
+        if (j == GLITCH_BRANCH_VARS) {
+          full = 1;
+        } else if (j == sc->nsnaps) {
+          sc->snaps[sc->nsnaps++][0] = v;
+        }
+      }
+    }
+    if (full) {
+      lib_stage_cleanup(NULL, sc);
+      free(sc);
+      continue;
+    }
+    /* Statements in the original order, followed by the input */
+    struct expr body = *in;
+    for (int k = sp->host[b] - 1; k >= 0; k--) {
+      struct expr stmt = expr_init();
+      if (!sp->need[b][k]) {
+        continue;
+      } else if (glitch_branch_moved(sp, b, k)) {
+        stmt = *sp->units[k];
+        removed[k] = 1;
+      } else {
+        expr_copy(&stmt, sp->units[k]);
+      }
+      body = expr_binary(OP_COMMA, stmt, body);
+    }
+    for (int k = 0; k < sp->nunits; k++) {
+      struct branch_deps *d = &sp->deps[k];
+      if (k != sp->first + b && (k >= sp->nstmts || !sp->need[b][k])) {
+        continue;
+      }
+      for (int i = 0; i < d->nwrites; i++) {
+        float *v;
+        if (glitch_branch_private(sp, b, d->writes[i]) &&
+            (v = glitch_branch_var(g, &sc->vars, d->writes[i])) != NULL) {
+          glitch_branch_rebind(&body, d->writes[i], v);
+        }
+      }
+    }
+    for (int i = 0; i < sc->nsnaps; i++) {
+      float *v = glitch_branch_var(g, &sc->vars, sc->snaps[i][0]);
+      sc->snaps[i][1] = (v != NULL ? v : sc->snaps[i][0]);
+      glitch_branch_rebind(&body, sc->snaps[i][0], sc->snaps[i][1]);
+    }
+    w.type = OP_FUNC;
+    w.param.func.f = &glitch_stage_func;
+    w.param.func.context = sc;
+    vec_push(&w.param.func.args, body);
+    *in = w;
+  }
+  glitch_branch_unlink(e, removed, sp->nstmts);
+}
+
+/* Moves inputs of effects that can be rendered ahead into stages. Inputs
+ * that cannot are put back and the program is analysed again, since they
+ * then count as part of the rest of it. */
+static void glitch_stage_split(struct glitch *g, struct expr *e) {
+  struct branch_split *sp = (struct branch_split *)calloc(1, sizeof(*sp));
+  struct expr *rejected[GLITCH_BRANCHES];
+  int ok[GLITCH_BRANCHES];
+  int nrejected = 0;
+  for (int again = 1; again && sp != NULL;) {
+    int n;
+    again = 0;
+    memset(sp, 0, sizeof(*sp));
+    n = glitch_stage_analyse(g, e, sp, rejected, nrejected, ok);
+    sp->nunits = sp->first + n; /* Also when the analysis gave up early */
+    for (int b = 0; b < n; b++) {
+      if (ok[b]) {
+        continue;
+      } else if (nrejected == GLITCH_BRANCHES) {
+        sp->nunits = sp->first;
+        break;
+      }
+      rejected[nrejected++] = sp->units[sp->first + b];
+      again = 1;
+    }
+  }
+  if (sp != NULL && sp->nunits > sp->first) {
+    glitch_stage_move(g, e, sp);
+  }
+  free(sp);
+}
+
+/* Collects the stages below e */
+static void glitch_stage_collect(struct expr *e, struct expr **stages,
+                                 int *n) {
+  if (e == NULL || e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  } else if (e->type == OP_FUNC && e->param.func.f == &glitch_stage_func) {
+    if (*n < GLITCH_BRANCHES) {
+      stages[(*n)++] = e;
+    }
+    return;
+  }
+  vec_expr_t *args =
+      (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_stage_collect(&vec_nth(args, i), stages, n);
+  }
+}
+
+/* Points t of every stage to its private copy */
+static void glitch_stage_bind(struct glitch *g, struct expr *e) {
+  struct expr *stages[GLITCH_BRANCHES];
+  int n = 0;
+  glitch_stage_collect(e, stages, &n);
+  for (int i = 0; i < n; i++) {
+    struct stage_context *sc =
+        (struct stage_context *)stages[i]->param.func.context;
+    glitch_branch_rebind(&vec_nth(&stages[i]->param.func.args, 0),
+                         &g->t->value, &sc->shadow->t->value);
+  }
+}
+
+/* Drops blocks rendered by the stages below e */
+static void glitch_stage_flush(struct expr *e) {
+  struct expr *stages[GLITCH_BRANCHES];
+  int n = 0;
+  glitch_stage_collect(e, stages, &n);
+  for (int i = 0; i < n; i++) {
+    struct stage_context *sc =
+        (struct stage_context *)stages[i]->param.func.context;
+    for (int j = 0; j < GLITCH_STAGE_SLOTS; j++) {
+      sc->block[j] = -1;
+    }
+    sc->next = -1;
+  }
+}
+
+/*
+ * Worker pool of an instance. A dispatch publishes its tracks or stages as
+ * one word holding a dispatch number, the number of jobs and the next job,
+ * and threads claim jobs with a compare-and-swap on it. The dispatching
+ * thread joins by rendering unclaimed jobs as well and spinning until all of
+ * them are done, right away for tracks and at the next block for stages.
+ * Idle workers sleep on a condition variable.
+ */
+struct glitch_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  unsigned long gen; /* Dispatches so far, guarded by the lock */
+  int quit;
+  struct glitch *g;
+  long frame;
+  size_t len;
+  struct expr *jobs[GLITCH_BRANCHES];
+  unsigned int serial;
+  unsigned int word; /* serial << 16 | number of jobs << 8 | next job */
+  int pending;       /* Jobs not rendered yet */
+  int nthreads;
+  pthread_t threads[];
+};
+
+static void glitch_pool_work(struct glitch_pool *p) {
+  unsigned int w = __atomic_load_n(&p->word, __ATOMIC_ACQUIRE);
+  for (;;) {
+    unsigned int i = w & 0xff;
+    if (i >= ((w >> 8) & 0xff)) {
+      return;
+    }
+    if (__atomic_compare_exchange_n(&p->word, &w, w + 1, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      glitch_trace_begin("job");
+      if (p->jobs[i]->param.func.f == &glitch_stage_func) {
+        glitch_stage_render(p->jobs[i], p->frame, p->len);
+      } else {
+        glitch_branch_render(p->g, p->jobs[i], p->frame, p->len);
+      }
+      glitch_trace_end("job");
+      __atomic_fetch_sub(&p->pending, 1, __ATOMIC_RELEASE);
+      w = __atomic_load_n(&p->word, __ATOMIC_ACQUIRE);
+    }
+  }
+}
+
+static void *glitch_pool_main(void *arg) {
+  struct glitch_pool *p = (struct glitch_pool *)arg;
+  unsigned long gen = 0;
+  libglitch_denormals_off();
+  glitch_trace_thread("glitch worker");
+  pthread_mutex_lock(&p->lock);
+  while (!p->quit) {
+    if (p->gen == gen) {
+      pthread_cond_wait(&p->wake, &p->lock);
+      continue;
+    }
+    gen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+    glitch_pool_work(p);
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void glitch_pool_destroy(struct glitch_pool *p) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->nthreads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+}
+
+static struct glitch_pool *glitch_pool_create(int n) {
+  struct glitch_pool *p = (struct glitch_pool *)calloc(
+      1, sizeof(struct glitch_pool) + n * sizeof(pthread_t));
+  if (p == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  for (; p->nthreads < n; p->nthreads++) {
+    if (pthread_create(&p->threads[p->nthreads], NULL, glitch_pool_main, p) !=
+        0) {
+      break;
+    }
+  }
+  if (p->nthreads == 0) {
+    glitch_pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+/* Publishes jobs to render n frames of each from the given frame */
+static void glitch_pool_post(struct glitch *g, struct expr **jobs, int njobs,
+                             long frame, size_t n) {
+  struct glitch_pool *p = g->pool;
+  memcpy(p->jobs, jobs, njobs * sizeof(struct expr *));
+  p->g = g;
+  p->frame = frame;
+  p->len = n;
+  p->serial++;
+  __atomic_store_n(&p->pending, njobs, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->word, ((p->serial & 0xffff) << 16) | (njobs << 8),
+                   __ATOMIC_RELEASE);
+  pthread_mutex_lock(&p->lock);
+  p->gen++;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Returns once the jobs posted last are done */
+static void glitch_pool_join(struct glitch *g) {
+  struct glitch_pool *p = g->pool;
+  if (p == NULL) {
+    return;
+  }
+  glitch_pool_work(p);
+  while (__atomic_load_n(&p->pending, __ATOMIC_ACQUIRE) > 0) {
+    sched_yield();
+  }
+  glitch_enter(g);
+}
+
+/* Renders the next n frames of every track of g, once all of them have been
+ * evaluated in serial order. Returns after the last track is done. */
+static void glitch_pool_dispatch(struct glitch *g, size_t n) {
+  struct expr *tracks[GLITCH_BRANCHES], *feeds[GLITCH_BRANCH_STMTS];
+  int nfeeds;
+  int njobs = glitch_branch_tracks(g->e, tracks, feeds, &nfeeds);
+  if (njobs < 2) {
+    return;
+  }
+  for (int i = 0; i < njobs; i++) {
+    if (!((struct branch_context *)tracks[i]->param.func.context)->warm) {
+      return;
+    }
+  }
+  glitch_feed_render(g, feeds, nfeeds, n);
+  glitch_pool_post(g, tracks, njobs, g->frame, n);
+  glitch_pool_join(g);
+}
+
+/* Moves the pipeline of g to the block starting at the current frame: waits
+ * for the stages to finish it and has the workers render the next one. A
+ * stage that has been evaluated in place renders the block first. */
+static void glitch_stage_step(struct glitch *g) {
+  struct expr *stages[GLITCH_BRANCHES], *jobs[GLITCH_BRANCHES];
+  int n = 0, njobs = 0;
+  long j = g->frame / GLITCH_BRANCH_BLOCK;
+  if (g->frame % GLITCH_BRANCH_BLOCK != 0) {
+    return;
+  }
+  glitch_stage_collect(g->e, stages, &n);
+  if (n == 0) {
+    return;
+  }
+  glitch_pool_join(g);
+  for (int i = 0; i < n; i++) {
+    struct stage_context *sc =
+        (struct stage_context *)stages[i]->param.func.context;
+    if (!sc->warm) {
+      continue;
+    }
+    glitch_stage_prepare(g, sc);
+    if (sc->block[j % GLITCH_STAGE_SLOTS] != j) {
+      glitch_stage_render(stages[i], g->frame, GLITCH_BRANCH_BLOCK);
+    }
+    sc->next = j + 1;
+    sc->busy = 1;
+    jobs[njobs++] = stages[i];
+  }
+  glitch_enter(g);
+  if (njobs > 0) {
+    glitch_pool_post(g, jobs, njobs, g->frame + GLITCH_BRANCH_BLOCK,
+                     GLITCH_BRANCH_BLOCK);
+  }
+}
+
+/*
+ * Record: public calls that change the state of an instance are appended to a
+ * log, each with the frame it was made at, and fills are logged as runs of
+ * equal blocks. Replaying the log on a fresh instance renders the same
+ * samples. Numbers are LEB128 varints, signed ones are zigzag encoded.
+ */
+#define GLITCH_RECORD_MAGIC "GLITCHREC1\n"
+
+enum glitch_record_op {
+  GLITCH_RECORD_FILL = 'f',    /* frames, channels, count */
+  GLITCH_RECORD_COMPILE = 'c', /* length, text */
+  GLITCH_RECORD_SET = 's',     /* length, name, float bits */
+  GLITCH_RECORD_SET_AT = 'v',  /* frame offset, length, name, float bits */
+  GLITCH_RECORD_MIDI = 'm',    /* cmd, a, b */
+  GLITCH_RECORD_MIDI_AT = 'a', /* frame offset, cmd, a, b */
+  GLITCH_RECORD_RESET = 'r',
+  GLITCH_RECORD_RESTORE = 'l', /* length, snapshot */
+  GLITCH_RECORD_SEED = 'd',   /* seed, streams */
+  GLITCH_RECORD_OPTION = 'o', /* option, value */
+};
+
+enum glitch_record_option {
+  GLITCH_OPTION_RATE,
+  GLITCH_OPTION_TICK,
+  GLITCH_OPTION_CONTROL,
+  GLITCH_OPTION_VOICES,
+  GLITCH_OPTION_STEAL,
+  GLITCH_OPTION_THREADS,
+  GLITCH_OPTION_PIPELINE,
+};
+
+struct glitch_recorder {
+  FILE *out;
+  long frame;          /* Frame of the last record */
+  long run;            /* Frame where the pending run of fills started */
+  size_t frames;       /* Frames and channels of each fill of the run */
+  size_t channels;
+  unsigned long count; /* Fills in the run, zero if none is pending */
+};
+
+static void glitch_record_uint(FILE *out, unsigned long long x) {
+  for (; x >= 0x80; x = x >> 7) {
+    fputc((int)(x & 0x7f) | 0x80, out);
+  }
+  fputc((int)x, out);
+}
+
+static void glitch_record_int(FILE *out, long long x) {
+  glitch_record_uint(out, ((unsigned long long)x << 1) ^ (x < 0 ? ~0ULL : 0));
+}
+
+static void glitch_record_op(struct glitch_recorder *r, int op, long frame) {
+  fputc(op, r->out);
+  glitch_record_int(r->out, frame - r->frame);
+  r->frame = frame;
+}
+
+static void glitch_record_flush(struct glitch_recorder *r) {
+  if (r->count > 0) {
+    glitch_record_op(r, GLITCH_RECORD_FILL, r->run);
+    glitch_record_uint(r->out, r->frames);
+    glitch_record_uint(r->out, r->channels);
+    glitch_record_uint(r->out, r->count);
+    r->count = 0;
+  }
+}
+
+/* Starts a record of the given kind, returns the output or NULL if the
+ * instance is not recorded */
+static FILE *glitch_record_event(struct glitch *g, int op) {
+  struct glitch_recorder *r = g->recorder;
+  if (r == NULL) {
+    return NULL;
+  }
+  glitch_record_flush(r);
+  glitch_record_op(r, op, g->frame);
+  return r->out;
+}
+
+static void glitch_record_fill(struct glitch *g, size_t frames,
+                               size_t channels) {
+  struct glitch_recorder *r = g->recorder;
+  if (r == NULL) {
+    return;
+  }
+  if (r->count > 0 && (r->frames != frames || r->channels != channels)) {
+    glitch_record_flush(r);
+  }
+  if (r->count == 0) {
+    r->run = g->frame;
+    r->frames = frames;
+    r->channels = channels;
+  }
+  r->count++;
+}
+
+static void glitch_record_option(struct glitch *g, enum glitch_record_option o,
+                                 long value) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_OPTION);
+  if (out != NULL) {
+    glitch_record_uint(out, o);
+    glitch_record_int(out, value);
+  }
+}
+
+static void glitch_record_seed(struct glitch *g) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_SEED);
+  if (out != NULL) {
+    glitch_record_uint(out, g->seed);
+    glitch_record_uint(out, g->streams);
+  }
+}
+
+static void glitch_record_bytes(FILE *out, const char *s, size_t len) {
+  glitch_record_uint(out, len);
+  fwrite(s, 1, len, out);
+}
+
+int glitch_record(struct glitch *g, FILE *out) {
+  if (g->recorder != NULL) {
+    glitch_record_flush(g->recorder);
+    fflush(g->recorder->out);
+    free(g->recorder);
+    g->recorder = NULL;
+  }
+  if (out == NULL) {
+    return 0;
+  }
+  struct glitch_recorder *r = calloc(1, sizeof(struct glitch_recorder));
+  if (r == NULL) {
+    return -1;
+  }
+  r->out = out;
+  g->recorder = r;
+  fputs(GLITCH_RECORD_MAGIC, out);
+  /* Settings the log starts with */
+  glitch_record_option(g, GLITCH_OPTION_RATE,
+                       (g->sample_rate > 0 ? g->sample_rate
+                                           : libglitch_default_sample_rate));
+  glitch_record_option(g, GLITCH_OPTION_TICK, g->tick);
+  glitch_record_option(g, GLITCH_OPTION_CONTROL, g->control);
+  if (g->voices.n > 0) {
+    glitch_record_option(g, GLITCH_OPTION_VOICES, g->voices.n);
+  }
+  glitch_record_option(g, GLITCH_OPTION_STEAL, g->voices.steal);
+  glitch_record_option(g, GLITCH_OPTION_THREADS,
+                       (g->pool != NULL ? g->pool->nthreads : 0));
+  glitch_record_option(g, GLITCH_OPTION_PIPELINE, g->pipeline);
+  glitch_record_seed(g);
+  return (ferror(out) ? -1 : 0);
+}
+
+static unsigned long long glitch_replay_uint(FILE *in, int *err) {
+  unsigned long long x = 0;
+  for (int shift = 0; shift < 64; shift = shift + 7) {
+    int c = fgetc(in);
+    if (c == EOF) {
+      break;
+    }
+    x = x | (unsigned long long)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return x;
+    }
+  }
+  *err = 1;
+  return 0;
+}
+
+static long long glitch_replay_int(FILE *in, int *err) {
+  unsigned long long x = glitch_replay_uint(in, err);
+  return (long long)(x >> 1) ^ -(long long)(x & 1);
+}
+
+/* Reads a length-prefixed string into a buffer that the caller frees */
+static char *glitch_replay_bytes(FILE *in, size_t *len, int *err) {
+  *len = glitch_replay_uint(in, err);
+  char *s = (*err ? NULL : malloc(*len + 1));
+  if (s == NULL || fread(s, 1, *len, in) != *len) {
+    free(s);
+    *err = 1;
+    return NULL;
+  }
+  s[*len] = '\0';
+  return s;
+}
+
+long glitch_replay(struct glitch *g, FILE *in, FILE *out, FILE *profile,
+                   uint64_t *hash) {
+  char magic[sizeof(GLITCH_RECORD_MAGIC)] = {0};
+  char *text = NULL;    /* Source of the last compile */
+  char *current = NULL; /* Source of the program being rendered */
+  float *buf = NULL;
+  size_t cap = 0;
+  long frame = 0;
+  long rendered = 0;
+  int err = 0;
+  if (fread(magic, 1, sizeof(magic) - 1, in) != sizeof(magic) - 1 ||
+      strcmp(magic, GLITCH_RECORD_MAGIC) != 0) {
+    return -1;
+  }
+  for (int op; !err && (op = fgetc(in)) != EOF;) {
+    frame = frame + (long)glitch_replay_int(in, &err);
+    if (err || frame != g->frame) {
+      /* Calls made before the record started are not in the log */
+      err = 1;
+      break;
+    }
+    switch (op) {
+    case GLITCH_RECORD_FILL: {
+      size_t frames = glitch_replay_uint(in, &err);
+      size_t channels = glitch_replay_uint(in, &err);
+      unsigned long count = glitch_replay_uint(in, &err);
+      if (err || channels == 0 || channels > GLITCH_MAX_CHANNELS) {
+        err = 1;
+        break;
+      }
+      if (frames * channels > cap) {
+        float *p = realloc(buf, frames * channels * sizeof(float));
+        if (p == NULL) {
+          err = 1;
+          break;
+        }
+        buf = p;
+        cap = frames * channels;
+      }
+      for (unsigned long i = 0; i < count; i++) {
+        glitch_fill(g, buf, frames, channels);
+        if (out != NULL) {
+          fwrite(buf, sizeof(float), frames * channels, out);
+        }
+        if (hash != NULL) {
+          const unsigned char *p = (const unsigned char *)buf;
+          for (size_t j = 0; j < frames * channels * sizeof(float); j++) {
+            *hash = (*hash ^ p[j]) * 0x100000001b3ULL;
+          }
+        }
+        if (g->next_expr == NULL && current != text) {
+          free(current);
+          current = text;
+        }
+      }
+      rendered = rendered + (long)(frames * count);
+      break;
+    }
+    case GLITCH_RECORD_COMPILE: {
+      size_t len;
+      char *s = glitch_replay_bytes(in, &len, &err);
+      if (s != NULL) {
+        glitch_compile(g, s, len);
+        if (text != current) {
+          free(text);
+        }
+        text = s;
+        if (g->next_expr == NULL) {
+          free(current);
+          current = text;
+        }
+      }
+      break;
+    }
+    case GLITCH_RECORD_SET:
+    case GLITCH_RECORD_SET_AT: {
+      long at = (op == GLITCH_RECORD_SET_AT ? glitch_replay_int(in, &err) : 0);
+      size_t len;
+      char *name = glitch_replay_bytes(in, &len, &err);
+      uint32_t bits = 0;
+      for (int i = 0; i < 4; i++) {
+        bits = bits | (uint32_t)(fgetc(in) & 0xff) << (i * 8);
+      }
+      if (name != NULL) {
+        float x;
+        memcpy(&x, &bits, sizeof(x));
+        if (op == GLITCH_RECORD_SET) {
+          glitch_set(g, name, x);
+        } else {
+          glitch_set_at(g, g->frame + at, name, x);
+        }
+        free(name);
+      }
+      break;
+    }
+    case GLITCH_RECORD_MIDI:
+    case GLITCH_RECORD_MIDI_AT: {
+      long at = (op == GLITCH_RECORD_MIDI_AT ? glitch_replay_int(in, &err) : 0);
+      unsigned char msg[3];
+      if (err || fread(msg, 1, 3, in) != 3) {
+        err = 1;
+      } else if (op == GLITCH_RECORD_MIDI) {
+        glitch_midi(g, msg[0], msg[1], msg[2]);
+      } else {
+        glitch_midi_at(g, g->frame + at, msg[0], msg[1], msg[2]);
+      }
+      break;
+    }
+    case GLITCH_RECORD_RESET:
+      glitch_reset(g);
+      break;
+    case GLITCH_RECORD_RESTORE: {
+      size_t len;
+      char *snap = glitch_replay_bytes(in, &len, &err);
+      if (snap != NULL && glitch_restore(g, snap, len) != 0) {
+        err = 1;
+      }
+      free(snap);
+      break;
+    }
+    case GLITCH_RECORD_SEED:
+      g->seed = glitch_replay_uint(in, &err);
+      g->streams = glitch_replay_uint(in, &err);
+      break;
+    case GLITCH_RECORD_OPTION: {
+      unsigned long long o = glitch_replay_uint(in, &err);
+      long value = (long)glitch_replay_int(in, &err);
+      switch (o) {
+      case GLITCH_OPTION_RATE:
+        glitch_set_sample_rate(g, value);
+        break;
+      case GLITCH_OPTION_TICK:
+        glitch_set_tick(g, (enum glitch_tick)value);
+        break;
+      case GLITCH_OPTION_CONTROL:
+        glitch_set_control(g, value);
+        break;
+      case GLITCH_OPTION_VOICES:
+        glitch_set_voices(g, value, g->voices.steal);
+        break;
+      case GLITCH_OPTION_STEAL:
+        g->voices.steal = (enum glitch_steal)value;
+        break;
+      case GLITCH_OPTION_THREADS:
+        glitch_set_threads(g, value);
+        break;
+      case GLITCH_OPTION_PIPELINE:
+        glitch_set_pipeline(g, value);
+        break;
+      }
+      break;
+    }
+    default:
+      err = 1;
+    }
+  }
+  if (!err && profile != NULL && current != NULL) {
+    glitch_profile(g, current, profile, GLITCH_PROFILE_FOLDED);
+  }
+  if (text != current) {
+    free(text);
+  }
+  free(current);
+  free(buf);
+  return (err ? -1 : rendered);
+}
+
+struct glitch *glitch_create() {
+  struct glitch *g = calloc(1, sizeof(struct glitch));
+  if (g != NULL) {
+    g->seed = libglitch_rand_seed;
+  }
+  return g;
+}
+
+void glitch_init(int sample_rate, unsigned long long seed) {
+  libglitch_init(sample_rate, seed);
+}
+
+void glitch_set_sample_loader(glitch_loader_fn fn) { loader = fn; }
+
+int glitch_add_sample(const char *name) {
+  for (int i = FIRST_USER_FUNC; i < MAX_FUNCS; i++) {
+    if (glitch_funcs[i].name == NULL || strlen(glitch_funcs[i].name) == 0) {
+      const char *s = calloc(1, strlen(name) + 1);
+      strcpy((char *)s, name);
+      glitch_funcs[i].name = s;
+      glitch_funcs[i].f = lib_sample;
+      glitch_funcs[i].ctxsz = sizeof(struct sample_context);
+      glitch_funcs[i + 1].name = NULL;
+      return 0;
+    }
+    if (strcmp(glitch_funcs[i].name, name) == 0) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+int glitch_remove_sample(const char *name) {
+  for (int i = FIRST_USER_FUNC; i < MAX_FUNCS; i++) {
+    if (glitch_funcs[i].name == NULL) {
+      break;
+    }
+    if (strcmp(glitch_funcs[i].name, name) == 0) {
+      free((void *)(glitch_funcs[i].name));
+      glitch_funcs[i].name = "";
+    }
+  }
+  return -1;
+}
+
+void glitch_seed(struct glitch *g, unsigned long long seed) {
+  g->seed = seed;
+  g->streams = 0;
+  glitch_record_seed(g);
+}
+
+void glitch_set_sample_rate(struct glitch *g, int sample_rate) {
+  g->sample_rate = (sample_rate > 0 ? sample_rate : 0);
+  glitch_record_option(g, GLITCH_OPTION_RATE,
+                       (g->sample_rate > 0 ? g->sample_rate
+                                           : libglitch_default_sample_rate));
+}
+
+void glitch_set_tick(struct glitch *g, enum glitch_tick tick) {
+  g->tick = tick;
+  glitch_record_option(g, GLITCH_OPTION_TICK, tick);
+}
+
+void glitch_set_control(struct glitch *g, int frames) {
+  g->control = frames;
+  glitch_record_option(g, GLITCH_OPTION_CONTROL, frames);
+}
+
+void glitch_set_threads(struct glitch *g, int n) {
+  glitch_record_option(g, GLITCH_OPTION_THREADS, n);
+  glitch_pool_join(g);
+  glitch_pool_destroy(g->pool);
+  g->pool = (n > 0 ? glitch_pool_create(n) : NULL);
+}
+
+void glitch_set_pipeline(struct glitch *g, int on) {
+  g->pipeline = on;
+  glitch_record_option(g, GLITCH_OPTION_PIPELINE, on);
+}
+
+int glitch_latency(struct glitch *g) {
+  struct expr *stages[GLITCH_BRANCHES];
+  int n = 0;
+  if (g->pool != NULL) {
+    glitch_stage_collect(g->e, stages, &n);
+  }
+  return (n > 0 ? GLITCH_BRANCH_BLOCK : 0);
+}
+
+struct glitch_load glitch_get_load(struct glitch *g) {
+  return g->load;
+}
+
+void glitch_reset_load(struct glitch *g) {
+  struct glitch_load load = {0};
+  g->load = load;
+}
+
+void glitch_xrun(struct glitch *g, int underruns, int overruns) {
+  glitch_trace_instant("xrun", underruns + overruns);
+  g->load.underruns = g->load.underruns + underruns;
+  g->load.overruns = g->load.overruns + overruns;
+}
+
+void glitch_destroy(struct glitch *g) {
+  glitch_record(g, NULL);
+  glitch_pool_join(g);
+  glitch_pool_destroy(g->pool);
+  glitch_cache_destroy(g->cache);
+  glitch_cache_destroy(g->next_cache);
+  expr_destroy(g->e, &g->vars);
+  free(g);
+}
+
+static void glitch_record_float(FILE *out, float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  for (int i = 0; i < 4; i++) {
+    fputc((bits >> (i * 8)) & 0xff, out);
+  }
+}
+
+void glitch_set(struct glitch *g, const char *name, float x) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_SET);
+  if (out != NULL) {
+    glitch_record_bytes(out, name, strlen(name));
+    glitch_record_float(out, x);
+  }
+  expr_var(&g->vars, name, strlen(name))->value = x;
+}
+
+float glitch_get(struct glitch *g, const char *name) {
+  return expr_var(&g->vars, name, strlen(name))->value;
+}
+
+/* Copies voice state into the k, g and v variables if the voice has them */
+static void glitch_voice_sync(struct glitch *g, int i) {
+  if (i < MAX_POLYPHONY) {
+    g->k[i]->value = g->voices.key[i];
+    g->g[i]->value = g->voices.gate[i];
+    g->v[i]->value = g->voices.vel[i];
+  }
+}
+
+static void glitch_voice_off(struct glitch *g, int i) {
+  struct glitch_voices *vs = &g->voices;
+  vs->key[i] = vs->gate[i] = vs->vel[i] = NAN;
+  vs->active[i / 32] &= ~(1u << (i % 32));
+  glitch_voice_sync(g, i);
+}
+
+static int glitch_same(float a, float b) {
+  return a == b || (isnan(a) && isnan(b));
+}
+
+/* Takes values written to the k, g and v variables by the program or by
+ * glitch_set into the voices they mirror. A voice ends when its key or
+ * velocity is NaN and a new note starts when its gate is set again. */
+static void glitch_voice_adopt(struct glitch *g) {
+  struct glitch_voices *vs = &g->voices;
+  for (int i = 0; i < MIN(vs->n, MAX_POLYPHONY); i++) {
+    float key = g->k[i]->value;
+    float gate = g->g[i]->value;
+    float vel = g->v[i]->value;
+    if (glitch_same(key, vs->key[i]) && glitch_same(gate, vs->gate[i]) &&
+        glitch_same(vel, vs->vel[i])) {
+      continue;
+    }
+    int active = (vs->active[i / 32] >> (i % 32)) & 1;
+    int note = !active || (isnan(vs->gate[i]) && !isnan(gate));
+    vs->key[i] = key;
+    vs->gate[i] = gate;
+    vs->vel[i] = vel;
+    if (isnan(key) || isnan(vel)) {
+      if (active) {
+        glitch_voice_off(g, i);
+      }
+      continue;
+    }
+    if (note) {
+      vs->age[i] = ++vs->serial;
+      vs->active[i / 32] |= 1u << (i % 32);
+    }
+    if (isnan(gate)) {
+      vs->released = 1;
+    }
+  }
+}
+
+/* Returns a free voice slot, or a voice to steal, or -1 */
+static int glitch_voice_alloc(struct glitch *g) {
+  struct glitch_voices *vs = &g->voices;
+  for (int w = 0; w * 32 < vs->n; w++) {
+    if (~vs->active[w] != 0) {
+      int i = w * 32 + glitch_ctz(~vs->active[w]);
+      if (i < vs->n) {
+        return i;
+      }
+      break;
+    }
+  }
+  int victim = -1;
+  glitch_voice_foreach(vs, i) {
+    if (victim == -1 ||
+        (vs->steal == GLITCH_STEAL_OLDEST && vs->age[i] < vs->age[victim]) ||
+        (vs->steal == GLITCH_STEAL_QUIETEST && vs->vel[i] < vs->vel[victim])) {
+      victim = i;
+    }
+  }
+  return (vs->steal == GLITCH_STEAL_NONE ? -1 : victim);
+}
+
+void glitch_set_voices(struct glitch *g, int n, enum glitch_steal steal) {
+  if (n < 1) {
+    n = 1;
+  } else if (n > GLITCH_MAX_VOICES) {
+    n = GLITCH_MAX_VOICES;
+  }
+  g->voices.steal = steal;
+  if (g->init) {
+    for (int i = n; i < g->voices.n; i++) {
+      glitch_voice_off(g, i);
+    }
+  }
+  g->voices.n = n;
+  glitch_record_option(g, GLITCH_OPTION_VOICES, n);
+  glitch_record_option(g, GLITCH_OPTION_STEAL, steal);
+}
+
+static void glitch_midi_apply(struct glitch *g, unsigned char cmd,
+                              unsigned char a, unsigned char b) {
+  struct glitch_voices *vs = &g->voices;
+  glitch_trace_instant("midi", cmd << 16 | a << 8 | b);
+  cmd = cmd >> 4;
+  if (cmd == 0x9 && b > 0) {
+    // Note pressed: take a free voice or steal one
+    int i = glitch_voice_alloc(g);
+    if (i >= 0) {
+      vs->key[i] = a - 69;
+      vs->gate[i] = vs->vel[i] = b / 128.0;
+      vs->age[i] = ++vs->serial;
+      vs->active[i / 32] |= 1u << (i % 32);
+      glitch_voice_sync(g, i);
+    }
+  } else if ((cmd == 0x9 && b == 0) || cmd == 0x8) {
+    // Note released: velocity starts fading out
+    float key = a - 69;
+    glitch_voice_foreach(vs, i) {
+      if (vs->key[i] == key && !isnan(vs->gate[i])) {
+        vs->gate[i] = NAN;
+        vs->released = 1;
+        glitch_voice_sync(g, i);
+        break;
+      }
+    }
+  } else if (cmd == 0xe) {
+    // Pitch bend wheel
+    g->x->value = (b - 64.f) / 65.f;
+  } else if (cmd == 0xb && a == 1) {
+    // Control change message: mod wheel
+    g->y->value = (b - 64.f) / 65.f;
+  } else {
+    fprintf(stderr, "MIDI command %d %d %d\n", cmd, a, b);
+  }
+}
+
+void glitch_midi(struct glitch *g, unsigned char cmd, unsigned char a,
+                 unsigned char b) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_MIDI);
+  if (out != NULL) {
+    fputc(cmd, out);
+    fputc(a, out);
+    fputc(b, out);
+  }
+  glitch_midi_apply(g, cmd, a, b);
+}
+
+static void glitch_event_apply(struct glitch *g, struct glitch_event *ev) {
+  if (ev->var != NULL) {
+    ev->var->value = ev->value;
+  } else {
+    glitch_midi_apply(g, ev->cmd, ev->a, ev->b);
+  }
+}
+
+/* Queues an event, it is applied by glitch_fill exactly at its frame or at
+ * the start of the next fill if already passed */
+static int glitch_event_push(struct glitch *g, struct glitch_event ev) {
+  int i = g->nevents;
+  if (i == GLITCH_MAX_EVENTS) {
+    /* A note-off is never dropped, the earliest event is applied now to
+     * make room for it, so that the order of events is kept */
+    if (ev.var != NULL ||
+        (ev.cmd >> 4 != 0x8 && (ev.cmd >> 4 != 0x9 || ev.b > 0))) {
+      return -1;
+    }
+    glitch_event_apply(g, &g->events[0]);
+    memmove(g->events, g->events + 1, (i - 1) * sizeof(g->events[0]));
+    g->nevents = i = i - 1;
+  }
+  /* Events at the same frame keep their order */
+  for (; i > 0 && g->events[i - 1].frame > ev.frame; i--) {
+    g->events[i] = g->events[i - 1];
+  }
+  g->events[i] = ev;
+  g->nevents++;
+  return 0;
+}
+
+int glitch_midi_at(struct glitch *g, long frame, unsigned char cmd,
+                   unsigned char a, unsigned char b) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_MIDI_AT);
+  if (out != NULL) {
+    glitch_record_int(out, frame - g->frame);
+    fputc(cmd, out);
+    fputc(a, out);
+    fputc(b, out);
+  }
+  glitch_trace_instant("midi_at", cmd << 16 | a << 8 | b);
+  struct glitch_event ev = {frame, NULL, 0, cmd, a, b};
+  return glitch_event_push(g, ev);
+}
+
+int glitch_set_at(struct glitch *g, long frame, const char *name, float x) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_SET_AT);
+  if (out != NULL) {
+    glitch_record_int(out, frame - g->frame);
+    glitch_record_bytes(out, name, strlen(name));
+    glitch_record_float(out, x);
+  }
+  struct glitch_event ev = {frame, expr_var(&g->vars, name, strlen(name)), x,
+                            0, 0, 0};
+  return glitch_event_push(g, ev);
+}
+
+static void glitch_events(struct glitch *g) {
+  int n = 0;
+  glitch_voice_adopt(g);
+  for (; n < g->nevents && g->events[n].frame <= g->frame; n++) {
+    glitch_event_apply(g, &g->events[n]);
+  }
+  if (n > 0) {
+    g->nevents = g->nevents - n;
+    memmove(g->events, g->events + n, g->nevents * sizeof(g->events[0]));
+  }
+}
+
+static void glitch_reset_state(struct glitch *g) {
+  g->t = expr_var(&g->vars, "t", 1);
+  g->x = expr_var(&g->vars, "x", 1);
+  g->y = expr_var(&g->vars, "y", 1);
+  g->bpm = expr_var(&g->vars, "bpm", 3);
+
+  g->t->value = g->x->value = g->y->value = g->bpm->value = 0;
+
+  for (int i = 0; i < MAX_POLYPHONY; i++) {
+    char name[4];
+    snprintf(name, sizeof(name), "k%d", i);
+    g->k[i] = expr_var(&g->vars, name, strlen(name));
+    snprintf(name, sizeof(name), "v%d", i);
+    g->v[i] = expr_var(&g->vars, name, strlen(name));
+    snprintf(name, sizeof(name), "g%d", i);
+    g->g[i] = expr_var(&g->vars, name, strlen(name));
+  }
+  if (g->voices.n == 0) {
+    g->voices.n = MAX_POLYPHONY;
+  }
+  for (int i = 0; i < GLITCH_MAX_VOICES; i++) {
+    g->voices.age[i] = 0;
+    glitch_voice_off(g, i);
+  }
+  /* Serial keeps counting, poly() contexts remember the ages they have seen */
+
+  /* Note constants */
+  const struct {
+    char *name;
+    int pitch;
+  } notes[] = {
+      {"C0", -9},  {"C#0", -8}, {"Cb0", -10}, {"D0", -7},  {"D#0", -6},
+      {"Db0", -8}, {"E0", -5},  {"E#0", -4},  {"Eb0", -6}, {"F0", -4},
+      {"F#0", -3}, {"Fb0", -5}, {"G0", -2},   {"G#0", -1}, {"Gb0", -3},
+      {"A0", 0},   {"A#0", 1},  {"Ab0", -1},  {"B0", 2},   {"B#0", 3},
+      {"Bb0", 1},
 
   };
   for (int octave = -4; octave < 4; octave++) {
@@ -769,38 +4119,515 @@ void glitch_reset(struct glitch *g) {
     }
   }
 
-  /* TR808 drum constants */
-  expr_var(&g->vars, "BD", 3)->value = 0;
-  expr_var(&g->vars, "SD", 3)->value = 1;
-  expr_var(&g->vars, "MT", 3)->value = 2;
-  expr_var(&g->vars, "MA", 3)->value = 3;
-  expr_var(&g->vars, "RS", 3)->value = 4;
-  expr_var(&g->vars, "CP", 3)->value = 5;
-  expr_var(&g->vars, "CB", 7)->value = 6;
-  expr_var(&g->vars, "OH", 3)->value = 7;
-  expr_var(&g->vars, "HH", 3)->value = 8;
+  /* TR808 drum constants */
+  expr_var(&g->vars, "BD", 3)->value = 0;
+  expr_var(&g->vars, "SD", 3)->value = 1;
+  expr_var(&g->vars, "MT", 3)->value = 2;
+  expr_var(&g->vars, "MA", 3)->value = 3;
+  expr_var(&g->vars, "RS", 3)->value = 4;
+  expr_var(&g->vars, "CP", 3)->value = 5;
+  expr_var(&g->vars, "CB", 7)->value = 6;
+  expr_var(&g->vars, "OH", 3)->value = 7;
+  expr_var(&g->vars, "HH", 3)->value = 8;
+
+  g->frame = g->bpm_start = 0;
+  g->nevents = 0;
+  glitch_pool_join(g);
+  glitch_branch_flush(g->e);
+  glitch_branch_flush(g->next_expr);
+  glitch_stage_flush(g->e);
+  glitch_stage_flush(g->next_expr);
+  if (g->cache != NULL) {
+    g->cache->sample_rate = 0;
+  }
+  g->streams = 0;
+  g->last_bpm = g->last_sample = 0.f;
+  libglitch_dither_init(g->dither, 0);
+  for (int i = 0; i < GLITCH_MAX_CHANNELS; i++) {
+    g->last_frame[i] = 0.f;
+  }
+}
+
+void glitch_reset(struct glitch *g) {
+  glitch_record_event(g, GLITCH_RECORD_RESET);
+  glitch_reset_state(g);
+}
+
+/*
+ * Sleeping subtrees: a side-effect free subtree that holds oscillator,
+ * envelope or filter state is wrapped at compile time. A subtree that keeps
+ * returning NaN (gated off) or zero (released) for the same input variables
+ * without changing its state is not evaluated again until one of the
+ * variables it reads changes. Free-running oscillators keep a subtree awake,
+ * so their phase is the same as if it was evaluated every frame.
+ */
+#define GLITCH_SLEEP_BACKOFF 64 /* frames between failed fixed point checks */
+
+struct sleep_state {
+  void *context;
+  size_t size;
+};
+
+struct sleep_context {
+  int init;
+  int asleep;
+  int armed;
+  int backoff;
+  float value;
+  vec(float *) vars;             /* Variables read by the subtree */
+  vec(struct sleep_state) state; /* Node contexts of the subtree */
+  float *values;                 /* Variable values when armed */
+  unsigned char *snapshot;       /* Node contexts when armed */
+};
+
+static int glitch_sleepable(struct expr *e, int *stateful) {
+  vec_expr_t *args;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return 1;
+  } else if (e->type == OP_ASSIGN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    /* Heap state, randomness, external data and channel routing stay awake */
+    if (f->cleanup != NULL || f->f == lib_r || f->f == lib_sample ||
+        f->f == lib_out || f->f == lib_pan || f == &glitch_feed_func ||
+        f == &glitch_pull_func) {
+      return 0;
+    }
+    if (f->ctxsz > 0) {
+      (*stateful)++;
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (!glitch_sleepable(&vec_nth(args, i), stateful)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void glitch_sleep_collect(struct sleep_context *sl, struct expr *e) {
+  vec_expr_t *args;
+  if (e->type == OP_CONST) {
+    return;
+  } else if (e->type == OP_VAR) {
+    for (int i = 0; i < vec_len(&sl->vars); i++) {
+      if (vec_nth(&sl->vars, i) == e->param.var.value) {
+        return;
+      }
+    }
+    vec_push(&sl->vars, e->param.var.value);
+    return;
+  } else if (e->type == OP_FUNC) {
+    if (e->param.func.f->ctxsz > 0) {
+      struct sleep_state st = {e->param.func.context,
+                               e->param.func.f->ctxsz};
+      vec_push(&sl->state, st);
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_sleep_collect(sl, &vec_nth(args, i));
+  }
+}
+
+static int glitch_sleep_vars(struct sleep_context *sl) {
+  for (int i = 0; i < vec_len(&sl->vars); i++) {
+    if (memcmp(vec_nth(&sl->vars, i), &sl->values[i], sizeof(float)) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int glitch_sleep_state(struct sleep_context *sl, int save) {
+  unsigned char *p = sl->snapshot;
+  int same = 1;
+  for (int i = 0; i < vec_len(&sl->state); i++) {
+    struct sleep_state *st = &vec_nth(&sl->state, i);
+    if (save) {
+      memcpy(p, st->context, st->size);
+    } else if (memcmp(p, st->context, st->size) != 0) {
+      same = 0;
+      break;
+    }
+    p += st->size;
+  }
+  if (save) {
+    for (int i = 0; i < vec_len(&sl->vars); i++) {
+      sl->values[i] = *vec_nth(&sl->vars, i);
+    }
+  }
+  return same;
+}
+
+/* Returns the size of the node contexts of the subtree */
+static size_t glitch_sleep_size(struct sleep_context *sl) {
+  size_t size = 0;
+  for (int i = 0; i < vec_len(&sl->state); i++) {
+    size += vec_nth(&sl->state, i).size;
+  }
+  return size;
+}
+
+static void glitch_sleep_init(struct sleep_context *sl, struct expr *e) {
+  sl->init = 1;
+  glitch_sleep_collect(sl, e);
+  sl->values = calloc(vec_len(&sl->vars) + 1, sizeof(float));
+  sl->snapshot = malloc(glitch_sleep_size(sl));
+  if (sl->values == NULL || sl->snapshot == NULL) {
+    sl->backoff = -1; /* never sleeps */
+  }
+}
+
+static float lib_sleep(struct expr_func *f, vec_expr_t *args, void *context) {
+  (void)f;
+  struct sleep_context *sl = (struct sleep_context *)context;
+  struct expr *e = &vec_nth(args, 0);
+
+  if (!sl->init) {
+    glitch_sleep_init(sl, e);
+  }
+
+  if (sl->asleep) {
+    if (glitch_sleep_vars(sl)) {
+      return sl->value;
+    }
+    sl->asleep = 0;
+  }
+
+  float r = expr_eval(e);
+  if (!isnan(r) && r != 0) {
+    sl->armed = 0;
+  } else if (sl->armed) {
+    sl->armed = 0;
+    if (memcmp(&r, &sl->value, sizeof(float)) == 0 && glitch_sleep_vars(sl) &&
+        glitch_sleep_state(sl, 0)) {
+      sl->asleep = 1;
+    } else {
+      sl->backoff = GLITCH_SLEEP_BACKOFF;
+    }
+  } else if (sl->backoff > 0) {
+    sl->backoff--;
+  } else if (sl->backoff == 0) {
+    glitch_sleep_state(sl, 1);
+    sl->armed = 1;
+  }
+  sl->value = r;
+  return r;
+}
+
+static void lib_sleep_cleanup(struct expr_func *f, void *context) {
+  (void)f;
+  struct sleep_context *sl = (struct sleep_context *)context;
+  vec_free(&sl->vars);
+  vec_free(&sl->state);
+  free(sl->values);
+  free(sl->snapshot);
+}
+
+static struct expr_func glitch_sleep_func = {"", lib_sleep, lib_sleep_cleanup,
+                                             sizeof(struct sleep_context)};
+
+/* Wraps maximal stateful subtrees that may sleep, tuples are left intact */
+static void glitch_sleep_wrap(struct expr *e) {
+  vec_expr_t *args;
+  int stateful = 0;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  }
+  if (e->type != OP_COMMA && glitch_sleepable(e, &stateful) && stateful > 0) {
+    struct expr w = expr_init();
+    w.type = OP_FUNC;
+    w.param.func.f = &glitch_sleep_func;
+    w.param.func.context = calloc(1, sizeof(struct sleep_context));
+    if (w.param.func.context == NULL || vec_push(&w.param.func.args, *e) != 0) {
+      free(w.param.func.context);
+      return;
+    }
+    *e = w;
+    return;
+  }
+  args = (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_sleep_wrap(&vec_nth(args, i));
+  }
+}
+
+/*
+ * Control-rate arguments: pitch, cutoff, tempo or time arguments of
+ * instruments and effects usually read only constants, variables and
+ * sequencers, which change at musical rates. Such arguments are wrapped at
+ * compile time and re-evaluated only when one of their inputs changes.
+ * Sequencers inside them keep running every frame and feed the argument
+ * through latch variables.
+ */
+#define GLITCH_CONTROL_SEQS 4
+
+struct control_context {
+  int init;
+  int nvars;
+  float *vars[GLITCH_PURE_VARS];
+  float values[GLITCH_PURE_VARS];
+  float latch[GLITCH_CONTROL_SEQS]; /* Sequencer outputs */
+  float value;
+  float from; /* Output when the value changed */
+  float out;
+  int ramp; /* Frames since the value changed */
+};
+
+static float lib_control(struct expr_func *f, vec_expr_t *args,
+                         void *context) {
+  (void)f;
+  struct control_context *cc = (struct control_context *)context;
+  struct glitch *g = glitch_current;
+  struct expr *e = &vec_nth(args, 0);
+  for (int i = 1; i < vec_len(args); i++) {
+    cc->latch[i - 1] = expr_eval(&vec_nth(args, i));
+  }
+  if (g == NULL || g->control < 0) {
+    return expr_eval(e);
+  }
+  int first = !cc->init;
+  int same = !first;
+  if (first) {
+    cc->init = 1;
+    glitch_pure_collect(e, cc->vars, &cc->nvars);
+  }
+  for (int i = 0; i < cc->nvars && same; i++) {
+    same = (memcmp(cc->vars[i], &cc->values[i], sizeof(float)) == 0);
+  }
+  if (!same) {
+    cc->value = expr_eval(e);
+    cc->from = (first ? cc->value : cc->out);
+    cc->ramp = 0;
+    for (int i = 0; i < cc->nvars; i++) {
+      cc->values[i] = *cc->vars[i];
+    }
+  }
+  cc->out = cc->value;
+  if (cc->ramp < g->control && !isnan(cc->from) && !isnan(cc->value)) {
+    cc->out = cc->from + (cc->value - cc->from) * cc->ramp / g->control;
+    cc->ramp++;
+  }
+  return cc->out;
+}
+
+static struct expr_func glitch_control_func = {"", lib_control, NULL,
+                                               sizeof(struct control_context)};
+
+/* Returns non-zero if e reads only constants and variables other than t */
+static int glitch_control_static(struct glitch *g, struct expr *e) {
+  vec_expr_t *args;
+  if (e->type == OP_CONST) {
+    return 1;
+  } else if (e->type == OP_VAR) {
+    return e->param.var.value != &g->t->value;
+  } else if (e->type == OP_ASSIGN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    if (f->ctxsz > 0 || f->cleanup != NULL || f->f == lib_out ||
+        f->f == lib_pan) {
+      return 0;
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (!glitch_control_static(g, &vec_nth(args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns the number of operations in a control-rate subtree, or -1 if it
+ * reads t, has side effects or state other than sequencers evaluated on
+ * every frame, or reads too many variables */
+static int glitch_control_ops(struct glitch *g, struct expr *e, float **vars,
+                              int *nvars, int *nseqs, int cond) {
+  vec_expr_t *args;
+  int ops = 1;
+  if (e->type == OP_CONST) {
+    return 0;
+  } else if (e->type == OP_VAR) {
+    for (int i = 0; i < *nvars; i++) {
+      if (vars[i] == e->param.var.value) {
+        return 0;
+      }
+    }
+    if (e->param.var.value == &g->t->value ||
+        *nvars == GLITCH_PURE_VARS - GLITCH_CONTROL_SEQS) {
+      return -1;
+    }
+    vars[(*nvars)++] = e->param.var.value;
+    return 0;
+  } else if (e->type == OP_ASSIGN) {
+    return -1;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    args = &e->param.func.args;
+    if (f->f == lib_seq) {
+      /* Sequencer arguments are constant or read variables only */
+      if (cond || *nseqs == GLITCH_CONTROL_SEQS) {
+        return -1;
+      }
+      for (int i = 0; i < vec_len(args); i++) {
+        if (!glitch_control_static(g, &vec_nth(args, i))) {
+          return -1;
+        }
+      }
+      (*nseqs)++;
+      return 0;
+    } else if (f->ctxsz > 0 || f->cleanup != NULL || f->f == lib_out ||
+               f->f == lib_pan) {
+      return -1;
+    }
+    for (int i = 0; i < vec_len(args); i++) {
+      int k = glitch_control_ops(g, &vec_nth(args, i), vars, nvars, nseqs,
+                                 cond || (f->f == lib_a && i > 0));
+      if (k < 0) {
+        return -1;
+      }
+      ops = ops + k;
+    }
+    return ops;
+  }
+  args = &e->param.op.args;
+  for (int i = 0; i < vec_len(args); i++) {
+    int k = glitch_control_ops(
+        g, &vec_nth(args, i), vars, nvars, nseqs,
+        cond || (i > 0 && (e->type == OP_LOGICAL_AND ||
+                           e->type == OP_LOGICAL_OR)));
+    if (k < 0) {
+      return -1;
+    }
+    ops = ops + k;
+  }
+  return ops;
+}
+
+/* Moves sequencers out of the argument into the wrapper, leaving variables
+ * that read their latched output */
+static void glitch_control_latch(struct expr *e, struct expr *w) {
+  vec_expr_t *args;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  } else if (e->type == OP_FUNC && e->param.func.f->f == lib_seq) {
+    struct control_context *cc = (struct control_context *)w->param.func.context;
+    struct expr v = expr_init();
+    v.type = OP_VAR;
+    v.param.var.value = &cc->latch[vec_len(&w->param.func.args) - 1];
+    vec_push(&w->param.func.args, *e);
+    *e = v;
+    return;
+  }
+  args = (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_control_latch(&vec_nth(args, i), w);
+  }
+}
 
-  g->frame = g->bpm_start = 0;
-  g->last_bpm = g->last_sample = 0.f;
+/* Wraps arguments of instruments and effects that run at control rate.
+ * Bodies of each() and poly() are copied at runtime and left intact. */
+static void glitch_control_wrap(struct glitch *g, struct expr *e) {
+  vec_expr_t *args;
+  int control = 0;
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    if (f->f == lib_each || f->f == lib_poly) {
+      return;
+    }
+    control = (f->ctxsz > 0 && f->f != lib_seq && f->f != lib_mix &&
+               f != &glitch_sleep_func && f != &glitch_tick_func &&
+               f != &glitch_int_func && f != &glitch_branch_func &&
+               f != &glitch_feed_func && f != &glitch_pull_func &&
+               f != &glitch_stage_func);
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    struct expr *arg = &vec_nth(args, i);
+    float *vars[GLITCH_PURE_VARS];
+    int nvars = 0, nseqs = 0;
+    if (control && arg->type != OP_COMMA &&
+        glitch_control_ops(g, arg, vars, &nvars, &nseqs, 0) > 0) {
+      struct expr w = expr_init();
+      w.type = OP_FUNC;
+      w.param.func.f = &glitch_control_func;
+      w.param.func.context = calloc(1, sizeof(struct control_context));
+      if (w.param.func.context == NULL ||
+          vec_push(&w.param.func.args, *arg) != 0) {
+        free(w.param.func.context);
+        continue;
+      }
+      /* Latching may move the wrapper arguments, the root is not a sequencer */
+      struct expr body = vec_nth(&w.param.func.args, 0);
+      glitch_control_latch(&body, &w);
+      vec_nth(&w.param.func.args, 0) = body;
+      *arg = w;
+    } else {
+      glitch_control_wrap(g, arg);
+    }
+  }
 }
 
 int glitch_compile(struct glitch *g, const char *s, size_t len) {
+  FILE *out = glitch_record_event(g, GLITCH_RECORD_COMPILE);
+  if (out != NULL) {
+    glitch_record_bytes(out, s, len);
+  }
   if (!g->init) {
-    glitch_reset(g);
+    glitch_reset_state(g);
     g->init = 1;
   }
+  glitch_trace_begin("compile");
+  glitch_trace_begin("parse");
   struct expr *e = expr_create(s, len, &g->vars, glitch_funcs);
+  glitch_trace_end("parse");
   if (e == NULL) {
+    glitch_trace_end("compile");
     return -1;
   }
+  glitch_trace_begin("prepare");
+  if (g->pool != NULL && g->pipeline) {
+    glitch_stage_split(g, e);
+  } else if (g->pool != NULL) {
+    glitch_branch_split(g, e);
+  }
+  glitch_sleep_wrap(e);
+  glitch_tick_wrap(g, e);
+  glitch_control_wrap(g, e);
+  glitch_branch_bind(g, e);
+  glitch_stage_bind(g, e);
+  struct glitch_cache *c = glitch_cache_create(g, e);
+  glitch_trace_end("prepare");
   expr_destroy(g->next_expr, NULL);
+  glitch_cache_destroy(g->next_cache);
   if (g->bpm->value == 0) {
+    glitch_pool_join(g);
     expr_destroy(g->e, NULL);
+    glitch_cache_destroy(g->cache);
     g->e = e;
+    g->cache = c;
     g->next_expr = NULL;
+    g->next_cache = NULL;
+    glitch_trace_instant("swap", 0);
   } else {
     g->next_expr = e;
+    g->next_cache = c;
   }
+  glitch_trace_end("compile");
   return 0;
 }
 
@@ -809,54 +4636,868 @@ float glitch_beat(struct glitch *g) {
          libglitch_sample_rate;
 }
 
-void glitch_iter(struct glitch *g, size_t frames) {
+/* Returns the frame whose interval crosses the next beat, where a pending
+ * program is swapped in. The beat is placed in double precision, so that
+ * segments end on the same frame whatever their length. */
+static long glitch_swap_frame(struct glitch *g) {
+  double frames_per_beat = 60.0 * libglitch_sample_rate / g->bpm->value;
+  double beat = floor((g->frame - g->bpm_start) / frames_per_beat) + 1;
+  long frame = g->bpm_start + (long)ceil(beat * frames_per_beat) - 1;
+  while (frame < g->frame) {
+    beat = beat + 1;
+    frame = g->bpm_start + (long)ceil(beat * frames_per_beat) - 1;
+  }
+  return frame;
+}
+
+/* Decays the velocity of released voices by one frame */
+static void glitch_voice_release(struct glitch *g) {
+  struct glitch_voices *vs = &g->voices;
+  int released = 0;
+  glitch_voice_foreach(vs, i) {
+    if (isnan(vs->gate[i])) {
+      vs->vel[i] = vs->vel[i] - (10.f / libglitch_sample_rate);
+      if (vs->vel[i] < 0.01f) {
+        glitch_voice_off(g, i);
+      } else {
+        glitch_voice_sync(g, i);
+        released = 1;
+      }
+    }
+  }
+  vs->released = released;
+}
+
+/* Housekeeping at the start of a segment */
+static void glitch_iter(struct glitch *g) {
   int apply_next = 1;
   /* If BPM is given - apply changes on the next beat */
-  if (g->bpm->value > 0) {
-    float beat = glitch_beat(g);
-    float interval = frames * g->bpm->value / 60.0 / libglitch_sample_rate;
-    float a = (beat) - (int)beat;
-    float b = (beat + interval) - (int)(beat + interval);
-    if (a < b) {
-      apply_next = 0;
-    }
+  if (g->bpm->value > 0 && g->next_expr != NULL) {
+    apply_next = (g->frame == glitch_swap_frame(g));
   }
   if (apply_next && g->next_expr != NULL) {
     if (g->bpm->value != g->last_bpm) {
       g->last_bpm = g->bpm->value;
       g->bpm_start = g->frame;
     }
+    glitch_pool_join(g);
     expr_destroy(g->e, NULL);
     g->e = g->next_expr;
     g->next_expr = NULL;
+    glitch_cache_destroy(g->cache);
+    g->cache = g->next_cache;
+    g->next_cache = NULL;
+    glitch_trace_instant("swap", (long)g->frame);
   }
-  for (int i = 0; i < MAX_POLYPHONY; i++) {
-    if (!isnan(g->v[i]->value) && isnan(g->g[i]->value)) {
-      g->v[i]->value = g->v[i]->value - (10.f * frames / libglitch_sample_rate);
-      if (g->v[i]->value < 0.01f) {
-        g->v[i]->value = NAN;
-        g->k[i]->value = NAN;
-      }
-    }
+  if (g->voices.released) {
+    glitch_voice_release(g);
   }
 }
 
 float glitch_eval(struct glitch *g) {
+  glitch_enter(g);
   float v = expr_eval(g->e);
+  struct glitch_cache *c = g->cache;
+  if (c != NULL && c->len < c->period && g->frame == c->start + c->len) {
+    c->buf[c->len++] = v;
+  }
   if (!isnan(v)) {
     g->last_sample = v;
   }
-  g->t->value = (long)(g->frame * 8000.0f / libglitch_sample_rate);
+  g->t->value = glitch_time(g->frame);
   g->frame++;
   return g->last_sample;
 }
 
+/* Returns the number of frames that can be rendered before the next
+ * housekeeping event: a scheduled MIDI message, a beat boundary with a
+ * pending program swap or the end of a released voice. Housekeeping is then
+ * done once for the whole segment, only the velocity of released voices
+ * decays every frame. */
+static size_t glitch_segment(struct glitch *g, size_t frames) {
+  size_t n = frames;
+  if (g->pool != NULL) {
+    /* Segments do not cross blocks of tracks and stages */
+    n = MIN(n, (size_t)(GLITCH_BRANCH_BLOCK - g->frame % GLITCH_BRANCH_BLOCK));
+  }
+  if (g->nevents > 0 && (size_t)(g->events[0].frame - g->frame) < n) {
+    n = g->events[0].frame - g->frame;
+  }
+  if (g->next_expr != NULL && g->bpm->value > 0) {
+    long k = glitch_swap_frame(g) - g->frame;
+    if (k > 0 && (size_t)k < n) {
+      n = k;
+    }
+  }
+  struct glitch_voices *vs = &g->voices;
+  glitch_voice_foreach(vs, i) {
+    if (isnan(vs->gate[i])) {
+      if (g->pool != NULL) {
+        /* Tracks are rendered for the segment before the decay */
+        return 1;
+      }
+      size_t k = (size_t)((vs->vel[i] - 0.01f) * libglitch_sample_rate / 10.f);
+      n = MIN(n, MAX(k, 1));
+    }
+  }
+  return (n > 0 ? n : 1);
+}
+
+/* Returns the multichannel result expression of the program, which is the
+ * last top-level expression if it is out() or pan(), or NULL otherwise. */
+static struct expr *glitch_output(struct expr *e) {
+  while (e->type == OP_COMMA) {
+    e = &vec_nth(&e->param.op.args, 1);
+  }
+  if (e->type == OP_FUNC &&
+      (e->param.func.f->f == lib_out || e->param.func.f->f == lib_pan)) {
+    return e;
+  }
+  return NULL;
+}
+
+/* Evaluates one frame of a multichannel program. Top-level expressions are
+ * evaluated once, so values they assign are shared by all channels. Returns
+ * the number of channels written to v. */
+static size_t glitch_eval_channels(struct glitch *g, struct expr *out,
+                                   float *v) {
+  size_t n = 0;
+  glitch_enter(g);
+  for (struct expr *e = g->e; e != out; e = &vec_nth(&e->param.op.args, 1)) {
+    expr_eval(&vec_nth(&e->param.op.args, 0));
+  }
+  vec_expr_t *args = &out->param.func.args;
+  if (out->param.func.f->f == lib_pan) {
+    float x = arg(args, 0, NAN);
+    float pos = (flim(arg(args, 1, 0), -1, 1) + 1) / 8;
+    v[n++] = x * SIN(pos + 0.25f);
+    v[n++] = x * SIN(pos);
+  } else {
+    for (; n < (size_t)vec_len(args) && n < GLITCH_MAX_CHANNELS; n++) {
+      v[n] = expr_eval(&vec_nth(args, n));
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (isnan(v[i])) {
+      v[i] = g->last_frame[i];
+    } else {
+      g->last_frame[i] = v[i];
+    }
+  }
+  if (n > 0) {
+    g->last_sample = g->last_frame[0];
+  }
+  g->t->value = glitch_time(g->frame);
+  g->frame++;
+  return n;
+}
+
+/* Accounts the time since start against the duration of the rendered frames.
+ * The moving average has a time constant of about a second of audio. */
+static void glitch_load_update(struct glitch *g, double start, size_t frames) {
+  struct glitch_load *l = &g->load;
+  if (frames == 0) {
+    return;
+  }
+  double period = (double)frames / libglitch_sample_rate;
+  double end = glitch_clock();
+  float load = (float)((end - start) / period);
+  glitch_trace('X', "fill", (long)frames, (start - glitch_trace_t0) * 1e6,
+               (end - start) * 1e6);
+  l->last = load;
+  if (l->fills == 0) {
+    l->average = load;
+  } else {
+    l->average = l->average + (load - l->average) * (float)MIN(period, 1);
+  }
+  l->peak = MAX(l->peak, load);
+  l->fills++;
+  if (load > 1) {
+    l->late++;
+  }
+}
+
+static void glitch_render(struct glitch *g, float *buf, size_t frames,
+                          size_t channels) {
+  float v[GLITCH_MAX_CHANNELS];
+  unsigned long fpmode = libglitch_denormals_off();
+  glitch_record_fill(g, frames, channels);
+  glitch_enter(g);
+  while (frames > 0) {
+    glitch_events(g);
+    size_t n = glitch_segment(g, frames);
+    glitch_iter(g);
+    if (g->pool != NULL) {
+      glitch_stage_step(g);
+    }
+    struct expr *out = (channels > 1 ? glitch_output(g->e) : NULL);
+    if (out == NULL && glitch_cache_play(g, buf, n, channels)) {
+      for (size_t i = 1; g->voices.released && i < n; i++) {
+        glitch_voice_release(g);
+      }
+      buf = buf + n * channels;
+      frames = frames - n;
+      continue;
+    }
+    if (g->pool != NULL) {
+      glitch_pool_dispatch(g, n);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (i > 0 && g->voices.released) {
+        glitch_voice_release(g);
+      }
+      if (out == NULL) {
+        float x = glitch_eval(g);
+        for (size_t j = 0; j < channels; j++) {
+          *buf++ = x;
+        }
+      } else {
+        size_t m = glitch_eval_channels(g, out, v);
+        for (size_t j = 0; j < channels; j++) {
+          *buf++ = (m > 0 ? v[j % m] : 0);
+        }
+      }
+    }
+    frames = frames - n;
+  }
+  libglitch_denormals_restore(fpmode);
+}
+
 void glitch_fill(struct glitch *g, float *buf, size_t frames, size_t channels) {
-  for (unsigned int i = 0; i < frames; i++) {
-    glitch_iter(g, 1);
-    float v = glitch_eval(g);
-    for (unsigned int j = 0; j < channels; j++) {
-      *buf++ = v;
+  double start = glitch_clock();
+  glitch_render(g, buf, frames, channels);
+  glitch_load_update(g, start, frames);
+}
+
+enum glitch_format {
+  GLITCH_FORMAT_ADD,
+  GLITCH_FORMAT_PLANAR,
+  GLITCH_FORMAT_S16,
+  GLITCH_FORMAT_S24,
+  GLITCH_FORMAT_S32,
+};
+
+/* Renders interleaved float frames into a small scratch buffer that stays in
+ * cache and converts them to the requested output format block by block */
+static void glitch_fill_format(struct glitch *g, void *buf, size_t frames,
+                               size_t channels, enum glitch_format format) {
+  float tmp[GLITCH_SCRATCH];
+  double start = glitch_clock();
+  if (channels == 0 || channels > GLITCH_SCRATCH) {
+    return;
+  }
+  size_t block = GLITCH_SCRATCH / channels;
+  for (size_t off = 0; off < frames;) {
+    size_t n = MIN(frames - off, block);
+    size_t len = n * channels;
+    size_t pos = off * channels;
+    glitch_render(g, tmp, n, channels);
+    switch (format) {
+    case GLITCH_FORMAT_ADD:
+      for (size_t i = 0; i < len; i++) {
+        ((float *)buf)[pos + i] += tmp[i];
+      }
+      break;
+    case GLITCH_FORMAT_PLANAR:
+      for (size_t j = 0; j < channels; j++) {
+        float *out = ((float **)buf)[j] + off;
+        for (size_t i = 0; i < n; i++) {
+          out[i] = tmp[i * channels + j];
+        }
+      }
+      break;
+    case GLITCH_FORMAT_S16:
+      libglitch_to_s16((int16_t *)buf + pos, tmp, len, g->dither);
+      break;
+    case GLITCH_FORMAT_S24:
+      libglitch_to_s24((unsigned char *)buf + pos * 3, tmp, len, g->dither);
+      break;
+    case GLITCH_FORMAT_S32:
+      libglitch_to_s32((int32_t *)buf + pos, tmp, len);
+      break;
+    }
+    off = off + n;
+  }
+  glitch_load_update(g, start, frames);
+}
+
+void glitch_fill_add(struct glitch *g, float *buf, size_t frames,
+                     size_t channels) {
+  glitch_fill_format(g, buf, frames, channels, GLITCH_FORMAT_ADD);
+}
+
+void glitch_fill_planar(struct glitch *g, float **bufs, size_t frames,
+                        size_t channels) {
+  glitch_fill_format(g, bufs, frames, channels, GLITCH_FORMAT_PLANAR);
+}
+
+void glitch_fill_s16(struct glitch *g, int16_t *buf, size_t frames,
+                     size_t channels) {
+  glitch_fill_format(g, buf, frames, channels, GLITCH_FORMAT_S16);
+}
+
+void glitch_fill_s24(struct glitch *g, unsigned char *buf, size_t frames,
+                     size_t channels) {
+  glitch_fill_format(g, buf, frames, channels, GLITCH_FORMAT_S24);
+}
+
+void glitch_fill_s32(struct glitch *g, int32_t *buf, size_t frames,
+                     size_t channels) {
+  glitch_fill_format(g, buf, frames, channels, GLITCH_FORMAT_S32);
+}
+
+/*
+ * Profiling
+ */
+struct glitch_profile_func {
+  const char *name;
+  unsigned long calls;
+  unsigned long long self;
+};
+
+static const char *glitch_profile_label(struct glitch *g, struct expr *e) {
+  if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    if (f->name[0] != '\0') {
+      return f->name;
+    }
+    return (f == &glitch_tick_func      ? "[tick]"
+            : f == &glitch_int_func     ? "[int]"
+            : f == &glitch_control_func ? "[control]"
+            : f == &glitch_sleep_func   ? "[sleep]"
+            : f == &glitch_branch_func  ? "[branch]"
+            : f == &glitch_stage_func   ? "[stage]"
+                                        : "[wrap]");
+  } else if (e->type == OP_VAR) {
+    for (struct expr_var *v = g->vars.head; v != NULL; v = v->next) {
+      if (&v->value == e->param.var.value) {
+        return v->name;
+      }
+    }
+    return "[var]";
+  } else if (e->type == OP_CONST) {
+    return "[const]";
+  }
+  for (unsigned int i = 0; i < sizeof(OPS) / sizeof(OPS[0]); i++) {
+    if (OPS[i].op == e->type) {
+      return OPS[i].s;
+    }
+  }
+  return "[?]";
+}
+
+#ifdef EXPR_PROFILE
+static vec_expr_t *glitch_profile_args(struct expr *e) {
+  if (e->type == OP_CONST || e->type == OP_VAR) {
+    return NULL;
+  }
+  return (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+}
+
+/* Cycles spent in the node itself rather than in its arguments */
+static unsigned long long glitch_profile_self(struct expr *e) {
+  unsigned long long children = 0;
+  vec_expr_t *args = glitch_profile_args(e);
+  for (int i = 0; args != NULL && i < vec_len(args); i++) {
+    children = children + vec_nth(args, i).prof.cycles;
+  }
+  return (children < e->prof.cycles ? e->prof.cycles - children : 0);
+}
+
+/* Formats the label of a node with the line and column where it starts, or
+ * with the byte offset if the source is not known. Wrappers added by the
+ * compiler are placed at their first argument. */
+static void glitch_profile_frame(struct glitch *g, struct expr *e,
+                                 const char *src, char *buf, size_t len) {
+  const char *label = glitch_profile_label(g, e);
+  struct expr *at = e;
+  vec_expr_t *args;
+  while (at->prof.end == 0 && (args = glitch_profile_args(at)) != NULL &&
+         vec_len(args) > 0) {
+    at = &vec_nth(args, 0);
+  }
+  if (at->prof.end == 0) {
+    snprintf(buf, len, "%s", label);
+  } else if (src == NULL) {
+    snprintf(buf, len, "%s@%d", label, at->prof.start);
+  } else {
+    int line = 1, col = 1;
+    for (int i = 0; i < at->prof.start && src[i] != '\0'; i++) {
+      col = (src[i] == '\n' ? 1 : col + 1);
+      line = line + (src[i] == '\n');
+    }
+    snprintf(buf, len, "%s@%d:%d", label, line, col);
+  }
+}
+
+/* Commas are left out of the stacks, so that statements are siblings */
+static void glitch_profile_folded(struct glitch *g, struct expr *e,
+                                  const char *src, FILE *out, char *stack,
+                                  size_t len, size_t cap) {
+  char frame[64];
+  size_t n = 0;
+  if (e->prof.calls == 0) {
+    return;
+  }
+  glitch_profile_frame(g, e, src, frame, sizeof(frame));
+  if (e->type != OP_COMMA && len + strlen(frame) + 1 < cap) {
+    n = strlen(frame) + (len > 0);
+    snprintf(stack + len, cap - len, "%s%s", (len > 0 ? ";" : ""), frame);
+    len = len + n;
+  }
+  unsigned long long self = glitch_profile_self(e);
+  if (self > 0 && len > 0) {
+    fprintf(out, "%s %llu\n", stack, self);
+  }
+  vec_expr_t *args = glitch_profile_args(e);
+  for (int i = 0; args != NULL && i < vec_len(args); i++) {
+    glitch_profile_folded(g, &vec_nth(args, i), src, out, stack, len, cap);
+  }
+  stack[len - n] = '\0';
+}
+
+static void glitch_profile_table(struct glitch *g, struct expr *e,
+                                 const char *src, FILE *out, int depth,
+                                 struct glitch_profile_func *funcs, int *n) {
+  char frame[64];
+  if (e->prof.calls == 0) {
+    return;
+  }
+  unsigned long long self = glitch_profile_self(e);
+  if (e->type != OP_COMMA) {
+    glitch_profile_frame(g, e, src, frame, sizeof(frame));
+    fprintf(out, "%12lu %16llu %16llu %*s%s\n", e->prof.calls, e->prof.cycles,
+            self, depth * 2, "", frame);
+    depth++;
+  }
+  if (e->type == OP_FUNC) {
+    const char *name = glitch_profile_label(g, e);
+    int i = 0;
+    while (i < *n && strcmp(funcs[i].name, name) != 0) {
+      i++;
+    }
+    if (i == *n && *n < MAX_FUNCS) {
+      struct glitch_profile_func f = {name, 0, 0};
+      funcs[(*n)++] = f;
+    }
+    if (i < *n) {
+      funcs[i].calls = funcs[i].calls + e->prof.calls;
+      funcs[i].self = funcs[i].self + self;
+    }
+  }
+  vec_expr_t *args = glitch_profile_args(e);
+  for (int i = 0; args != NULL && i < vec_len(args); i++) {
+    glitch_profile_table(g, &vec_nth(args, i), src, out, depth, funcs, n);
+  }
+}
+#endif
+
+int glitch_profile(struct glitch *g, const char *src, FILE *out,
+                   enum glitch_profile format) {
+#ifdef EXPR_PROFILE
+  if (g->e == NULL) {
+    return -1;
+  }
+  glitch_pool_join(g);
+  if (format == GLITCH_PROFILE_FOLDED) {
+    char stack[4096] = {0};
+    glitch_profile_folded(g, g->e, src, out, stack, 0, sizeof(stack));
+  } else {
+    struct glitch_profile_func funcs[MAX_FUNCS];
+    int n = 0;
+    fprintf(out, "%12s %16s %16s %s\n", "calls", "cycles", "self", "node");
+    glitch_profile_table(g, g->e, src, out, 0, funcs, &n);
+    fprintf(out, "\n%12s %16s %16s %s\n", "calls", "", "self", "function");
+    for (int i = 0; i < n; i++) {
+      fprintf(out, "%12lu %16s %16llu %s\n", funcs[i].calls, "", funcs[i].self,
+              funcs[i].name);
+    }
+  }
+  return 0;
+#else
+  (void)glitch_profile_label;
+  (void)g;
+  (void)src;
+  (void)out;
+  (void)format;
+  return -1;
+#endif
+}
+
+/*
+ * Snapshot: the running state of a program is held by the contexts of its
+ * functions, written in the order of a depth-first walk of the expression
+ * tree after the frame counter, variables, voices and pending MIDI messages
+ * of the instance. Contexts that own buffers or copies of the program are
+ * written field by field, others as they are. The same walk reads a
+ * snapshot back, so it loads into any program of the same shape, e.g. the
+ * same text compiled again by another instance.
+ */
+#define GLITCH_SNAPSHOT_MAGIC 0x324e5347 /* "GSN2" */
+
+struct glitch_snap {
+  unsigned char *out;      /* Snapshot being written, NULL when restoring */
+  const unsigned char *in; /* Snapshot being restored */
+  size_t len;
+  size_t pos;
+  int err;
+};
+
+/* Writes n bytes from p, or reads them into p when restoring */
+static void glitch_snap_io(struct glitch_snap *s, void *p, size_t n) {
+  if (s->in != NULL) {
+    if (s->err || n > s->len - s->pos) {
+      s->err = 1;
+      return;
+    }
+    memcpy(p, s->in + s->pos, n);
+  } else if (s->out != NULL && s->pos + n <= s->len) {
+    memcpy(s->out + s->pos, p, n);
+  }
+  s->pos = s->pos + n;
+}
+
+/* Context except the n bytes at the offset, which hold pointers */
+static void glitch_snap_skip(struct glitch_snap *s, void *context, size_t size,
+                             size_t off, size_t n) {
+  glitch_snap_io(s, context, off);
+  glitch_snap_io(s, (char *)context + off + n, size - off - n);
+}
+
+/* Buffer of n floats, resized when restoring */
+static void glitch_snap_buf(struct glitch_snap *s, float **buf, size_t *n) {
+  size_t len = *n;
+  glitch_snap_io(s, &len, sizeof(len));
+  if (s->in != NULL && !s->err && len != *n) {
+    float *p = (len > 0 ? realloc(*buf, len * sizeof(float)) : NULL);
+    if (len > 0 && p == NULL) {
+      s->err = 1;
+      return;
+    }
+    if (len == 0) {
+      free(*buf);
+    }
+    *buf = p;
+    *n = len;
+  }
+  glitch_snap_io(s, *buf, len * sizeof(float));
+}
+
+/* Init flag of a lazily initialised context, the rest of which is only
+ * written once it is initialised. A context restored from an earlier state
+ * is cleared as if it was never evaluated. */
+static int glitch_snap_init(struct glitch_snap *s, struct expr *e, int *init) {
+  struct expr_func *f = e->param.func.f;
+  int x = *init;
+  glitch_snap_io(s, &x, sizeof(x));
+  if (s->in != NULL && !s->err && !x && *init) {
+    f->cleanup(f, e->param.func.context);
+    memset(e->param.func.context, 0, f->ctxsz);
+  }
+  return (s->err ? 0 : x);
+}
+
+static void glitch_snap_expr(struct glitch_snap *s, struct expr *e);
+
+static void glitch_snap_func(struct glitch_snap *s, struct expr *e) {
+  struct expr_func *f = e->param.func.f;
+  vec_expr_t *args = &e->param.func.args;
+  void *context = e->param.func.context;
+  if (f->f == lib_seq) {
+    struct seq_context *seq = (struct seq_context *)context;
+    if (!glitch_snap_init(s, e, &seq->init)) {
+      return;
+    } else if (!seq->init) {
+      seq_init(seq, args);
+    }
+    glitch_snap_io(s, &seq->offset, sizeof(seq->offset));
+    glitch_snap_io(s, &seq->t, sizeof(seq->t));
+    glitch_snap_io(s, &seq->duration, sizeof(seq->duration));
+    glitch_snap_io(s, &seq->step, sizeof(seq->step));
+    int n = vec_len(&seq->steps);
+    glitch_snap_io(s, &n, sizeof(n));
+    if (n != vec_len(&seq->steps)) {
+      s->err = 1;
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      struct seq_step *step = &vec_nth(&seq->steps, i);
+      glitch_snap_io(s, &step->start, sizeof(step->start));
+      glitch_snap_io(s, &step->end, sizeof(step->end));
+      glitch_snap_io(s, &step->value, sizeof(step->value));
+    }
+  } else if (f->f == lib_mix) {
+    struct mix_context *mix = (struct mix_context *)context;
+    if (!glitch_snap_init(s, e, &mix->init)) {
+      return;
+    } else if (!mix->init) {
+      for (int i = 0; i < vec_len(args); i++) {
+        vec_push(&mix->values, 0);
+      }
+      mix->init = 1;
+    }
+    int n = vec_len(&mix->values);
+    glitch_snap_io(s, &n, sizeof(n));
+    if (n != vec_len(&mix->values)) {
+      s->err = 1;
+      return;
+    }
+    glitch_snap_io(s, mix->values.buf, n * sizeof(float));
+  } else if (f->f == lib_each) {
+    struct each_context *each = (struct each_context *)context;
+    if (!glitch_snap_init(s, e, &each->init)) {
+      return;
+    } else if (!each->init) {
+      each_init(each, args);
+    }
+    int n = vec_len(&each->args);
+    glitch_snap_io(s, &n, sizeof(n));
+    if (n != vec_len(&each->args)) {
+      s->err = 1;
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      glitch_snap_expr(s, &vec_nth(&each->args, i));
+    }
+  } else if (f->f == lib_poly) {
+    struct poly_context *poly = (struct poly_context *)context;
+    for (int i = 0; i < GLITCH_MAX_VOICES && !s->err; i++) {
+      unsigned char copy = (poly->voices[i] != NULL);
+      glitch_snap_io(s, &poly->age[i], sizeof(poly->age[i]));
+      glitch_snap_io(s, &copy, sizeof(copy));
+      if (s->in != NULL && !s->err && copy && poly->voices[i] == NULL) {
+        poly->voices[i] = (struct expr *)calloc(1, sizeof(struct expr));
+        if (poly->voices[i] == NULL) {
+          s->err = 1;
+          return;
+        }
+        expr_copy(poly->voices[i], &vec_nth(args, 1));
+      }
+      if (copy) {
+        glitch_snap_expr(s, poly->voices[i]);
+      }
+    }
+  } else if (f->f == lib_delay) {
+    libglitch_delay_t *delay = (libglitch_delay_t *)context;
+    glitch_snap_io(s, &delay->pos, sizeof(delay->pos));
+    glitch_snap_buf(s, &delay->buf, &delay->n);
+  } else if (f->f == lib_pluck) {
+    libglitch_pluck_t *pluck = (libglitch_pluck_t *)context;
+    size_t n = (pluck->sample != NULL ? pluck->n : 0);
+    glitch_snap_io(s, &pluck->init, sizeof(pluck->init));
+    glitch_snap_io(s, &pluck->t, sizeof(pluck->t));
+    glitch_snap_io(s, &pluck->rng, sizeof(pluck->rng));
+    glitch_snap_buf(s, &pluck->sample, &n);
+    pluck->n = (int)n;
+  } else if (f == &glitch_sleep_func) {
+    struct sleep_context *sl = (struct sleep_context *)context;
+    if (!glitch_snap_init(s, e, &sl->init)) {
+      return;
+    } else if (!sl->init) {
+      glitch_sleep_init(sl, &vec_nth(args, 0));
+    }
+    if (sl->values == NULL || sl->snapshot == NULL) {
+      s->err = 1;
+      return;
+    }
+    glitch_snap_io(s, &sl->asleep, sizeof(sl->asleep));
+    glitch_snap_io(s, &sl->armed, sizeof(sl->armed));
+    glitch_snap_io(s, &sl->backoff, sizeof(sl->backoff));
+    glitch_snap_io(s, &sl->value, sizeof(sl->value));
+    glitch_snap_io(s, sl->values, vec_len(&sl->vars) * sizeof(float));
+    glitch_snap_io(s, sl->snapshot, glitch_sleep_size(sl));
+  } else if (f == &glitch_tick_func) {
+    /* Pointers to the variables are collected by the instance */
+    struct tick_context *tc = (struct tick_context *)context;
+    if (s->in != NULL && !tc->init) {
+      tc->init = 1;
+      glitch_pure_collect(&vec_nth(args, 0), tc->vars, &tc->nvars);
+    }
+    glitch_snap_skip(s, context, f->ctxsz, offsetof(struct tick_context, vars),
+                     sizeof(tc->vars));
+  } else if (f == &glitch_control_func) {
+    struct control_context *cc = (struct control_context *)context;
+    if (s->in != NULL && !cc->init) {
+      cc->init = 1;
+      glitch_pure_collect(&vec_nth(args, 0), cc->vars, &cc->nvars);
+    }
+    glitch_snap_skip(s, context, f->ctxsz,
+                     offsetof(struct control_context, vars), sizeof(cc->vars));
+  } else if (f->cleanup != NULL || f == &glitch_feed_func ||
+             f == &glitch_pull_func) {
+    /* Tracks and stages rendered by worker threads are not supported */
+    s->err = 1;
+  } else {
+    glitch_snap_io(s, context, f->ctxsz);
+  }
+}
+
+static void glitch_snap_expr(struct glitch_snap *s, struct expr *e) {
+  vec_expr_t *args;
+  if (s->err || e->type == OP_CONST || e->type == OP_VAR) {
+    return;
+  } else if (e->type == OP_FUNC) {
+    if (e->param.func.f->ctxsz > 0) {
+      glitch_snap_func(s, e);
+    }
+    args = &e->param.func.args;
+  } else {
+    args = &e->param.op.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    glitch_snap_expr(s, &vec_nth(args, i));
+  }
+}
+
+/* Hashes node types, functions and the number of arguments of the tree */
+static uint64_t glitch_snap_shape(struct expr *e, uint64_t h) {
+  vec_expr_t *args = NULL;
+  h = (h ^ (uint64_t)e->type) * 0x100000001b3ULL;
+  if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    for (const char *c = f->name; *c != '\0'; c++) {
+      h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+    }
+    h = (h ^ f->ctxsz) * 0x100000001b3ULL;
+    args = &e->param.func.args;
+  } else if (e->type != OP_CONST && e->type != OP_VAR) {
+    args = &e->param.op.args;
+  }
+  if (args != NULL) {
+    h = (h ^ (uint64_t)vec_len(args)) * 0x100000001b3ULL;
+    for (int i = 0; i < vec_len(args); i++) {
+      h = glitch_snap_shape(&vec_nth(args, i), h);
+    }
+  }
+  return h;
+}
+
+/* Stores a variable by name, a zero length name stands for NULL */
+static void glitch_snap_var(struct glitch_snap *s, struct expr_var_list *vars,
+                            struct expr_var **v) {
+  size_t len = (*v != NULL ? strlen((*v)->name) : 0);
+  glitch_snap_io(s, &len, sizeof(len));
+  if (s->in == NULL) {
+    glitch_snap_io(s, (*v != NULL ? (*v)->name : ""), len);
+    return;
+  }
+  if (s->err || len > s->len - s->pos) {
+    s->err = 1;
+    return;
+  }
+  *v = (len > 0 ? expr_var(vars, (const char *)s->in + s->pos, len) : NULL);
+  s->pos = s->pos + len;
+}
+
+/* Everything but the program: frame counter, variables, voices, events */
+static void glitch_snap_engine(struct glitch_snap *s, struct glitch *g) {
+  glitch_snap_io(s, &g->frame, sizeof(g->frame));
+  glitch_snap_io(s, &g->bpm_start, sizeof(g->bpm_start));
+  glitch_snap_io(s, &g->last_bpm, sizeof(g->last_bpm));
+  glitch_snap_io(s, &g->last_sample, sizeof(g->last_sample));
+  glitch_snap_io(s, g->last_frame, sizeof(g->last_frame));
+  glitch_snap_io(s, g->dither, sizeof(g->dither));
+  glitch_snap_io(s, &g->seed, sizeof(g->seed));
+  glitch_snap_io(s, &g->streams, sizeof(g->streams));
+  glitch_snap_io(s, &g->voices, sizeof(g->voices));
+  glitch_snap_io(s, &g->nevents, sizeof(g->nevents));
+  if (g->nevents < 0 || g->nevents > GLITCH_MAX_EVENTS) {
+    s->err = 1;
+    return;
+  }
+  for (int i = 0; i < g->nevents; i++) {
+    struct glitch_event *ev = &g->events[i];
+    glitch_snap_io(s, &ev->frame, sizeof(ev->frame));
+    glitch_snap_io(s, &ev->value, sizeof(ev->value));
+    glitch_snap_io(s, &ev->cmd, sizeof(ev->cmd));
+    glitch_snap_io(s, &ev->a, sizeof(ev->a));
+    glitch_snap_io(s, &ev->b, sizeof(ev->b));
+    glitch_snap_var(s, &g->vars, &ev->var);
+  }
+
+  int n = 0;
+  for (struct expr_var *v = g->vars.head; v != NULL; v = v->next) {
+    n++;
+  }
+  glitch_snap_io(s, &n, sizeof(n));
+  if (s->in == NULL) {
+    for (struct expr_var *v = g->vars.head; v != NULL; v = v->next) {
+      glitch_snap_var(s, &g->vars, &v);
+      glitch_snap_io(s, &v->value, sizeof(v->value));
+    }
+    return;
+  }
+  for (int i = 0; i < n && !s->err; i++) {
+    struct expr_var *v = NULL;
+    glitch_snap_var(s, &g->vars, &v);
+    float value = 0;
+    glitch_snap_io(s, &value, sizeof(value));
+    if (v != NULL) {
+      v->value = value;
     }
   }
 }
+
+long glitch_snapshot(struct glitch *g, void *buf, size_t len) {
+  struct glitch_snap s = {(unsigned char *)buf, NULL, len, 0, 0};
+  uint32_t magic = GLITCH_SNAPSHOT_MAGIC;
+  if (g->e == NULL) {
+    return -1;
+  }
+  glitch_pool_join(g);
+  uint64_t shape = glitch_snap_shape(g->e, 0xcbf29ce484222325ULL);
+  glitch_snap_io(&s, &magic, sizeof(magic));
+  glitch_snap_io(&s, &shape, sizeof(shape));
+  glitch_snap_engine(&s, g);
+  glitch_snap_expr(&s, g->e);
+  return (s.err ? -1 : (long)s.pos);
+}
+
+/* Loads a snapshot after its header, returns non-zero if it is damaged */
+static int glitch_snap_load(struct glitch *g, const void *buf, size_t len) {
+  struct glitch_snap s = {NULL, (const unsigned char *)buf, len, 0, 0};
+  s.pos = sizeof(uint32_t) + sizeof(uint64_t);
+  glitch_snap_engine(&s, g);
+  glitch_snap_expr(&s, g->e);
+  return (s.err || s.pos != len);
+}
+
+int glitch_restore(struct glitch *g, const void *buf, size_t len) {
+  struct glitch_snap s = {NULL, (const unsigned char *)buf, len, 0, 0};
+  uint32_t magic = 0;
+  uint64_t shape = 0;
+  if (g->e == NULL) {
+    return -1;
+  }
+  glitch_snap_io(&s, &magic, sizeof(magic));
+  glitch_snap_io(&s, &shape, sizeof(shape));
+  if (s.err || magic != GLITCH_SNAPSHOT_MAGIC ||
+      shape != glitch_snap_shape(g->e, 0xcbf29ce484222325ULL)) {
+    return -1;
+  }
+  /* Damage past the header is only found while loading, so the current
+   * state is saved first and loaded back if the snapshot fails */
+  long n = glitch_snapshot(g, NULL, 0);
+  unsigned char *backup = (n > 0 ? (unsigned char *)malloc(n) : NULL);
+  if (backup == NULL || glitch_snapshot(g, backup, n) != n) {
+    free(backup);
+    return -1;
+  }
+  long frame = g->frame;
+  int err = glitch_snap_load(g, buf, len);
+  if (err) {
+    glitch_snap_load(g, backup, n);
+  }
+  free(backup);
+  /* Recording of a periodic program starts over from the restored frame */
+  if (g->cache != NULL) {
+    g->cache->sample_rate = 0;
+  }
+  /* Logged at the frame it was called at, later records follow the new one */
+  if (!err && g->recorder != NULL) {
+    glitch_record_flush(g->recorder);
+    glitch_record_op(g->recorder, GLITCH_RECORD_RESTORE, frame);
+    glitch_record_bytes(g->recorder->out, (const char *)buf, len);
+  }
+  return (err ? -1 : 0);
+}
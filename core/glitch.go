@@ -2,7 +2,7 @@ package core
 
 /*
 #cgo CFLAGS: -std=c99 -g -Wall -Wextra -pedantic -Wno-unused-parameter -Wno-unused-function
-#cgo LDFLAGS: -lm -g
+#cgo LDFLAGS: -lm -lpthread -g
 
 #include <stdlib.h>
 #include "glitch.h"
@@ -16,6 +16,7 @@ static void setSampleLoader() {
 import "C"
 import (
 	"errors"
+	"os"
 	"sync"
 	"time"
 	"unsafe"
@@ -26,7 +27,11 @@ type SampleLoader interface {
 }
 
 var (
-	Loader SampleLoader
+	Loader     SampleLoader
+	sampleRate int
+	// registry guards engine-wide state: default sample rate and the table of
+	// functions that samples are added to
+	registry sync.RWMutex
 )
 
 func init() {
@@ -43,16 +48,23 @@ func goSampleLoader(name *C.char, variant, frame C.int) C.float {
 }
 
 func Init(sr int, seed uint64) {
+	registry.Lock()
+	defer registry.Unlock()
+	sampleRate = sr
 	C.glitch_init(C.int(sr), C.ulonglong(seed))
 }
 
 func AddSample(name string) bool {
+	registry.Lock()
+	defer registry.Unlock()
 	p := C.CString(name)
 	defer C.free(unsafe.Pointer(p))
 	return C.glitch_add_sample(p) == 0
 }
 
 func RemoveSample(name string) bool {
+	registry.Lock()
+	defer registry.Unlock()
 	p := C.CString(name)
 	defer C.free(unsafe.Pointer(p))
 	return C.glitch_remove_sample(p) == 0
@@ -61,18 +73,85 @@ func RemoveSample(name string) bool {
 type Glitch interface {
 	Compile(expr string) error
 	MIDI(msg []byte)
+	MIDIAt(msg []byte, t time.Time) error
 	Fill(buf []float32, frames int, channels int)
+	FillAhead(buf []float32, frames, channels, ahead int)
+	FillInt16(buf []int16, frames int, channels int)
+	FillInt24(buf []byte, frames int, channels int)
+	FillInt32(buf []int32, frames int, channels int)
 	Set(name string, value float32)
+	SetAt(name string, value float32, t time.Time) error
 	Get(name string) float32
+	SetVoices(n int, steal VoiceSteal)
+	SetSampleRate(sr int)
+	SetTick(mode TickMode)
+	SetControl(frames int)
+	SetThreads(n int)
+	SetPipeline(on bool)
+	Latency() int
+	Load() Load
+	ResetLoad()
+	Xrun(underruns, overruns int)
+	Profile(path, src string, table bool) error
+	Record(path string) error
+	Snapshot() ([]byte, error)
+	Restore(state []byte) error
+	Seed(seed uint64)
 	Reset()
 	Destroy()
 }
 
+// VoiceSteal is a policy of reusing voices when all of them are playing
+type VoiceSteal int
+
+const (
+	StealNone     VoiceSteal = C.GLITCH_STEAL_NONE
+	StealOldest   VoiceSteal = C.GLITCH_STEAL_OLDEST
+	StealQuietest VoiceSteal = C.GLITCH_STEAL_QUIETEST
+)
+
+// TickMode selects how subtrees that only change with t are evaluated
+type TickMode int
+
+const (
+	TickHold   TickMode = C.GLITCH_TICK_HOLD
+	TickLinear TickMode = C.GLITCH_TICK_LINEAR
+	TickOff    TickMode = C.GLITCH_TICK_OFF
+)
+
+// Load is the render time of fills relative to the duration of the frames they
+// render, where 1 is real time, and the xruns reported by the host
+type Load struct {
+	Last      float32 `json:"last"`
+	Average   float32 `json:"average"` // Moving average over about a second
+	Peak      float32 `json:"peak"`
+	Fills     int     `json:"fills"`
+	Late      int     `json:"late"` // Fills slower than real time
+	Underruns int     `json:"underruns"`
+	Overruns  int     `json:"overruns"`
+}
+
 var ErrSyntax = errors.New("glitch syntax error")
 
+// ErrNoProfile is returned by Profile unless the core is built with
+// CGO_CFLAGS=-DEXPR_PROFILE
+var ErrNoProfile = errors.New("glitch is built without EXPR_PROFILE")
+
+// ErrMIDIQueue is returned by MIDIAt if a message is dropped because too many
+// are pending, note-offs are never dropped
+var ErrMIDIQueue = errors.New("glitch MIDI queue is full")
+
+// ErrSetQueue is returned by SetAt if a change is dropped because too many
+// events are pending
+var ErrSetQueue = errors.New("glitch event queue is full")
+
 type glitch struct {
 	sync.Mutex
-	g *C.struct_glitch
+	g          *C.struct_glitch
+	fillTime   time.Time
+	ahead      int
+	sampleRate int
+	record     *C.FILE
 }
 
 func NewGlitch() Glitch {
@@ -87,6 +166,9 @@ func (g *glitch) Destroy() {
 	g.Lock()
 	defer g.Unlock()
 	C.glitch_destroy(g.g)
+	if g.record != nil {
+		C.fclose(g.record)
+	}
 }
 
 func (g *glitch) Reset() {
@@ -96,6 +178,8 @@ func (g *glitch) Reset() {
 }
 
 func (g *glitch) Compile(expr string) error {
+	registry.RLock()
+	defer registry.RUnlock()
 	g.Lock()
 	defer g.Unlock()
 	p := C.CString(expr)
@@ -108,11 +192,59 @@ func (g *glitch) Compile(expr string) error {
 }
 
 func (g *glitch) Fill(buf []float32, frames, channels int) {
+	registry.RLock()
+	defer registry.RUnlock()
 	g.Lock()
 	defer g.Unlock()
+	g.fillTime = time.Now()
+	g.ahead = 0
 	C.glitch_fill(g.g, (*C.float)(&buf[0]), C.size_t(frames), C.size_t(channels))
 }
 
+// FillAhead fills the buffer like Fill, where the buffer is played the given
+// number of frames later, e.g. when it is rendered into a ring. Messages given
+// to MIDIAt and changes given to SetAt until the next fill are delayed by as
+// many frames.
+func (g *glitch) FillAhead(buf []float32, frames, channels, ahead int) {
+	registry.RLock()
+	defer registry.RUnlock()
+	g.Lock()
+	defer g.Unlock()
+	g.fillTime = time.Now()
+	g.ahead = ahead
+	C.glitch_fill(g.g, (*C.float)(&buf[0]), C.size_t(frames), C.size_t(channels))
+}
+
+func (g *glitch) FillInt16(buf []int16, frames, channels int) {
+	registry.RLock()
+	defer registry.RUnlock()
+	g.Lock()
+	defer g.Unlock()
+	g.fillTime = time.Now()
+	g.ahead = 0
+	C.glitch_fill_s16(g.g, (*C.int16_t)(&buf[0]), C.size_t(frames), C.size_t(channels))
+}
+
+func (g *glitch) FillInt24(buf []byte, frames, channels int) {
+	registry.RLock()
+	defer registry.RUnlock()
+	g.Lock()
+	defer g.Unlock()
+	g.fillTime = time.Now()
+	g.ahead = 0
+	C.glitch_fill_s24(g.g, (*C.uchar)(&buf[0]), C.size_t(frames), C.size_t(channels))
+}
+
+func (g *glitch) FillInt32(buf []int32, frames, channels int) {
+	registry.RLock()
+	defer registry.RUnlock()
+	g.Lock()
+	defer g.Unlock()
+	g.fillTime = time.Now()
+	g.ahead = 0
+	C.glitch_fill_s32(g.g, (*C.int32_t)(&buf[0]), C.size_t(frames), C.size_t(channels))
+}
+
 func (g *glitch) MIDI(msg []byte) {
 	if len(msg) == 3 {
 		g.Lock()
@@ -121,6 +253,226 @@ func (g *glitch) MIDI(msg []byte) {
 	}
 }
 
+// MIDIAt schedules a MIDI message received at time t. Messages are delayed by
+// one buffer, so that the time between them is kept to a frame.
+func (g *glitch) MIDIAt(msg []byte, t time.Time) error {
+	if len(msg) == 3 {
+		registry.RLock()
+		defer registry.RUnlock()
+		g.Lock()
+		defer g.Unlock()
+		frame := g.frameAt(t)
+		if C.glitch_midi_at(g.g, frame, C.uchar(msg[0]), C.uchar(msg[1]), C.uchar(msg[2])) != 0 {
+			return ErrMIDIQueue
+		}
+	}
+	return nil
+}
+
+// frameAt returns the frame at which an event received at time t is played,
+// the caller must hold the lock
+func (g *glitch) frameAt(t time.Time) C.long {
+	frame := int64(g.g.frame) + int64(g.ahead)
+	if d := t.Sub(g.fillTime); !g.fillTime.IsZero() && d > 0 {
+		sr := g.sampleRate
+		if sr == 0 {
+			sr = sampleRate
+		}
+		frame = frame + int64(d.Seconds()*float64(sr))
+	}
+	return C.long(frame)
+}
+
+func (g *glitch) SetVoices(n int, steal VoiceSteal) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_set_voices(g.g, C.int(n), C.enum_glitch_steal(steal))
+}
+
+// SetSampleRate changes the rate of this instance, zero resets it to the rate
+// given to Init
+func (g *glitch) SetSampleRate(sr int) {
+	g.Lock()
+	defer g.Unlock()
+	g.sampleRate = sr
+	C.glitch_set_sample_rate(g.g, C.int(sr))
+}
+
+// SetTick changes how subtrees that only change with t are evaluated: once per
+// tick and held (the default), once per tick and interpolated, or every frame
+func (g *glitch) SetTick(mode TickMode) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_set_tick(g.g, C.enum_glitch_tick(mode))
+}
+
+// SetControl changes how arguments that only change with variables and
+// sequencers are evaluated: on change and held (0, the default), on change and
+// ramped over the given number of frames, or every frame (negative)
+func (g *glitch) SetControl(frames int) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_set_control(g.g, C.int(frames))
+}
+
+// SetThreads renders independent tracks of the final mix() of programs
+// compiled after the call on n worker threads, or on the calling goroutine if
+// n is zero (the default)
+func (g *glitch) SetThreads(n int) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_set_threads(g.g, C.int(n))
+}
+
+// SetPipeline renders inputs of delay() and filters of programs compiled after
+// the call a block ahead on the worker threads instead of tracks of mix().
+// Variables read by these inputs are then seen Latency() frames late.
+func (g *glitch) SetPipeline(on bool) {
+	g.Lock()
+	defer g.Unlock()
+	v := 0
+	if on {
+		v = 1
+	}
+	C.glitch_set_pipeline(g.g, C.int(v))
+}
+
+// Latency returns the number of frames by which pipeline stages of the current
+// program see variables late, or zero without them
+func (g *glitch) Latency() int {
+	g.Lock()
+	defer g.Unlock()
+	return int(C.glitch_latency(g.g))
+}
+
+// Load returns the load of the fills made so far
+func (g *glitch) Load() Load {
+	g.Lock()
+	defer g.Unlock()
+	l := C.glitch_get_load(g.g)
+	return Load{
+		Last:      float32(l.last),
+		Average:   float32(l.average),
+		Peak:      float32(l.peak),
+		Fills:     int(l.fills),
+		Late:      int(l.late),
+		Underruns: int(l.underruns),
+		Overruns:  int(l.overruns),
+	}
+}
+
+// ResetLoad clears the peak load and the counters
+func (g *glitch) ResetLoad() {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_reset_load(g.g)
+}
+
+// Xrun counts underruns and overruns of the device the instance plays on
+func (g *glitch) Xrun(underruns, overruns int) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_xrun(g.g, C.int(underruns), C.int(overruns))
+}
+
+// Profile writes the cycles spent in each node of the current program to a
+// file, as folded stacks for flamegraph.pl or as a table. Nodes are labelled
+// with their line and column in src, the text the program was compiled from.
+func (g *glitch) Profile(path, src string, table bool) error {
+	p := C.CString(path)
+	defer C.free(unsafe.Pointer(p))
+	mode := C.CString("w")
+	defer C.free(unsafe.Pointer(mode))
+	s := C.CString(src)
+	defer C.free(unsafe.Pointer(s))
+	format := C.enum_glitch_profile(C.GLITCH_PROFILE_FOLDED)
+	if table {
+		format = C.GLITCH_PROFILE_TABLE
+	}
+	f, err := C.fopen(p, mode)
+	if f == nil {
+		return err
+	}
+	g.Lock()
+	r := C.glitch_profile(g.g, s, f, format)
+	g.Unlock()
+	C.fclose(f)
+	if r != 0 {
+		os.Remove(path)
+		return ErrNoProfile
+	}
+	return nil
+}
+
+// Record logs compiles, variables, MIDI messages and fills of the instance to
+// a file, to be replayed offline by glitch_replay. An empty path stops
+// recording. Start recording before the first compile.
+func (g *glitch) Record(path string) error {
+	var f *C.FILE
+	if path != "" {
+		p := C.CString(path)
+		defer C.free(unsafe.Pointer(p))
+		mode := C.CString("wb")
+		defer C.free(unsafe.Pointer(mode))
+		var err error
+		if f, err = C.fopen(p, mode); f == nil {
+			return err
+		}
+	}
+	g.Lock()
+	r := C.glitch_record(g.g, f)
+	if g.record != nil {
+		C.fclose(g.record)
+	}
+	g.record = f
+	g.Unlock()
+	if r != 0 {
+		return errors.New("glitch: can not record to " + path)
+	}
+	return nil
+}
+
+// ErrSnapshot is returned by Snapshot if the program state can not be saved,
+// and by Restore if it does not fit the program
+var ErrSnapshot = errors.New("glitch state does not fit the program")
+
+// Snapshot returns the running state of the current program, which Restore
+// loads into a program of the same shape, e.g. the same text compiled again
+func (g *glitch) Snapshot() ([]byte, error) {
+	g.Lock()
+	defer g.Unlock()
+	n := C.glitch_snapshot(g.g, nil, 0)
+	for n > 0 {
+		buf := make([]byte, int(n))
+		m := C.glitch_snapshot(g.g, unsafe.Pointer(&buf[0]), C.size_t(len(buf)))
+		if m == n {
+			return buf, nil
+		}
+		n = m
+	}
+	return nil, ErrSnapshot
+}
+
+func (g *glitch) Restore(state []byte) error {
+	if len(state) == 0 {
+		return ErrSnapshot
+	}
+	g.Lock()
+	defer g.Unlock()
+	if C.glitch_restore(g.g, unsafe.Pointer(&state[0]), C.size_t(len(state))) != 0 {
+		return ErrSnapshot
+	}
+	return nil
+}
+
+// Seed sets the seed of random streams started after the call, instances with
+// the same seed and program render the same output
+func (g *glitch) Seed(seed uint64) {
+	g.Lock()
+	defer g.Unlock()
+	C.glitch_seed(g.g, C.ulonglong(seed))
+}
+
 func (g *glitch) Set(name string, value float32) {
 	p := C.CString(name)
 	defer C.free(unsafe.Pointer(p))
@@ -129,6 +481,21 @@ func (g *glitch) Set(name string, value float32) {
 	C.glitch_set(g.g, p, C.float(value))
 }
 
+// SetAt changes a variable at time t, delayed like the messages given to
+// MIDIAt
+func (g *glitch) SetAt(name string, value float32, t time.Time) error {
+	p := C.CString(name)
+	defer C.free(unsafe.Pointer(p))
+	registry.RLock()
+	defer registry.RUnlock()
+	g.Lock()
+	defer g.Unlock()
+	if C.glitch_set_at(g.g, g.frameAt(t), p, C.float(value)) != 0 {
+		return ErrSetQueue
+	}
+	return nil
+}
+
 func (g *glitch) Get(name string) float32 {
 	p := C.CString(name)
 	defer C.free(unsafe.Pointer(p))
@@ -5,11 +5,72 @@
 extern "C" {
 #endif
 #include "expr.h"
+#include <stdint.h>
 
-#define MAX_POLYPHONY 9
+#define MAX_POLYPHONY 9 /* Voices exposed as k0..k8, g0..g8, v0..v8 */
+#define GLITCH_MAX_VOICES 128
+#define GLITCH_MAX_CHANNELS 8
+#define GLITCH_MAX_EVENTS 256
+
+/* Voice stealing policy when a note is pressed and all voices are in use */
+enum glitch_steal {
+  GLITCH_STEAL_NONE,     /* New note is ignored */
+  GLITCH_STEAL_OLDEST,   /* Voice with the earliest note-on is reused */
+  GLITCH_STEAL_QUIETEST, /* Voice with the lowest velocity is reused */
+};
+
+/* Voice slots in SoA layout. A voice is active from note-on until its
+ * velocity fades out after note-off. */
+struct glitch_voices {
+  int n;
+  enum glitch_steal steal;
+  unsigned long serial; /* Note-on counter */
+  uint32_t active[GLITCH_MAX_VOICES / 32];
+  float key[GLITCH_MAX_VOICES];
+  float gate[GLITCH_MAX_VOICES];
+  float vel[GLITCH_MAX_VOICES];
+  unsigned long age[GLITCH_MAX_VOICES]; /* Serial of the last note-on */
+  int released;                         /* Some voice is fading out */
+};
+
+/* Evaluation of subtrees that only change with t, which advances at 8 kHz */
+enum glitch_tick {
+  GLITCH_TICK_HOLD,   /* Evaluated once per tick and held */
+  GLITCH_TICK_LINEAR, /* Evaluated once per tick and interpolated */
+  GLITCH_TICK_OFF,    /* Evaluated every frame */
+};
+
+struct glitch_cache;
+struct glitch_pool;
+struct glitch_recorder;
+
+/* MIDI message scheduled at a frame */
+struct glitch_event {
+  long frame;
+  struct expr_var *var; /* Variable to set, NULL for a MIDI message */
+  float value;
+  unsigned char cmd;
+  unsigned char a;
+  unsigned char b;
+};
+
+/* Render time of fill calls relative to the duration of the frames they
+ * render, where 1 is real time */
+struct glitch_load {
+  float last;              /* Load of the last fill */
+  float average;           /* Moving average over about a second */
+  float peak;              /* Highest load since glitch_reset_load */
+  unsigned long fills;     /* Fill calls measured */
+  unsigned long late;      /* Fills slower than real time */
+  unsigned long underruns; /* Reported by the host with glitch_xrun */
+  unsigned long overruns;
+};
 
 struct glitch {
   int init;
+  int sample_rate; /* Zero if the rate given to glitch_init is used */
+  enum glitch_tick tick;
+  int control; /* Control argument ramp in frames, negative to disable */
   struct expr *e;
   struct expr *next_expr;
   struct expr_var_list vars;
@@ -21,15 +82,39 @@ struct glitch {
   struct expr_var *k[MAX_POLYPHONY];
   struct expr_var *g[MAX_POLYPHONY];
   struct expr_var *v[MAX_POLYPHONY];
+  struct glitch_voices voices;
 
   long frame;     /* Frame number since the beginning of the playback */
   long bpm_start; /* Frame number when tempo has been changed */
   float last_bpm;
   float last_sample;
+  float last_frame[GLITCH_MAX_CHANNELS]; /* Last non-NaN value per channel */
+  uint32_t dither[4];                    /* Dither noise generator state */
+  unsigned long long seed;               /* Seed of random streams */
+  unsigned long streams;                 /* Random streams seeded so far */
+
+  struct glitch_event events[GLITCH_MAX_EVENTS]; /* Pending, sorted by frame */
+  int nevents;
+
+  struct glitch_cache *cache;      /* Render cache of a periodic program */
+  struct glitch_cache *next_cache; /* Render cache of next_expr */
+  struct glitch_pool *pool;        /* Threads rendering tracks of mix() */
+  int pipeline;                    /* Pool renders effect inputs ahead */
+  struct glitch_load load;
+  struct glitch_recorder *recorder; /* Log of calls, see glitch_record */
+};
+
+/* Output of glitch_profile */
+enum glitch_profile {
+  GLITCH_PROFILE_FOLDED, /* Stacks of nodes and their own cycles */
+  GLITCH_PROFILE_TABLE,  /* Calls and cycles of each node and function */
 };
 
 typedef float (*glitch_loader_fn)(const char *name, int variant, int frame);
 
+/* Engine-wide setup. These must not be called concurrently with each other or
+ * with glitch_compile, instances are otherwise independent and may be
+ * rendered from different threads. */
 void glitch_init(int sample_rate, unsigned long long seed);
 void glitch_set_sample_loader(glitch_loader_fn fn);
 int glitch_add_sample(const char *name);
@@ -39,11 +124,94 @@ struct glitch *glitch_create();
 void glitch_destroy(struct glitch *g);
 int glitch_compile(struct glitch *g, const char *s, size_t len);
 void glitch_reset(struct glitch *g);
+void glitch_set_sample_rate(struct glitch *g, int sample_rate);
+void glitch_seed(struct glitch *g, unsigned long long seed);
+void glitch_set_tick(struct glitch *g, enum glitch_tick tick);
+void glitch_set_control(struct glitch *g, int frames);
+/* Renders independent tracks of the final mix() of programs compiled after
+ * the call on n worker threads, or on the calling thread if n is zero */
+void glitch_set_threads(struct glitch *g, int n);
+/* Renders inputs of delay() and filters of programs compiled after the call
+ * a block ahead on the worker threads instead of tracks of mix(). Variables
+ * read by these inputs are then seen glitch_latency frames late. */
+void glitch_set_pipeline(struct glitch *g, int on);
+int glitch_latency(struct glitch *g);
+/* Load of the fill calls made so far. Device underruns and overruns are not
+ * seen by the instance and are counted when the host reports them. */
+struct glitch_load glitch_get_load(struct glitch *g);
+void glitch_reset_load(struct glitch *g);
+void glitch_xrun(struct glitch *g, int underruns, int overruns);
+/* Writes the cycles spent in each node of the current program so far, as
+ * folded stacks for flamegraph.pl or as a table. Nodes are labelled with
+ * their line and column in src, the text the program was compiled from, or
+ * their offset if src is NULL. Tracks rendered by worker threads are not
+ * seen. Returns -1 unless glitch.c is built with EXPR_PROFILE. */
+int glitch_profile(struct glitch *g, const char *src, FILE *out,
+                   enum glitch_profile format);
+/* Trace of engine activity in the Chrome trace format, for chrome://tracing
+ * or ui.perfetto.dev. Each thread keeps its latest events in its own ring,
+ * recording takes no locks and does not allocate. Fill calls, compiles,
+ * program swaps, MIDI messages and worker jobs are recorded by the engine,
+ * hosts may add their own events. Timestamps are microseconds since tracing
+ * was first started, as returned by glitch_trace_now. */
+void glitch_trace_start();
+void glitch_trace_stop();
+void glitch_trace_thread(const char *name);
+void glitch_trace_begin(const char *name);
+void glitch_trace_end(const char *name);
+void glitch_trace_instant(const char *name, long arg);
+void glitch_trace_complete(const char *name, double ts, double dur);
+double glitch_trace_now();
+int glitch_trace_dump(FILE *out);
+/* Logs calls that change the instance to out with the frame they are made
+ * at: compiles, variables, MIDI messages, resets, settings and the sizes of
+ * fills. A NULL out stops recording, the file is not closed. Start recording
+ * before the first compile for the log to replay exactly. */
+int glitch_record(struct glitch *g, FILE *out);
+/* Makes the calls of a log on a fresh instance, as fast as it renders, and
+ * writes the rendered frames to out as raw floats if it is not NULL. If hash
+ * is not NULL the bytes of the frames are folded into it with FNV-1a. The
+ * program current at the end is profiled into profile as folded stacks, see
+ * glitch_profile. Returns the number of frames rendered, or -1 if the log is
+ * malformed or the instance has diverged from the recorded one. */
+long glitch_replay(struct glitch *g, FILE *in, FILE *out, FILE *profile,
+                   uint64_t *hash);
+/* Writes the running state of the current program to buf: contexts of its
+ * functions (oscillator phases, sequencer positions, envelopes, delay and
+ * pluck buffers), variables, voices, pending MIDI messages and the frame
+ * counter. Returns the size of the snapshot, which is only complete if it
+ * is not larger than len, or -1 if the program has no state that can be
+ * saved, e.g. tracks split across worker threads. */
+long glitch_snapshot(struct glitch *g, void *buf, size_t len);
+/* Loads a snapshot into the current program, which must have the same shape
+ * as the one it was taken from, e.g. the same text compiled again. Returns
+ * -1 if it does not, or if the snapshot is damaged, then the state is left
+ * as it was. */
+int glitch_restore(struct glitch *g, const void *buf, size_t len);
 void glitch_set(struct glitch *g, const char *name, float value);
 float glitch_get(struct glitch *g, const char *name);
 void glitch_midi(struct glitch *g, unsigned char cmd, unsigned char a,
                  unsigned char b);
+/* Schedules a MIDI message at a frame. Returns -1 if GLITCH_MAX_EVENTS are
+ * pending and the message is dropped, which is never the case for note-offs.
+ */
+int glitch_midi_at(struct glitch *g, long frame, unsigned char cmd,
+                   unsigned char a, unsigned char b);
+/* Schedules a variable change at a frame. Returns -1 if GLITCH_MAX_EVENTS
+ * are pending and the change is dropped. */
+int glitch_set_at(struct glitch *g, long frame, const char *name, float value);
+void glitch_set_voices(struct glitch *g, int n, enum glitch_steal steal);
 void glitch_fill(struct glitch *g, float *buf, size_t frames, size_t channels);
+void glitch_fill_add(struct glitch *g, float *buf, size_t frames,
+                     size_t channels);
+void glitch_fill_planar(struct glitch *g, float **bufs, size_t frames,
+                        size_t channels);
+void glitch_fill_s16(struct glitch *g, int16_t *buf, size_t frames,
+                     size_t channels);
+void glitch_fill_s24(struct glitch *g, unsigned char *buf, size_t frames,
+                     size_t channels);
+void glitch_fill_s32(struct glitch *g, int32_t *buf, size_t frames,
+                     size_t channels);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,438 @@
+// +build ignore
+
+/*
+ * glitch_aot translates a glitch program into a C file that evaluates most of
+ * it without walking the expression tree: arithmetic is inlined and
+ * instruments and effects are called directly. Sequencers, each(), poly() and
+ * mix() are still interpreted, so the result is built together with glitch.c
+ * and parses the program when it is loaded, see glitch_aot.h for the runtime.
+ *
+ *   glitch_aot program.glitch > program.c
+ *   cc -O3 -ffp-contract=off -DGLITCH_AOT_MAIN -I core program.c -lm
+ *
+ * Contraction of floating point operations must be disabled to keep the
+ * results bit-exact with the interpreter.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* Before any system header */
+#include <stdio.h>
+
+#include "glitch.c"
+#define GLITCH_AOT_TRANSLATOR /* Only glitch_aot_unit() is shared */
+#include "glitch_aot.h"
+
+#define AOT_MAX_DEPTH 64
+
+/* Functions that evaluate a fixed number of arguments once and in order. If
+ * call is NULL the function is called with the argument values, otherwise
+ * the call is inlined with %c replaced by the function context and %0..%9 by
+ * the arguments. */
+static struct aot_kernel {
+  const char *name;
+  int nargs; /* Arguments evaluated, negative for all of them */
+  float defaults[5];
+  const char *call;
+} aot_kernels[] = {
+    {"byte", 1, {127}, "libglitch_byte(%0)"},
+    {"s",
+     1,
+     {0},
+     "libglitch_interpolate(libglitch_sin_lut, LIBGLITCH_OSC_LUT_LEN, "
+     "LIBGLITCH_OSC_LUT_LEN * libglitch_wrap(%0))"},
+    {"r", 1, {1}, "libglitch_rand(glitch_rand((libglitch_rand_t *)%c), %0)"},
+    {"hz", 1, {0}, "libglitch_hz(%0)"},
+    {"scale", 2, {0}, NULL},
+    {"sin", 1, {NAN}, "libglitch_sin((libglitch_osc_t *)%c, %0)"},
+    {"tri", 1, {NAN}, "libglitch_tri((libglitch_osc_t *)%c, %0)"},
+    {"saw", 1, {NAN}, "libglitch_saw((libglitch_osc_t *)%c, %0)"},
+    {"sqr", 2, {NAN, 0.5}, "libglitch_sqr((libglitch_osc_t *)%c, %0, %1)"},
+    {"fm", 7, {0}, NULL},
+    {"tr808", 3, {0}, NULL},
+    {"lpf",
+     3,
+     {NAN, 200, 1},
+     "libglitch_biquad((libglitch_biquad_t *)%c, LIBGLITCH_FILTER_LPF, %0, "
+     "%1, %2)"},
+    {"hpf",
+     3,
+     {NAN, 200, 1},
+     "libglitch_biquad((libglitch_biquad_t *)%c, LIBGLITCH_FILTER_HPF, %0, "
+     "%1, %2)"},
+    {"bpf",
+     3,
+     {NAN, 200, 1},
+     "libglitch_biquad((libglitch_biquad_t *)%c, LIBGLITCH_FILTER_BPF, %0, "
+     "%1, %2)"},
+    {"bsf",
+     3,
+     {NAN, 200, 1},
+     "libglitch_biquad((libglitch_biquad_t *)%c, LIBGLITCH_FILTER_BSF, %0, "
+     "%1, %2)"},
+    {"delay",
+     4,
+     {NAN, 0, 0, 0},
+     "libglitch_delay((libglitch_delay_t *)%c, %0, %1, %2, %3)"},
+    {"out", -1, {0}, NULL},
+    {"pan", 2, {0}, NULL},
+    {NULL, 0, {0}, NULL},
+};
+
+static const char *aot_ops[] = {
+    [OP_UNARY_MINUS] = "-%0",
+    [OP_UNARY_LOGICAL_NOT] = "!%0",
+    [OP_UNARY_BITWISE_NOT] = "~to_int(%0)",
+    [OP_POWER] = "powf(%0, %1)",
+    [OP_MULTIPLY] = "%0 * %1",
+    [OP_DIVIDE] = "%0 / %1",
+    [OP_REMAINDER] = "fmodf(%0, %1)",
+    [OP_PLUS] = "%0 + %1",
+    [OP_MINUS] = "%0 - %1",
+    [OP_SHL] = "to_int(%0) << (to_int(%1) & 31)",
+    [OP_SHR] = "to_int(%0) >> (to_int(%1) & 31)",
+    [OP_LT] = "%0 < %1",
+    [OP_LE] = "%0 <= %1",
+    [OP_GT] = "%0 > %1",
+    [OP_GE] = "%0 >= %1",
+    [OP_EQ] = "%0 == %1",
+    [OP_NE] = "%0 != %1",
+    [OP_BITWISE_AND] = "to_int(%0) & to_int(%1)",
+    [OP_BITWISE_OR] = "to_int(%0) | to_int(%1)",
+    [OP_BITWISE_XOR] = "to_int(%0) ^ to_int(%1)",
+};
+
+struct aot_site {
+  int unit;
+  int nargs;
+  int depth;
+  int path[AOT_MAX_DEPTH];
+};
+
+struct aot {
+  FILE *out;
+  struct glitch *g;
+  vec(float *) vars;
+  vec(struct aot_site) sites;
+  int unit;
+  int nregs;
+  int path[AOT_MAX_DEPTH];
+  int depth;
+  int maxdepth;
+};
+
+static int aot_var(struct aot *a, float *v) {
+  float *p;
+  int i;
+  vec_foreach(&a->vars, p, i) {
+    if (p == v) {
+      return i;
+    }
+  }
+  vec_push(&a->vars, v);
+  return vec_len(&a->vars) - 1;
+}
+
+static int aot_site(struct aot *a, int nargs) {
+  struct aot_site s = {a->unit, nargs, a->depth, {0}};
+  memcpy(s.path, a->path, sizeof(s.path));
+  vec_push(&a->sites, s);
+  a->maxdepth = MAX(a->maxdepth, a->depth);
+  return vec_len(&a->sites) - 1;
+}
+
+/* Prints a float literal that converts back to exactly the same value */
+static void aot_float(struct aot *a, float x) {
+  if (isnan(x)) {
+    fprintf(a->out, "NAN");
+  } else if (isinf(x)) {
+    fprintf(a->out, x < 0 ? "-INFINITY" : "INFINITY");
+  } else {
+    fprintf(a->out, "(float)%a", (double)x);
+  }
+}
+
+/* Prints a template with %c replaced by ctx and %N by register regs[N] */
+static void aot_format(struct aot *a, const char *fmt, const char *ctx,
+                       int *regs) {
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      fputc(*p, a->out);
+    } else if (*++p == 'c') {
+      fputs(ctx, a->out);
+    } else {
+      fprintf(a->out, "r%d", regs[*p - '0']);
+    }
+  }
+}
+
+static int aot_emit(struct aot *a, struct expr *e, int indent);
+
+/* Emits the i-th argument of e, or its default value if it is missing */
+static int aot_emit_arg(struct aot *a, vec_expr_t *args, int i, float defval,
+                        int indent) {
+  int r;
+  if (i < vec_len(args)) {
+    if (a->depth == AOT_MAX_DEPTH) {
+      return -1;
+    }
+    a->path[a->depth++] = i;
+    r = aot_emit(a, &vec_nth(args, i), indent);
+    a->depth--;
+    return r;
+  }
+  r = a->nregs++;
+  fprintf(a->out, "%*sfloat r%d = ", indent, "", r);
+  aot_float(a, defval);
+  fprintf(a->out, ";\n");
+  return r;
+}
+
+static int aot_emit_func(struct aot *a, struct expr *e, int indent) {
+  struct expr_func *f = e->param.func.f;
+  vec_expr_t *args = &e->param.func.args;
+  int regs[10];
+  char ctx[64];
+  struct aot_kernel *k = aot_kernels;
+  while (k->name != NULL && strcmp(k->name, f->name) != 0) {
+    k++;
+  }
+  if (f->f == lib_env && vec_len(args) > 0) {
+    /* A tuple argument gives the gate and the signal separately */
+    struct expr *x = &vec_nth(args, 0);
+    int site = aot_site(a, 0);
+    if (x->type == OP_COMMA) {
+      a->path[a->depth++] = 0;
+      regs[0] = aot_emit_arg(a, &x->param.op.args, 0, NAN, indent);
+      regs[1] = aot_emit_arg(a, &x->param.op.args, 1, NAN, indent);
+      a->depth--;
+    } else {
+      regs[0] = regs[1] = aot_emit_arg(a, args, 0, NAN, indent);
+    }
+    float defaults[] = {0.01, 10, 0.5, 0.5};
+    for (int i = 0; i < 4; i++) {
+      regs[2 + i] = aot_emit_arg(a, args, i + 1, defaults[i], indent);
+    }
+    snprintf(ctx, sizeof(ctx), "c->site[%d]->param.func.context", site);
+    fprintf(a->out, "%*sfloat r%d = ", indent, "", a->nregs);
+    aot_format(a,
+               "libglitch_env((libglitch_env_t *)%c, %0, %1, %2, %3, %4, %5)",
+               ctx, regs);
+    fprintf(a->out, ";\n");
+    return a->nregs++;
+  } else if (k->name == NULL || f->f == lib_env) {
+    /* Sequencers and functions that evaluate arguments lazily are left to
+     * the interpreter */
+    int site = aot_site(a, 0);
+    fprintf(a->out, "%*sfloat r%d = expr_eval(c->site[%d]);\n", indent, "",
+            a->nregs, site);
+    return a->nregs++;
+  }
+  int n = (k->nargs < 0 ? vec_len(args) : k->nargs);
+  int site = aot_site(a, (k->call == NULL ? MIN(n, vec_len(args)) : 0));
+  snprintf(ctx, sizeof(ctx), "c->site[%d]->param.func.context", site);
+  if (k->call != NULL) {
+    for (int i = 0; i < n; i++) {
+      regs[i] = aot_emit_arg(a, args, i, k->defaults[i], indent);
+    }
+    fprintf(a->out, "%*sfloat r%d = ", indent, "", a->nregs);
+    aot_format(a, k->call, ctx, regs);
+    fprintf(a->out, ";\n");
+    return a->nregs++;
+  }
+  /* Arguments are passed as constants to the original function */
+  for (int i = 0; i < n && i < vec_len(args); i++) {
+    int r = aot_emit_arg(a, args, i, 0, indent);
+    fprintf(a->out,
+            "%*svec_nth(&c->args[%d], %d).param.num.value = r%d;\n", indent,
+            "", site, i, r);
+  }
+  fprintf(a->out,
+          "%*sfloat r%d = c->site[%d]->param.func.f->f("
+          "c->site[%d]->param.func.f, &c->args[%d], %s);\n",
+          indent, "", a->nregs, site, site, site, ctx);
+  return a->nregs++;
+}
+
+/* Emits statements evaluating e the same way expr_eval() does, returns the
+ * register holding the result */
+static int aot_emit(struct aot *a, struct expr *e, int indent) {
+  vec_expr_t *args = &e->param.op.args;
+  int regs[2], r;
+  switch (e->type) {
+  case OP_CONST:
+    fprintf(a->out, "%*sfloat r%d = ", indent, "", a->nregs);
+    aot_float(a, e->param.num.value);
+    fprintf(a->out, ";\n");
+    return a->nregs++;
+  case OP_VAR:
+    fprintf(a->out, "%*sfloat r%d = *c->v[%d];\n", indent, "", a->nregs,
+            aot_var(a, e->param.var.value));
+    return a->nregs++;
+  case OP_FUNC:
+    return aot_emit_func(a, e, indent);
+  case OP_COMMA:
+    aot_emit_arg(a, args, 0, 0, indent);
+    return aot_emit_arg(a, args, 1, 0, indent);
+  case OP_ASSIGN:
+    regs[1] = aot_emit_arg(a, args, 1, 0, indent);
+    if (vec_nth(args, 0).type == OP_VAR) {
+      fprintf(a->out, "%*s*c->v[%d] = r%d;\n", indent, "",
+              aot_var(a, vec_nth(args, 0).param.var.value), regs[1]);
+    }
+    return regs[1];
+  case OP_LOGICAL_AND:
+  case OP_LOGICAL_OR:
+    r = a->nregs++;
+    fprintf(a->out, "%*sfloat r%d = 0;\n", indent, "", r);
+    regs[0] = aot_emit_arg(a, args, 0, 0, indent);
+    if (e->type == OP_LOGICAL_AND) {
+      fprintf(a->out, "%*sif (r%d != 0) {\n", indent, "", regs[0]);
+    } else {
+      fprintf(a->out, "%*sif (r%d != 0 && !isnan(r%d)) {\n", indent, "",
+              regs[0], regs[0]);
+      fprintf(a->out, "%*sr%d = r%d;\n", indent + 2, "", r, regs[0]);
+      fprintf(a->out, "%*s} else {\n", indent, "");
+    }
+    regs[1] = aot_emit_arg(a, args, 1, 0, indent + 2);
+    fprintf(a->out, "%*sif (r%d != 0) {\n", indent + 2, "", regs[1]);
+    fprintf(a->out, "%*sr%d = r%d;\n", indent + 4, "", r, regs[1]);
+    fprintf(a->out, "%*s}\n%*s}\n", indent + 2, "", indent, "");
+    return r;
+  default:
+    if (e->type < 0 ||
+        e->type >= (int)(sizeof(aot_ops) / sizeof(aot_ops[0])) ||
+        aot_ops[e->type] == NULL) {
+      return -1;
+    }
+    for (int i = 0; i < vec_len(args) && i < 2; i++) {
+      regs[i] = aot_emit_arg(a, args, i, 0, indent);
+    }
+    fprintf(a->out, "%*sfloat r%d = ", indent, "", a->nregs);
+    aot_format(a, aot_ops[e->type], "", regs);
+    fprintf(a->out, ";\n");
+    return a->nregs++;
+  }
+}
+
+static void aot_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '\n') {
+      fprintf(out, "\\n\"\n    \"");
+    } else if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if (*s == '\t') {
+      fprintf(out, "\\t");
+    } else if ((unsigned char)*s < ' ') {
+      fprintf(out, "\\%03o", (unsigned char)*s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static int aot_translate(const char *name, const char *s, FILE *out) {
+  struct aot a = {out, glitch_create(), vec_init(), vec_init(), 0, 0,
+                  {0},  0,               0};
+  glitch_reset(a.g);
+  a.g->init = 1;
+  struct expr *e = expr_create(s, strlen(s), &a.g->vars, glitch_funcs);
+  if (e == NULL) {
+    fprintf(stderr, "%s: syntax error\n", name);
+    glitch_destroy(a.g);
+    return -1;
+  }
+
+  fprintf(out, "/* Generated by glitch_aot from %s, do not edit */\n\n", name);
+  fprintf(out, "#include \"glitch.c\"\n#include \"glitch_aot.h\"\n\n");
+  struct expr *u;
+  int status = 0;
+  for (; (u = glitch_aot_unit(e, a.unit)) != NULL; a.unit++) {
+    fprintf(out,
+            "static float glitch_aot_unit%d(struct expr_func *f, "
+            "vec_expr_t *args,\n                               void *context) "
+            "{\n",
+            a.unit);
+    fprintf(out, "  struct glitch_aot_context *c = "
+                 "(struct glitch_aot_context *)context;\n");
+    fprintf(out, "  (void)f;\n  (void)args;\n  (void)c;\n");
+    a.nregs = 0;
+    int r = aot_emit(&a, u, 2);
+    fprintf(out, "  return r%d;\n}\n\n", r);
+    if (r < 0) {
+      fprintf(stderr, "%s: unsupported expression\n", name);
+      status = -1;
+    }
+  }
+
+  fprintf(out, "const char glitch_aot_source[] =\n    ");
+  aot_string(out, s);
+  fprintf(out, ";\n\nstatic const char *glitch_aot_vars[] = {\n");
+  for (int i = 0; i < vec_len(&a.vars); i++) {
+    struct expr_var *v = a.g->vars.head;
+    while (&v->value != vec_nth(&a.vars, i)) {
+      v = v->next;
+    }
+    fprintf(out, "    \"%s\",\n", v->name);
+  }
+  fprintf(out, "    NULL,\n};\n\n");
+  int stride = a.maxdepth + 3;
+  fprintf(out, "static const int glitch_aot_sites[][%d] = {\n", stride);
+  for (int i = 0; i < vec_len(&a.sites); i++) {
+    struct aot_site *site = &vec_nth(&a.sites, i);
+    fprintf(out, "    {%d, %d, %d", site->unit, site->nargs, site->depth);
+    for (int j = 0; j < a.maxdepth; j++) {
+      fprintf(out, ", %d", site->path[j]);
+    }
+    fprintf(out, "},\n");
+  }
+  fprintf(out, "    {-1},\n};\n\n");
+  fprintf(out, "static struct expr_func glitch_aot_units[] = {\n");
+  for (int i = 0; i < a.unit; i++) {
+    fprintf(out, "    {\"\", glitch_aot_unit%d, glitch_aot_cleanup, 0},\n", i);
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "int glitch_aot_compile(struct glitch *g) {\n"
+               "  return glitch_aot_load(g, glitch_aot_source, "
+               "glitch_aot_vars, %d,\n"
+               "                         &glitch_aot_sites[0][0], %d, %d, "
+               "glitch_aot_units,\n"
+               "                         %d);\n}\n",
+          vec_len(&a.vars), vec_len(&a.sites), stride, a.unit);
+
+  vec_free(&a.vars);
+  vec_free(&a.sites);
+  expr_destroy(e, NULL);
+  glitch_destroy(a.g);
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s file.glitch [out.c]\n", argv[0]);
+    return 2;
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  vec(char) s = vec_init();
+  for (int c; (c = fgetc(in)) != EOF;) {
+    vec_push(&s, (char)c);
+  }
+  vec_push(&s, '\0');
+  fclose(in);
+  FILE *out = (argc > 2 ? fopen(argv[2], "w") : stdout);
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  glitch_init(44100, 0);
+  int status = aot_translate(argv[1], s.buf, out);
+  vec_free(&s);
+  if (out != stdout && fclose(out) != 0) {
+    status = -1;
+  }
+  return (status == 0 ? 0 : 1);
+}
@@ -0,0 +1,178 @@
+#ifndef GLITCH_AOT_H
+#define GLITCH_AOT_H
+
+/*
+ * Runtime of programs translated to C by glitch_aot. A generated file
+ * includes glitch.c and this header, and defines one function per top-level
+ * expression (or output channel) of the program. The program source is
+ * still parsed at load time: its top-level expressions are wrapped into the
+ * generated functions, while the parsed subtrees provide the state of
+ * instruments and effects, and interpret the sequencers and other functions
+ * that decide themselves when to evaluate their arguments.
+ */
+
+/* Returns the n-th top-level expression of a program, where arguments of the
+ * final out() or pan() count as separate expressions, or NULL */
+static struct expr *glitch_aot_unit(struct expr *e, int n) {
+  for (; e->type == OP_COMMA; e = &vec_nth(&e->param.op.args, 1)) {
+    if (n-- == 0) {
+      return &vec_nth(&e->param.op.args, 0);
+    }
+  }
+  if (glitch_output(e) != NULL) {
+    return (n < vec_len(&e->param.func.args) ? &vec_nth(&e->param.func.args, n)
+                                             : NULL);
+  }
+  return (n == 0 ? e : NULL);
+}
+
+#ifndef GLITCH_AOT_TRANSLATOR
+struct glitch_aot_context {
+  float **v;          /* Variables by index */
+  struct expr **site; /* Parsed function calls by index */
+  vec_expr_t *args;   /* Constant arguments of calls made with values */
+  int nsites;
+};
+
+static void glitch_aot_cleanup(struct expr_func *f, void *context) {
+  (void)f;
+  struct glitch_aot_context *c = (struct glitch_aot_context *)context;
+  for (int i = 0; i < c->nsites; i++) {
+    vec_free(&c->args[i]);
+  }
+  free(c->v);
+  free(c->site);
+  free(c->args);
+}
+
+/* Returns the node at the path of argument indices below e */
+static struct expr *glitch_aot_path(struct expr *e, const int *path, int n) {
+  for (int i = 0; i < n; i++) {
+    vec_expr_t *args =
+        (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+    e = &vec_nth(args, path[i]);
+  }
+  return e;
+}
+
+/* Sites are rows of {unit, number of constant arguments, depth, path...} */
+static int glitch_aot_load(struct glitch *g, const char *s, const char **vars,
+                           int nvars, const int *sites, int nsites, int stride,
+                           struct expr_func *units, int nunits) {
+  if (!g->init) {
+    glitch_reset(g);
+    g->init = 1;
+  }
+  struct expr *e = expr_create(s, strlen(s), &g->vars, glitch_funcs);
+  if (e == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < nunits; i++) {
+    struct expr *u = glitch_aot_unit(e, i);
+    struct glitch_aot_context *c =
+        (struct glitch_aot_context *)calloc(1, sizeof(*c));
+    struct expr w = expr_init();
+    if (u == NULL || c == NULL) {
+      free(c);
+      expr_destroy(e, NULL);
+      return -1;
+    }
+    c->v = (float **)calloc(nvars + 1, sizeof(float *));
+    c->site = (struct expr **)calloc(nsites + 1, sizeof(struct expr *));
+    c->args = (vec_expr_t *)calloc(nsites + 1, sizeof(vec_expr_t));
+    c->nsites = nsites;
+    w.type = OP_FUNC;
+    w.param.func.f = &units[i];
+    w.param.func.context = c;
+    if (c->v == NULL || c->site == NULL || c->args == NULL ||
+        vec_push(&w.param.func.args, *u) != 0) {
+      glitch_aot_cleanup(NULL, c);
+      free(c);
+      expr_destroy(e, NULL);
+      return -1;
+    }
+    *u = w;
+    for (int j = 0; j < nvars; j++) {
+      c->v[j] = &expr_var(&g->vars, vars[j], strlen(vars[j]))->value;
+    }
+    for (int j = 0; j < nsites; j++) {
+      const int *row = &sites[j * stride];
+      if (row[0] != i) {
+        continue;
+      }
+      c->site[j] = glitch_aot_path(&vec_nth(&w.param.func.args, 0), row + 3,
+                                   row[2]);
+      for (int k = 0; k < row[1]; k++) {
+        struct expr arg = expr_init();
+        arg.type = OP_CONST;
+        if (vec_push(&c->args[j], arg) != 0) {
+          expr_destroy(e, NULL);
+          return -1;
+        }
+      }
+    }
+  }
+  expr_destroy(g->next_expr, NULL);
+  glitch_cache_destroy(g->next_cache);
+  g->next_cache = NULL;
+  if (g->bpm->value == 0) {
+    expr_destroy(g->e, NULL);
+    glitch_cache_destroy(g->cache);
+    g->e = e;
+    g->cache = NULL;
+    g->next_expr = NULL;
+  } else {
+    g->next_expr = e;
+  }
+  return 0;
+}
+#endif /* GLITCH_AOT_TRANSLATOR */
+
+#ifdef GLITCH_AOT_MAIN
+int glitch_aot_compile(struct glitch *g);
+extern const char glitch_aot_source[];
+
+/* Writes raw 32-bit float stereo frames at 44100 Hz to stdout. With -check
+ * compares them with the interpreter instead and fails on any difference. */
+int main(int argc, char *argv[]) {
+  int check = (argc > 1 && strcmp(argv[1], "-check") == 0);
+  float seconds = (argc > 1 + check ? atof(argv[1 + check]) : 10);
+  float buf[1024], ref[1024];
+  glitch_init(44100, 0);
+  struct glitch *g = glitch_create();
+  struct glitch *h = glitch_create();
+  if (g == NULL || h == NULL) {
+    return 1;
+  }
+  glitch_seed(g, 1);
+  glitch_seed(h, 1);
+  if (glitch_aot_compile(g) != 0 ||
+      glitch_compile(h, glitch_aot_source, strlen(glitch_aot_source)) != 0) {
+    fprintf(stderr, "failed to compile the program\n");
+    return 1;
+  }
+  long frames = (long)(seconds * 44100);
+  for (long i = 0; i < frames; i = i + 512) {
+    glitch_fill(g, buf, 512, 2);
+    if (!check) {
+      fwrite(buf, sizeof(float), 1024, stdout);
+      continue;
+    }
+    glitch_fill(h, ref, 512, 2);
+    if (memcmp(buf, ref, sizeof(buf)) != 0) {
+      for (int j = 0; j < 1024; j++) {
+        if (memcmp(&buf[j], &ref[j], sizeof(float)) != 0) {
+          fprintf(stderr, "frame %ld: %g != %g\n", i + j / 2, buf[j], ref[j]);
+          break;
+        }
+      }
+      return 1;
+    }
+  }
+  glitch_destroy(g);
+  glitch_destroy(h);
+  return 0;
+}
+#endif
+
+#endif /* GLITCH_AOT_H */
@@ -0,0 +1,393 @@
+// +build ignore
+
+/*
+ * glitch_bench renders built-in functions and glitch programs through
+ * glitch_fill() in blocks of realistic size and reports the median, 99th
+ * percentile and maximum render time per block. Every block is timed on its
+ * own after a warm-up, so that occasional slow blocks (sequencer steps,
+ * allocations, cache misses) are seen rather than averaged away.
+ *
+ *   glitch_bench [-b frames] [-json] [-o file] [file.glitch...]
+ *
+ * Without files the built-in function benchmarks are run. With -json the
+ * results are written as a JSON document to compare between releases.
+ *
+ *   glitch_bench -baseline bench_baseline.txt file.glitch...
+ *   glitch_bench -check bench_baseline.txt [-tolerance 2] file.glitch...
+ *
+ * A baseline keeps the render time of each program relative to a reference
+ * kernel timed in the same run, and a hash of the rendered samples. A check
+ * fails if the output differs from the baseline in any bit, and separately if
+ * the relative time exceeds the baseline times the tolerance, zero to skip
+ * timing. Relative times carry over between machines of a similar kind,
+ * hashes only between builds with the same compiler, flags and libm.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* Before any system header */
+#include <stdio.h>
+
+#include "glitch.c"
+
+#define BENCH_WARMUP 64
+#define BENCH_FRAMES (1L << 19) /* Frames rendered by each benchmark */
+#define BENCH_RETRIES 3         /* Runs before a check reports a slowdown */
+#define BENCH_TOLERANCE 2.0     /* Slowdown failing a check by default */
+#define BENCH_REFERENCE "lpf(saw(440))" /* Timings are relative to it */
+
+struct bench {
+  const char *name;
+  const char *label;
+  void (*setup)(struct glitch *g);
+};
+
+static void bench_nocache(struct glitch *g) {
+  glitch_cache_destroy(g->cache);
+  g->cache = NULL;
+}
+
+static void bench_notick(struct glitch *g) {
+  bench_nocache(g);
+  glitch_set_tick(g, GLITCH_TICK_OFF);
+}
+
+static void bench_nocontrol(struct glitch *g) { glitch_set_control(g, -1); }
+
+static void bench_voices(struct glitch *g) {
+  for (int i = 0; i < 4; i++) {
+    glitch_midi(g, 0x90, 60 + i * 4, 100);
+  }
+}
+
+static struct bench kernels[] = {
+    /* Arithmetics */
+    {"0", "", NULL},
+    {"x=x+1", "", NULL},
+    {"byte(t*(42&t>>10))", "", NULL},
+    {"byte(t*(42&t>>10))", "notick", bench_notick},
+    {"byte(t*(42&t>>10))", "nocache", bench_nocache},
+    /* Instruments */
+    {"sin(440)", "", NULL},
+    {"saw(440)", "", NULL},
+    {"tri(440)", "", NULL},
+    {"sqr(440)", "", NULL},
+    {"fm(440,1,1)", "", NULL},
+    {"pluck(440)", "", NULL},
+    {"tr808(BD,1)", "", NULL},
+    /* Sequencers */
+    {"a(i=i+1,1,2,3,4)", "", NULL},
+    {"s(i=i+1/6)", "", NULL},
+    {"seq(120,1,2,3,4)", "", NULL},
+    {"seq(120,(0.5,1),2,(2,3),(1.5,4))", "", NULL},
+    {"seq((2,120),(0.5,1),2,(2,3),(1.5,4))", "", NULL},
+    {"seq(120*2,1,2,0,0,3,4,0,0)", "", NULL},
+    {"loop(120,1,2,3,4)", "", NULL},
+    /* Control rate */
+    {"sin(hz(seq(240,C4,E4,G4)))", "", NULL},
+    {"sin(hz(seq(240,C4,E4,G4)))", "nocontrol", bench_nocontrol},
+    {"lpf(saw(hz(x)),hz(x+24)*2)", "", NULL},
+    {"lpf(saw(hz(x)),hz(x+24)*2)", "nocontrol", bench_nocontrol},
+    /* Effects */
+    {"lpf(saw(440))", "", NULL},
+    {"lpf(saw(440)*(t<4800))", "tail", NULL},
+    {"hpf(saw(440))", "", NULL},
+    {"bpf(saw(440))", "", NULL},
+    {"bsf(saw(440))", "", NULL},
+    {"delay(saw(seq(120,440)),0.1,0.5,0.5)", "", NULL},
+    {"delay(sin(440),0.25,0.5,0.5)", "", NULL},
+    {"delay(sin(440),0.25+sin(4)/10,0.5,0.5)", "", NULL},
+    /* Utils */
+    {"hz(A4)", "", NULL},
+    {"l(440)", "", NULL},
+    {"scale(42)", "", NULL},
+    {"r()", "", NULL},
+    {"env(sin(seq(120,440)),0.1,0.3)", "", NULL},
+    {"mix(sin(220),sin(440),sin(880),sin(110))", "", NULL},
+    {"(sin(220)+sin(440)+sin(880)+sin(110))/4", "", NULL},
+    {"each(f,sin(f),220,440,880,110)/4", "", NULL},
+    {"poly((k,g,v),env((g,v*saw(hz(k))),0.01,0.5))", "4 voices",
+     bench_voices},
+    {"out(sin(220),sin(330))", "", NULL},
+    {"pan(sin(220),sin(1))", "", NULL},
+};
+
+struct bench_result {
+  double median, p99, max; /* Nanoseconds per block */
+  unsigned long long hash; /* FNV-1a of the rendered samples */
+};
+
+static unsigned long long bench_hash(unsigned long long h, const float *buf,
+                                     size_t n) {
+  const unsigned char *p = (const unsigned char *)buf;
+  for (size_t i = 0; i < n * sizeof(float); i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Renders BENCH_FRAMES frames of stereo in blocks, timing each block */
+static int bench_run(const char *s, void (*setup)(struct glitch *g), int block,
+                     struct bench_result *r) {
+  long n = BENCH_FRAMES / block;
+  double *ns = (double *)calloc(n, sizeof(double));
+  float *buf = (float *)calloc(block * 2, sizeof(float));
+  struct glitch *g = glitch_create();
+  if (ns == NULL || buf == NULL || g == NULL ||
+      glitch_compile(g, s, strlen(s)) != 0) {
+    free(ns);
+    free(buf);
+    if (g != NULL) {
+      glitch_destroy(g);
+    }
+    return -1;
+  }
+  if (setup != NULL) {
+    setup(g);
+  }
+  r->hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < BENCH_WARMUP; i++) {
+    glitch_fill(g, buf, block, 2);
+    r->hash = bench_hash(r->hash, buf, block * 2);
+  }
+  for (long i = 0; i < n; i++) {
+    double start = glitch_clock();
+    glitch_fill(g, buf, block, 2);
+    ns[i] = (glitch_clock() - start) * 1e9;
+    r->hash = bench_hash(r->hash, buf, block * 2);
+  }
+  qsort(ns, n, sizeof(double), bench_cmp);
+  r->median = ns[n / 2];
+  r->p99 = ns[n * 99 / 100];
+  r->max = ns[n - 1];
+  free(ns);
+  free(buf);
+  glitch_destroy(g);
+  return 0;
+}
+
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/* Renders a program and the reference kernel, returns the render time of the
+ * program relative to the reference or a negative value on failure */
+static double bench_relative(const char *s, void (*setup)(struct glitch *g),
+                             int block, struct bench_result *r) {
+  struct bench_result ref;
+  if (bench_run(BENCH_REFERENCE, NULL, block, &ref) != 0 ||
+      bench_run(s, setup, block, r) != 0) {
+    return -1;
+  }
+  return r->median / ref.median;
+}
+
+/* Looks up the relative time and the hash of a program rendered in blocks of
+ * the given size, lines are "name block ratio hash" */
+static int bench_baseline(const char *path, const char *name, int block,
+                          double *ratio, unsigned long long *hash) {
+  char line[256], s[128];
+  int b;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] != '#' &&
+        sscanf(line, "%127s %d %lf %llx", s, &b, ratio, hash) == 4 &&
+        strcmp(s, name) == 0 && b == block) {
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+  return -1;
+}
+
+/* Compares a result and its relative time with the baseline, and runs a slow
+ * program again in case the machine was busy. Returns the number of failures.
+ */
+static int bench_check(const char *path, const char *name, const char *s,
+                       int block, double tolerance, double ratio,
+                       struct bench_result *r) {
+  double expected;
+  unsigned long long hash;
+  int failed = 0;
+  if (bench_baseline(path, name, block, &expected, &hash) != 0) {
+    printf("FAIL: %s is not in %s for %d frames per block\n", name, path,
+           block);
+    return 1;
+  }
+  if (r->hash != hash) {
+    printf("FAIL: %s output changed, hash %016llx, expected %016llx\n", name,
+           r->hash, hash);
+    failed++;
+  }
+  for (int i = 1; tolerance > 0 && ratio > expected * tolerance; i++) {
+    struct bench_result again;
+    double t;
+    if (i == BENCH_RETRIES ||
+        (t = bench_relative(s, NULL, block, &again)) < 0) {
+      printf("FAIL: %s takes %.2fx the time of %s, baseline %.2fx, "
+             "tolerance %.2fx\n",
+             name, ratio, BENCH_REFERENCE, expected, tolerance);
+      failed++;
+      break;
+    }
+    ratio = MIN(ratio, t);
+  }
+  return failed;
+}
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  char *s = NULL;
+  long len;
+  if (f == NULL) {
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+      fseek(f, 0, SEEK_SET) == 0 && (s = (char *)calloc(1, len + 1)) != NULL &&
+      fread(s, 1, len, f) != (size_t)len) {
+    free(s);
+    s = NULL;
+  }
+  fclose(f);
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  int block = 512, json = 0, status = 0, first = 1;
+  double tolerance = BENCH_TOLERANCE;
+  const char *output = NULL, *baseline = NULL, *check = NULL;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      block = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-json") == 0) {
+      json = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "-check") == 0 && i + 1 < argc) {
+      check = argv[++i];
+    } else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [-b frames] [-json] [-o file] [-baseline file] "
+              "[-check file] [-tolerance x] [file.glitch...]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (block < 1 || block > BENCH_FRAMES) {
+    fprintf(stderr, "block size must be between 1 and %ld\n", BENCH_FRAMES);
+    return 2;
+  }
+  FILE *out = (output != NULL ? fopen(output, "w") : stdout);
+  if (out == NULL) {
+    perror(output);
+    return 1;
+  }
+  FILE *base = (baseline != NULL ? fopen(baseline, "w") : NULL);
+  if (baseline != NULL && base == NULL) {
+    perror(baseline);
+    return 1;
+  }
+  if (base != NULL) {
+    fprintf(base, "# name, frames per block, median time relative to %s, "
+                  "hash\n",
+            BENCH_REFERENCE);
+  }
+  glitch_init(44100, 1);
+
+  int nkernels = (i < argc ? 0 : (int)(sizeof(kernels) / sizeof(kernels[0])));
+  if (json) {
+    fprintf(out, "{\n  \"sampleRate\": 44100,\n  \"block\": %d,\n", block);
+    fprintf(out, "  \"results\": [");
+  } else {
+    fprintf(out, "%-56s %10s %10s %10s %8s\n", "program (ns per block)",
+            "median", "p99", "max", "ns/frame");
+  }
+  for (int k = 0; k < nkernels + argc - i; k++) {
+    struct bench_result r;
+    char name[128];
+    char *text = NULL;
+    const char *s;
+    void (*setup)(struct glitch *g) = NULL;
+    if (k < nkernels) {
+      s = kernels[k].name;
+      setup = kernels[k].setup;
+      snprintf(name, sizeof(name), "%s%s%s", s, (*kernels[k].label ? " " : ""),
+               kernels[k].label);
+    } else {
+      const char *path = argv[i + k - nkernels];
+      if ((text = read_file(path)) == NULL) {
+        perror(path);
+        status = 1;
+        continue;
+      }
+      s = text;
+      snprintf(name, sizeof(name), "%s",
+               (strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path));
+    }
+    double ratio = 0;
+    if (check != NULL || base != NULL) {
+      ratio = bench_relative(s, setup, block, &r);
+    } else if (bench_run(s, setup, block, &r) != 0) {
+      ratio = -1;
+    }
+    if (ratio < 0) {
+      fprintf(stderr, "%s: can't be compiled\n", name);
+      status = 1;
+      free(text);
+      continue;
+    }
+    if (check != NULL &&
+        bench_check(check, name, s, block, tolerance, ratio, &r)) {
+      status = 1;
+    }
+    if (base != NULL) {
+      fprintf(base, "%s %d %.3f %016llx\n", name, block, ratio, r.hash);
+    }
+    if (json) {
+      fprintf(out, "%s\n    {\"name\": ", (first ? "" : ","));
+      json_string(out, name);
+      fprintf(out,
+              ", \"medianNs\": %.0f, \"p99Ns\": %.0f, \"maxNs\": %.0f, "
+              "\"nsPerFrame\": %.2f, \"hash\": \"%016llx\"}",
+              r.median, r.p99, r.max, r.median / block, r.hash);
+      first = 0;
+    } else {
+      fprintf(out, "%-56s %10.0f %10.0f %10.0f %8.2f\n", name, r.median, r.p99,
+              r.max, r.median / block);
+    }
+    fflush(out);
+    free(text);
+  }
+  if (json) {
+    fprintf(out, "\n  ]\n}\n");
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  if (base != NULL) {
+    fclose(base);
+  }
+  return status;
+}
@@ -0,0 +1,98 @@
+// +build ignore
+
+/*
+ * glitch_replay drives a fresh instance through a log written by
+ * glitch_record(), as fast as it renders, to reproduce a session offline.
+ *
+ *   glitch_replay [-o file.raw] [-profile file.folded] [-trace file.json]
+ *                 session.log
+ *
+ * The rendered frames are written with -o as raw floats, and hashed so that
+ * runs can be compared bit by bit. The program current at the end of the log
+ * is profiled with -profile, which needs glitch_replay to be built with
+ * EXPR_PROFILE as by CMake, and engine activity is traced with -trace.
+ * Samples are not loaded, sample functions are silent.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* Before any system header */
+#include <stdio.h>
+
+#include "glitch.c"
+
+int main(int argc, char *argv[]) {
+  const char *output = NULL, *profile = NULL, *trace = NULL;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) {
+      profile = argv[++i];
+    } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else {
+      break;
+    }
+  }
+  if (i + 1 != argc) {
+    fprintf(stderr,
+            "usage: %s [-o file.raw] [-profile file.folded] [-trace file.json] "
+            "session.log\n",
+            argv[0]);
+    return 2;
+  }
+  FILE *in = fopen(argv[i], "rb");
+  if (in == NULL) {
+    perror(argv[i]);
+    return 1;
+  }
+  FILE *out = (output != NULL ? fopen(output, "wb") : NULL);
+  FILE *prof = (profile != NULL ? fopen(profile, "w") : NULL);
+  if ((output != NULL && out == NULL) || (profile != NULL && prof == NULL)) {
+    perror(output != NULL && out == NULL ? output : profile);
+    return 1;
+  }
+
+  glitch_init(44100, 1);
+  if (trace != NULL) {
+    glitch_trace_start();
+  }
+  struct glitch *g = glitch_create();
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  double start = glitch_clock();
+  long frames = glitch_replay(g, in, out, prof, &hash);
+  double elapsed = glitch_clock() - start;
+  glitch_trace_stop();
+  if (frames < 0) {
+    fprintf(stderr, "%s: malformed log or diverged at frame %ld\n", argv[i],
+            g->frame);
+    return 1;
+  }
+
+  int sample_rate =
+      (g->sample_rate > 0 ? g->sample_rate : libglitch_default_sample_rate);
+  printf("%s: %ld frames (%.1fs) replayed in %.3fs (%.1fx realtime), "
+         "hash %016llx\n",
+         argv[i], frames, (double)frames / sample_rate, elapsed,
+         (double)frames / sample_rate / elapsed, (unsigned long long)hash);
+
+  int status = 0;
+  if (trace != NULL) {
+    FILE *f = fopen(trace, "w");
+    if (f == NULL || glitch_trace_dump(f) != 0) {
+      perror(trace);
+      status = 1;
+    }
+    if (f != NULL) {
+      fclose(f);
+    }
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+  if (prof != NULL) {
+    fclose(prof);
+  }
+  fclose(in);
+  glitch_destroy(g);
+  return status;
+}
@@ -1,5 +1,6 @@
 // +build ignore
 
+#define _POSIX_C_SOURCE 200112L /* Before any system header */
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
@@ -61,6 +62,27 @@ static void test_r() {
       ASSERT(glitch_eval(g) >= 0 && glitch_eval(g) < 1);
     }
   }
+
+  /* Instances with the same seed render the same noise, other seeds differ */
+  GLITCH_TEST("r() + r() + pluck(100)") {
+    struct glitch *h = glitch_create();
+    struct glitch *k = glitch_create();
+    const char *s = "r() + r() + pluck(100)";
+    glitch_compile(h, s, strlen(s));
+    glitch_compile(k, s, strlen(s));
+    glitch_seed(g, 1);
+    glitch_seed(h, 1);
+    glitch_seed(k, 2);
+    int same = 1;
+    for (int i = 0; i < 1000; i++) {
+      float v = glitch_eval(g);
+      same = same && (v == glitch_eval(h));
+      ASSERT(v != glitch_eval(k));
+    }
+    ASSERT(same);
+    glitch_destroy(h);
+    glitch_destroy(k);
+  }
 }
 
 static void test_hz() {
@@ -367,73 +389,951 @@ static void test_delay() {
   }
 }
 
-static void test_benchmark(const char *s) {
-  double start = (double)clock() / CLOCKS_PER_SEC;
-  struct glitch *g = glitch_create();
-  if (g == NULL) {
-    printf("FAIL: glitch instance can't be created\n");
-    status = 1;
-    return;
-  }
-  if (glitch_compile(g, s, strlen(s)) != 0) {
-    printf("FAIL: %s can't be compiled\n", s);
-    status = 1;
-    return;
-  }
-  long N = 1000000L;
-  for (long i = 0; i < N; i++) {
+static void test_fill() {
+  printf("TEST: glitch_fill()\n");
+
+  int prev_sr = libglitch_sample_rate;
+  libglitch_init(1280, 0);
+
+  /* Block fill swaps programs on the same beat as frame-by-frame fill */
+  struct glitch *a = glitch_create();
+  struct glitch *b = glitch_create();
+  const char *s1 = "bpm=960, 1";
+  const char *s2 = "bpm=960, 2";
+  float bufa[200], bufb[200];
+  glitch_compile(a, s1, strlen(s1));
+  glitch_compile(b, s1, strlen(s1));
+  glitch_fill(a, bufa, 30, 1);
+  glitch_fill(b, bufb, 30, 1);
+  glitch_compile(a, s2, strlen(s2));
+  glitch_compile(b, s2, strlen(s2));
+  for (int i = 0; i < 200; i++) {
+    glitch_fill(a, &bufa[i], 1, 1);
+  }
+  glitch_fill(b, bufb, 200, 1);
+  for (int i = 0; i < 200; i++) {
+    ASSERT(bufa[i] == bufb[i]);
+  }
+  ASSERT(bufb[48] == 1 && bufb[49] == 2);
+  glitch_destroy(a);
+  glitch_destroy(b);
+
+  /* Released voices are removed on the same frame as with frame-by-frame fill
+   */
+  a = glitch_create();
+  b = glitch_create();
+  const char *s3 = "(v0 == v0) || -1";
+  glitch_compile(a, s3, strlen(s3));
+  glitch_compile(b, s3, strlen(s3));
+  glitch_midi(a, 0x90, 69, 64);
+  glitch_midi(b, 0x90, 69, 64);
+  glitch_midi(a, 0x80, 69, 0);
+  glitch_midi(b, 0x80, 69, 0);
+  for (int i = 0; i < 100; i++) {
+    glitch_fill(a, &bufa[i], 1, 1);
+  }
+  glitch_fill(b, bufb, 100, 1);
+  for (int i = 0; i < 100; i++) {
+    ASSERT(bufa[i] == bufb[i]);
+  }
+  ASSERT(bufb[61] == 1 && bufb[62] == -1);
+  glitch_destroy(a);
+  glitch_destroy(b);
+
+  /* Released velocity decays every frame, also within a block */
+  a = glitch_create();
+  const char *s4 = "v0";
+  glitch_compile(a, s4, strlen(s4));
+  glitch_midi(a, 0x90, 69, 64);
+  glitch_fill(a, bufa, 1, 1);
+  glitch_midi(a, 0x80, 69, 0);
+  /* Segments run to where the release ends, not frame by frame */
+  ASSERT(glitch_segment(a, 4096) ==
+         (size_t)((bufa[0] - 0.01f) * libglitch_sample_rate / 10.f));
+  float vel = bufa[0], last = vel;
+  for (int n = 0; n < 40 * 100; n = n + 40) {
+    glitch_fill(a, bufb, 40, 1);
+    for (int i = 0; i < 40; i++) {
+      vel = vel - (10.f * 1 / libglitch_sample_rate);
+      /* The last sample is held once the voice is off */
+      last = (vel < 0.01f ? last : vel);
+      ASSERT(bufb[i] == last);
+    }
+  }
+  ASSERT(vel < 0.01f && glitch_voice_next(&a->voices, 0) == -1);
+  glitch_destroy(a);
+
+  /* Programs are swapped on the frame whose interval crosses the beat, also
+   * if a beat is not a whole number of frames */
+  libglitch_init(48000, 0);
+  struct {
+    const char *bpm;
+    long preroll;
+    long swap;
+  } beats[] = {
+      {"bpm=144", 1000, 19999},
+      {"bpm=144", 245057, 259999},
+      {"bpm=200", 245057, 259199},
+      {"bpm=88", 735000, 752727},
+  };
+  for (size_t i = 0; i < sizeof(beats) / sizeof(beats[0]); i++) {
+    char src[32];
+    float buf[4096];
+    a = glitch_create();
+    snprintf(src, sizeof(src), "%s, 1", beats[i].bpm);
+    glitch_compile(a, src, strlen(src));
+    for (long n = beats[i].preroll; n > 0; n = n - 4096) {
+      glitch_fill(a, buf, MIN(n, 4096), 1);
+    }
+    snprintf(src, sizeof(src), "%s, 2", beats[i].bpm);
+    glitch_compile(a, src, strlen(src));
+    long frame = a->frame;
+    for (long n = beats[i].swap + 1 - frame; n > 0;) {
+      long m = MIN(n, 4096);
+      glitch_fill(a, buf, m, 1);
+      for (long j = 0; j < m; j++, frame++) {
+        if (frame < beats[i].swap) {
+          ASSERT(buf[j] == 1);
+        } else {
+          ASSERT(buf[j] == 2);
+        }
+      }
+      n = n - m;
+    }
+    glitch_destroy(a);
+  }
+
+  libglitch_init(prev_sr, 0);
+}
+
+static void test_channels() {
+  printf("TEST: out(), pan()\n");
+
+  /* Mono programs are copied into every channel */
+  GLITCH_TEST("1") {
+    float buf[4];
+    glitch_fill(g, buf, 2, 2);
+    ASSERT(buf[0] == 1 && buf[1] == 1 && buf[2] == 1 && buf[3] == 1);
+  }
+
+  /* out() renders one value per channel, wrapping if there are fewer values */
+  GLITCH_TEST("x=3, out(x, x*2)") {
+    float buf[8];
+    glitch_fill(g, buf, 2, 4);
+    ASSERT(buf[0] == 3 && buf[1] == 6 && buf[2] == 3 && buf[3] == 6);
+    ASSERT(buf[4] == 3 && buf[5] == 6 && buf[6] == 3 && buf[7] == 6);
+  }
+
+  /* The last sample of a multichannel program is its first channel */
+  GLITCH_TEST("out(3, 4)") {
+    float buf[2];
+    glitch_fill(g, buf, 1, 2);
+    ASSERT(g->last_sample == 3);
+  }
+
+  /* out() on a mono device is a channel average */
+  GLITCH_TEST("out(1, 2)") {
+    float buf[1];
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(buf[0] == 1.5);
+  }
+
+  /* Shared subexpressions are evaluated once per frame */
+  GLITCH_TEST("i=i+1, out(i, i)") {
+    float buf[6];
+    glitch_fill(g, buf, 3, 2);
+    ASSERT(buf[0] == 1 && buf[1] == 1 && buf[4] == 3 && buf[5] == 3);
+  }
+
+  /* pan() places a signal using equal power panning */
+  GLITCH_TEST("pan(1, -1)") {
+    float buf[2];
+    glitch_fill(g, buf, 1, 2);
+    ASSERT(buf[0] == 1 && fabsf(buf[1]) < 0.0001f);
+  }
+  GLITCH_TEST("pan(1)") {
+    float buf[2];
+    glitch_fill(g, buf, 1, 2);
+    ASSERT(fabsf(buf[0] - 0.7071f) < 0.0001f && buf[0] == buf[1]);
+  }
+  GLITCH_TEST("pan(1, 1)") { ASSERT(glitch_eval(g) == 1); }
+}
+
+static void test_formats() {
+  printf("TEST: glitch_fill_*()\n");
+
+  /* Planar output writes each channel into its own buffer */
+  GLITCH_TEST("out(1, 2)") {
+    float l[3000], r[3000];
+    float *bufs[] = {l, r};
+    glitch_fill_planar(g, bufs, 3000, 2);
+    ASSERT(l[0] == 1 && r[0] == 2 && l[2999] == 1 && r[2999] == 2);
+  }
+
+  /* Accumulating output adds to the existing buffer contents */
+  GLITCH_TEST("0.25") {
+    float buf[4] = {1, 2, 3, 4};
+    glitch_fill_add(g, buf, 2, 2);
+    ASSERT(buf[0] == 1.25 && buf[1] == 2.25 && buf[3] == 4.25);
+  }
+
+  /* Integer output is dithered by at most 1 LSB and clipped */
+  GLITCH_TEST("out(0.5, 2)") {
+    int16_t buf[4000];
+    glitch_fill_s16(g, buf, 2000, 2);
+    for (int i = 0; i < 4000; i = i + 2) {
+      ASSERT(buf[i] >= 16383 && buf[i] <= 16385);
+      ASSERT(buf[i + 1] == 32767);
+    }
+  }
+  GLITCH_TEST("-1") {
+    unsigned char buf[6];
+    glitch_fill_s24(g, buf, 2, 1);
+    ASSERT(buf[2] == 0x80 && buf[5] == 0x80);
+  }
+  GLITCH_TEST("-0.5") {
+    int32_t buf[2];
+    glitch_fill_s32(g, buf, 2, 1);
+    ASSERT(buf[0] == -1073741824 && buf[1] == -1073741824);
+  }
+}
+
+static void test_poly() {
+  printf("TEST: poly()\n");
+
+  /* Voices are allocated in order and exposed as k0..k8 variables */
+  GLITCH_TEST("poly((k, gt, vl), vl)") {
+    glitch_set_voices(g, 16, GLITCH_STEAL_NONE);
+    for (int i = 0; i < 12; i++) {
+      glitch_midi(g, 0x90, 60 + i, 64);
+    }
+    ASSERT(glitch_get(g, "k0") == -9 && glitch_get(g, "k8") == -1);
+    ASSERT(glitch_eval(g) == 12 * 0.5f / 4);
+    /* With no stealing, notes are ignored when all voices are in use */
+    for (int i = 0; i < 8; i++) {
+      glitch_midi(g, 0x90, 80 + i, 64);
+    }
+    ASSERT(glitch_eval(g) == 16 * 0.5f / 4);
+  }
+
+  /* Oldest voice is stolen */
+  GLITCH_TEST("0") {
+    glitch_set_voices(g, 2, GLITCH_STEAL_OLDEST);
+    glitch_midi(g, 0x90, 69, 100);
+    glitch_midi(g, 0x90, 70, 50);
+    glitch_midi(g, 0x90, 71, 100);
+    ASSERT(glitch_get(g, "k0") == 2 && glitch_get(g, "k1") == 1);
+  }
+
+  /* Quietest voice is stolen */
+  GLITCH_TEST("0") {
+    glitch_set_voices(g, 2, GLITCH_STEAL_QUIETEST);
+    glitch_midi(g, 0x90, 69, 100);
+    glitch_midi(g, 0x90, 70, 50);
+    glitch_midi(g, 0x90, 71, 100);
+    ASSERT(glitch_get(g, "k0") == 0 && glitch_get(g, "k1") == 2);
+  }
+
+  /* Only sounding voices are evaluated, a new note resets the voice once */
+  GLITCH_TEST("poly((k, gt, vl), n=n+1), n") {
+    glitch_set_voices(g, 128, GLITCH_STEAL_NONE);
+    ASSERT(glitch_eval(g) == 0);
+    glitch_midi(g, 0x90, 69, 100);
+    glitch_midi(g, 0x90, 70, 100);
+    ASSERT(glitch_eval(g) == 4);
+    ASSERT(glitch_eval(g) == 6);
+    glitch_midi(g, 0x80, 69, 0);
+    float buf[4096];
+    glitch_fill(g, buf, 4096, 1);
+    float n = glitch_eval(g);
+    ASSERT(glitch_eval(g) == n + 1);
+  }
+
+  /* A note after a reset retriggers the voice it is given */
+  GLITCH_TEST("poly((k, gt, vl), n=n+(k!=k)), n") {
+    glitch_midi(g, 0x90, 69, 100);
+    ASSERT(glitch_eval(g) == 1);
+    glitch_reset(g);
+    glitch_midi(g, 0x90, 69, 100);
+    ASSERT(glitch_eval(g) == 2);
+  }
+
+  /* Voices mirrored by k, g and v follow the variables set by the host */
+  GLITCH_TEST("poly((k, gt, vl), (n=n+(k!=k), k*vl))") {
+    glitch_set(g, "k0", 3);
+    glitch_set(g, "g0", 1);
+    glitch_set(g, "v0", 0.75);
+    float buf[1];
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(buf[0] == 3 * 0.75f / 3 && glitch_get(g, "n") == 1);
+    glitch_set(g, "v0", 0.5);
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(buf[0] == 3 * 0.5f / 3 && glitch_get(g, "n") == 1);
+    /* Gate off fades the voice out, a new gate is a new note */
+    glitch_set(g, "g0", NAN);
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(glitch_get(g, "v0") < 0.5f && glitch_get(g, "k0") == 3);
+    glitch_set(g, "g0", 1);
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(glitch_get(g, "n") == 2);
+    glitch_set(g, "k0", NAN);
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(buf[0] == 0 && isnan(glitch_get(g, "v0")));
+  }
+
+  /* And so do voices played by the program itself */
+  GLITCH_TEST("k1 = 2, g1 = 1, v1 = 1, poly((k, gt, vl), k)") {
+    ASSERT(glitch_eval(g) == 2.f / 3);
+    glitch_midi(g, 0x90, 69, 100);
+    ASSERT(glitch_get(g, "k0") == 0 && glitch_eval(g) == 2.f / 3);
+  }
+}
+
+static void test_sleep() {
+  printf("TEST: sleep\n");
+
+  /* Sleeping does not change the output of a settled envelope */
+  struct glitch *a = glitch_create();
+  struct glitch *b = glitch_create();
+  const char *sa = "env(x, 0.01, 0.02)";
+  const char *sb = "env((x, x + 0 * r()), 0.01, 0.02)";
+  glitch_compile(a, sa, strlen(sa));
+  glitch_compile(b, sb, strlen(sb));
+  ASSERT(a->e->param.func.f == &glitch_sleep_func);
+  ASSERT(b->e->param.func.f != &glitch_sleep_func);
+  struct sleep_context *sl = (struct sleep_context *)a->e->param.func.context;
+  float gates[] = {NAN, 1, NAN, 1};
+  int frames[] = {100, 3000, 100, 100};
+  int asleep[] = {1, 1, 1, 0};
+  for (int i = 0; i < 4; i++) {
+    glitch_set(a, "x", gates[i]);
+    glitch_set(b, "x", gates[i]);
+    for (int j = 0; j < frames[i]; j++) {
+      float va = glitch_eval(a);
+      float vb = glitch_eval(b);
+      if (va != vb) {
+        ASSERT(va == vb);
+        break;
+      }
+    }
+    ASSERT(sl->asleep == asleep[i]);
+  }
+  glitch_destroy(a);
+  glitch_destroy(b);
+
+  /* Gated-off voice sleeps and wakes up when its variables change */
+  GLITCH_TEST("x=1, env(y, 0.01, 0.02)") {
+    sl = (struct sleep_context *)vec_nth(&g->e->param.op.args, 1)
+             .param.func.context;
+    glitch_set(g, "y", NAN);
+    for (int i = 0; i < 4; i++) {
+      glitch_eval(g);
+    }
+    ASSERT(sl->asleep);
+    glitch_set(g, "y", 1);
     glitch_eval(g);
+    ASSERT(!sl->asleep);
+  }
+
+  /* Oscillators under a closed gate keep running */
+  a = glitch_create();
+  b = glitch_create();
+  sa = "y * sin(100)";
+  sb = "y * sin(100 + 0 * (z = 0))";
+  glitch_compile(a, sa, strlen(sa));
+  glitch_compile(b, sb, strlen(sb));
+  ASSERT(a->e->param.func.f == &glitch_sleep_func);
+  ASSERT(b->e->param.func.f != &glitch_sleep_func);
+  glitch_set(a, "y", NAN);
+  glitch_set(b, "y", NAN);
+  for (int i = 0; i < 300; i++) {
+    if (i == 200) {
+      glitch_set(a, "y", 1);
+      glitch_set(b, "y", 1);
+    }
+    float va = glitch_eval(a);
+    float vb = glitch_eval(b);
+    if (va != vb) {
+      ASSERT(va == vb);
+      break;
+    }
+  }
+  glitch_destroy(a);
+  glitch_destroy(b);
+}
+
+static void test_midi_at() {
+  printf("TEST: glitch_midi_at()\n");
+  GLITCH_TEST("x") {
+    float buf[512];
+    float lo = -64.f / 65.f;
+    float hi = 63.f / 65.f;
+    /* Events are applied at their frames, in order of frames */
+    glitch_midi_at(g, 700, 0xe0, 0, 127);
+    glitch_midi_at(g, 100, 0xe0, 0, 0);
+    glitch_midi_at(g, 300, 0xe0, 0, 64);
+    glitch_fill(g, buf, 512, 1);
+    ASSERT(buf[99] == 0 && buf[100] == lo && buf[299] == lo && buf[300] == 0);
+    ASSERT(g->nevents == 1);
+    glitch_fill(g, buf, 512, 1);
+    ASSERT(buf[187] == 0 && buf[188] == hi);
+    /* Late events are applied at the start of the next fill */
+    glitch_midi_at(g, 0, 0xe0, 0, 0);
+    glitch_fill(g, buf, 512, 1);
+    ASSERT(buf[0] == lo && g->nevents == 0);
+  }
+  /* A full queue drops messages but not note-offs */
+  GLITCH_TEST("g0") {
+    float buf[1];
+    ASSERT(glitch_midi_at(g, 1000, 0x90, 69, 64) == 0);
+    for (int i = 1; i < GLITCH_MAX_EVENTS; i++) {
+      ASSERT(glitch_midi_at(g, 1000 + i, 0xe0, 0, 0) == 0);
+    }
+    ASSERT(glitch_midi_at(g, 2000, 0xe0, 0, 0) == -1);
+    ASSERT(glitch_midi_at(g, 2000, 0x80, 69, 0) == 0);
+    ASSERT(g->nevents == GLITCH_MAX_EVENTS);
+    glitch_fill(g, buf, 1, 1);
+    ASSERT(buf[0] > 0);
+    while (g->frame <= 2000) {
+      glitch_fill(g, buf, 1, 1);
+    }
+    ASSERT(isnan(glitch_get(g, "g0")) && g->nevents == 0);
   }
-  double end = (double)clock() / CLOCKS_PER_SEC;
+  /* Variable changes are queued along with MIDI messages */
+  GLITCH_TEST("y") {
+    float buf[512];
+    glitch_set_at(g, 300, "y", 2);
+    glitch_set_at(g, 100, "y", 1);
+    ASSERT(glitch_midi_at(g, 200, 0x90, 69, 64) == 0);
+    glitch_fill(g, buf, 512, 1);
+    ASSERT(buf[99] == 0 && buf[100] == 1 && buf[299] == 1 && buf[300] == 2);
+    ASSERT(g->nevents == 0);
+    for (int i = 0; i < GLITCH_MAX_EVENTS; i++) {
+      ASSERT(glitch_set_at(g, 1000, "y", 3) == 0);
+    }
+    ASSERT(glitch_set_at(g, 1000, "y", 4) == -1);
+  }
+}
+
+static void test_sample_rate() {
+  printf("TEST: glitch_set_sample_rate()\n");
+  /* Instances with different rates are evaluated interchangeably */
+  GLITCH_TEST("t") {
+    struct glitch *h = glitch_create();
+    glitch_compile(h, "t", 1);
+    glitch_set_sample_rate(g, 8000);
+    glitch_set_sample_rate(h, 16000);
+    float a = 0, b = 0;
+    for (int i = 0; i < 5; i++) {
+      a = glitch_eval(g);
+      b = glitch_eval(h);
+    }
+    ASSERT(a == 3 && b == 1);
+    glitch_destroy(h);
+  }
+}
+
+static void test_cache() {
+  printf("TEST: render cache\n");
+  /* Programs that are not provably periodic are always rendered */
+  GLITCH_TEST("t") { ASSERT(g->cache == NULL); }
+  GLITCH_TEST("sin(440)") { ASSERT(g->cache == NULL); }
+  GLITCH_TEST("x = x + 1, byte(x)") { ASSERT(g->cache == NULL); }
+  GLITCH_TEST("byte(t * seq(120, 1, 2))") { ASSERT(g->cache == NULL); }
+  /* Cached playback matches rendering, including after a variable change */
+  const char *s = "byte(t * x ^ t >> 5) + seq(117.1875, 0, 1) / 4";
+  GLITCH_TEST(s) {
+    struct glitch *h = glitch_create();
+    glitch_compile(h, s, strlen(s));
+    glitch_cache_destroy(h->cache);
+    h->cache = NULL;
+    glitch_set_sample_rate(g, 8000);
+    glitch_set_sample_rate(h, 8000);
+    ASSERT(g->cache != NULL);
+    float a[500], b[500];
+    for (int i = 0; i < 400; i++) {
+      if (i == 200) {
+        glitch_set(g, "x", 3);
+        glitch_set(h, "x", 3);
+      }
+      glitch_fill(g, a, 250, 2);
+      glitch_fill(h, b, 250, 2);
+      ASSERT(memcmp(a, b, sizeof(a)) == 0);
+      if (i == 199 || i == 399) {
+        ASSERT(g->cache->period == 8192 && g->cache->len == 8192);
+      }
+    }
+    glitch_destroy(h);
+  }
+  /* Periods are played only while the products of t are exact in float */
+  s = "byte(t * 43)";
+  GLITCH_TEST(s) {
+    struct glitch *h = glitch_create();
+    glitch_compile(h, s, strlen(s));
+    glitch_cache_destroy(h->cache);
+    h->cache = NULL;
+    glitch_set_sample_rate(g, 8000);
+    glitch_set_sample_rate(h, 8000);
+    ASSERT(g->cache != NULL && g->cache->tmax == ((1L << 24) - 1) / 43);
+    float a[1024], b[1024];
+    for (int i = 0; i < 420000 / 512; i++) {
+      glitch_fill(g, a, 512, 2);
+      glitch_fill(h, b, 512, 2);
+      if (memcmp(a, b, sizeof(a)) != 0) {
+        ASSERT(memcmp(a, b, sizeof(a)) == 0);
+        break;
+      }
+    }
+    glitch_destroy(h);
+  }
+}
+
+static void test_tick() {
+  printf("TEST: glitch_set_tick()\n");
+  /* Held values match per-frame evaluation */
+  const char *s = "byte(t*(42&t>>10)) + byte(t*x) / 2";
+  GLITCH_TEST(s) {
+    struct glitch *h = glitch_create();
+    glitch_compile(h, s, strlen(s));
+    glitch_set_tick(h, GLITCH_TICK_OFF);
+    ASSERT(g->e->type == OP_FUNC && g->e->param.func.f == &glitch_tick_func);
+    for (int i = 0; i < 20000; i++) {
+      if (i == 10001) {
+        glitch_set(g, "x", 3);
+        glitch_set(h, "x", 3);
+      }
+      ASSERT(glitch_eval(g) == glitch_eval(h));
+    }
+    glitch_destroy(h);
+  }
+  /* Stateful and trivial subtrees are not wrapped */
+  GLITCH_TEST("sin(t>>4)") {
+    ASSERT(g->e->param.func.f != &glitch_tick_func);
+  }
+  /* Interpolation ramps to each tick value over the following tick */
+  GLITCH_TEST("(t & 255) / 2") {
+    glitch_set_sample_rate(g, 16000);
+    glitch_set_tick(g, GLITCH_TICK_LINEAR);
+    for (int i = 0; i < 100; i++) {
+      float v = glitch_eval(g);
+      ASSERT(v == (i < 3 ? 0 : (i - 3) / 4.f));
+    }
+  }
+}
+
+static void test_int() {
+  printf("TEST: integer kernel\n");
+  const char *progs[] = {
+      "byte(t*(42&t>>10))",
+      "byte((t/3>>4)^t%-100*(t>>6)%7)",
+      "byte(t*t>>3&t*5)",
+      "(t>>5)*((t&7)<3)+~t%13-(t>>4)/-3*2",
+      "byte(t*(t>>8|t>>9)&46&t>>8^(t&t>>13|t>>6))",
+  };
+  long starts[] = {0, (long)(GLITCH_INT_MAX - 200) *
+                          libglitch_default_sample_rate / 8000};
+  for (int i = 0; i < (int)(sizeof(progs) / sizeof(progs[0])); i++) {
+    for (int j = 0; j < 2; j++) {
+      struct glitch *g = glitch_create();
+      struct glitch *h = glitch_create();
+      ASSERT(glitch_compile(g, progs[i], strlen(progs[i])) == 0);
+      ASSERT(glitch_compile(h, progs[i], strlen(progs[i])) == 0);
+      glitch_set_tick(h, GLITCH_TICK_OFF);
+      g->frame = h->frame = starts[j];
+      /* Blocks match per-frame evaluation, also past the float range of t */
+      for (int k = 0; k < 20000; k++) {
+        float a = glitch_eval(g), b = glitch_eval(h);
+        if (memcmp(&a, &b, sizeof(float)) != 0) {
+          printf("FAIL: %s at frame %ld: %f != %f\n", progs[i], g->frame, a,
+                 b);
+          status = 1;
+          break;
+        }
+      }
+      glitch_destroy(g);
+      glitch_destroy(h);
+    }
+  }
+  GLITCH_TEST("byte(t*(42&t>>10))") {
+    struct expr *e = &vec_nth(&g->e->param.func.args, 0);
+    ASSERT(vec_nth(&e->param.func.args, 0).param.func.f == &glitch_int_func);
+  }
+  /* Division is only integer when it is truncated */
+  GLITCH_TEST("byte(t/3+t)") {
+    struct expr *e = &vec_nth(&g->e->param.func.args, 0);
+    ASSERT(vec_nth(&e->param.func.args, 0).type == OP_PLUS);
+  }
+}
+
+static void test_control() {
+  printf("TEST: glitch_set_control()\n");
+  /* Control arguments match per-frame evaluation */
+  const char *s = "sin(hz(seq(480, C4, (0.5, E4, G4), A4)) * (x + 1))";
+  GLITCH_TEST(s) {
+    struct glitch *h = glitch_create();
+    glitch_compile(h, s, strlen(s));
+    glitch_set_control(h, -1);
+    ASSERT(vec_nth(&g->e->param.func.args, 0).param.func.f ==
+           &glitch_control_func);
+    for (int i = 0; i < 30000; i++) {
+      if (i == 10001) {
+        glitch_set(g, "x", 1);
+        glitch_set(h, "x", 1);
+      }
+      ASSERT(glitch_eval(g) == glitch_eval(h));
+    }
+    glitch_destroy(h);
+  }
+  /* Audio-rate arguments are not wrapped */
+  GLITCH_TEST("sin(saw(1) * 100 + 440)") {
+    struct expr *e = &vec_nth(&g->e->param.func.args, 0); /* Asleep wrapper */
+    ASSERT(vec_nth(&e->param.func.args, 0).type != OP_FUNC);
+  }
+  /* Changes are ramped when requested */
+  GLITCH_TEST("sin(x * 100)") {
+    glitch_set_control(g, 4);
+    struct expr *e = &vec_nth(&g->e->param.func.args, 0); /* Asleep wrapper */
+    struct expr *w = &vec_nth(&e->param.func.args, 0);
+    struct control_context *cc =
+        (struct control_context *)w->param.func.context;
+    glitch_set(g, "x", 1);
+    glitch_eval(g);
+    glitch_set(g, "x", 2);
+    for (int i = 0; i < 6; i++) {
+      glitch_eval(g);
+      ASSERT(cc->out == (i < 4 ? 100 + 25 * i : 200));
+    }
+  }
+}
+
+static void test_threads() {
+  printf("TEST: glitch_set_threads()\n");
+  const char *progs[] = {
+      "bpm=120\np=seq(bpm/4, 0, 1, 3)\na=seq(bpm, 0, 7)\n"
+      "$(v, env($1*sin(hz($2)), 0.01, 0.2))\n"
+      "kick=v(seq(bpm, 1, 0), -24)\nlead=v(p&1, a+12)\n"
+      "mix(kick, (p>>1&1)*lead, 0.3*saw(hz(a-12)))",
+      "mix(tr808(seq(480, 0, 1), 1), 0.5*sin(hz(seq(120, 0, 4, 7))))",
+      "mix(x=sin(100), x*saw(50))",
+  };
+  int tracks[] = {3, 2, 0};
+  for (int i = 0; i < (int)(sizeof(progs) / sizeof(progs[0])); i++) {
+    struct glitch *g = glitch_create();
+    struct glitch *h = glitch_create();
+    struct expr *w[GLITCH_BRANCHES], *feeds[GLITCH_BRANCH_STMTS];
+    float a[1024], b[1024];
+    int nfeeds;
+    glitch_set_threads(g, 2);
+    ASSERT(glitch_compile(g, progs[i], strlen(progs[i])) == 0);
+    ASSERT(glitch_compile(h, progs[i], strlen(progs[i])) == 0);
+    ASSERT(glitch_branch_tracks(g->e, w, feeds, &nfeeds) == tracks[i]);
+    /* Tracks rendered ahead match serial evaluation */
+    for (int k = 0; k < 100; k++) {
+      glitch_fill(g, a, 512, 2);
+      glitch_fill(h, b, 512, 2);
+      if (memcmp(a, b, sizeof(a)) != 0) {
+        printf("FAIL: %s differs in block %d\n", progs[i], k);
+        status = 1;
+        break;
+      }
+    }
+    glitch_destroy(g);
+    glitch_destroy(h);
+  }
+}
+
+static void test_pipeline() {
+  printf("TEST: glitch_set_pipeline()\n");
+  const char *progs[] = {
+      "bpm=120\na=seq(bpm*2, 0, 3, 7)\nb=seq(bpm, 0, 5)\n"
+      "mix(delay(lpf(saw(hz(a+x)), 800), 0.25, 0.5, 0.5),\n"
+      "delay(hpf(sqr(hz(b-12))+r(0.1), 300), 0.1, 0.4, 0.3), sin(hz(a)))",
+      "n=seq(120, 0, 3, 7)\nlead=lpf(saw(hz(n))+saw(hz(n+0.1)), 1200)\n"
+      "delay(lead, 0.3, 0.5, 0.6)",
+      "y=sin(100)\ndelay(lpf(saw(50)*y, 500), 0.1, 0.5, 0.5)+y",
+      "y=r(1)\ndelay(lpf(y, 500), 0.1, 0.5, 0.5)+y",
+  };
+  int stages[] = {2, 1, 1, 0};
+  for (int i = 0; i < (int)(sizeof(progs) / sizeof(progs[0])); i++) {
+    struct glitch *g = glitch_create();
+    struct glitch *h = glitch_create();
+    struct expr *w[GLITCH_BRANCHES];
+    float a[1024], b[1024];
+    int n = 0;
+    glitch_set_threads(g, 2);
+    glitch_set_pipeline(g, 1);
+    ASSERT(glitch_compile(g, progs[i], strlen(progs[i])) == 0);
+    ASSERT(glitch_compile(h, progs[i], strlen(progs[i])) == 0);
+    glitch_stage_collect(g->e, w, &n);
+    ASSERT(n == stages[i]);
+    ASSERT(glitch_latency(g) == (n > 0 ? GLITCH_BRANCH_BLOCK : 0));
+    /* Stages rendered ahead match serial evaluation */
+    for (int k = 0; k < 100; k++) {
+      glitch_fill(g, a, 512, 2);
+      glitch_fill(h, b, 512, 2);
+      if (memcmp(a, b, sizeof(a)) != 0) {
+        printf("FAIL: %s differs in block %d\n", progs[i], k);
+        status = 1;
+        break;
+      }
+    }
+    glitch_destroy(g);
+    glitch_destroy(h);
+  }
+}
+
+static void test_load() {
+  printf("TEST: glitch_get_load()\n");
+  struct glitch *g = glitch_create();
+  float buf[512];
+  int16_t s16[512];
+  ASSERT(glitch_compile(g, "lpf(saw(100), 800)", 18) == 0);
+  ASSERT(glitch_get_load(g).fills == 0);
+  for (int i = 0; i < 10; i++) {
+    glitch_fill(g, buf, 256, 2);
+  }
+  glitch_fill_s16(g, s16, 256, 2);
+  struct glitch_load l = glitch_get_load(g);
+  ASSERT(l.fills == 11);
+  ASSERT(l.last > 0 && l.average > 0 && l.peak >= l.last);
+  ASSERT(l.late <= l.fills);
+  glitch_xrun(g, 2, 1);
+  glitch_xrun(g, 1, 0);
+  l = glitch_get_load(g);
+  ASSERT(l.underruns == 3 && l.overruns == 1);
+  glitch_reset_load(g);
+  l = glitch_get_load(g);
+  ASSERT(l.fills == 0 && l.peak == 0 && l.underruns == 0);
+  glitch_destroy(g);
+}
+
+static void test_profile() {
+  printf("TEST: glitch_profile()\n");
+  const char *src = "a=sin(440)\nlpf(a*2, 800)";
+  struct glitch *g = glitch_create();
+  float buf[128];
+  ASSERT(glitch_compile(g, src, strlen(src)) == 0);
+  glitch_fill(g, buf, 64, 2);
+  FILE *f = tmpfile();
+#ifdef EXPR_PROFILE
+  char out[4096] = {0};
+  ASSERT(glitch_profile(g, src, f, GLITCH_PROFILE_FOLDED) == 0);
+  rewind(f);
+  ASSERT(fread(out, 1, sizeof(out) - 1, f) > 0);
+  /* Stacks are labelled by source positions and counted in cycles */
+  ASSERT(strstr(out, ";sin@1:3 ") != NULL);
+  ASSERT(strstr(out, ";lpf@2:1;") != NULL);
+  ASSERT(strstr(out, ";*@2:5 ") != NULL);
+  ASSERT(strstr(out, ",") == NULL);
+  rewind(f);
+  ASSERT(glitch_profile(g, NULL, f, GLITCH_PROFILE_TABLE) == 0);
+  rewind(f);
+  memset(out, 0, sizeof(out));
+  ASSERT(fread(out, 1, sizeof(out) - 1, f) > 0);
+  ASSERT(strstr(out, "          64") != NULL);
+  ASSERT(strstr(out, " sin@2\n") != NULL);
+  ASSERT(strstr(out, " lpf\n") != NULL);
+#else
+  ASSERT(glitch_profile(g, src, f, GLITCH_PROFILE_FOLDED) == -1);
+#endif
+  fclose(f);
+  glitch_destroy(g);
+}
+
+static void *test_trace_worker(void *arg) {
+  glitch_trace_instant("worker", (long)arg);
+  return NULL;
+}
+
+static void test_trace() {
+  printf("TEST: glitch_trace_dump()\n");
+  struct glitch *g = glitch_create();
+  float buf[128];
+  char out[8192] = {0};
+  glitch_trace_start();
+  glitch_trace_thread("test \"main\"");
+  ASSERT(glitch_compile(g, "sin(440)", 8) == 0);
+  glitch_fill(g, buf, 64, 2);
+  glitch_midi(g, 0x90, 69, 100);
+  glitch_trace_complete("host", glitch_trace_now(), 10);
+  /* Rings of threads that exited are claimed again */
+  for (long i = 0; i < GLITCH_TRACE_THREADS * 2; i++) {
+    pthread_t thread;
+    ASSERT(pthread_create(&thread, NULL, test_trace_worker, (void *)i) == 0);
+    pthread_join(thread, NULL);
+  }
+  glitch_trace_stop();
+  /* Nothing is recorded while stopped */
+  glitch_trace_instant("stopped", 0);
+  FILE *f = tmpfile();
+  ASSERT(glitch_trace_dump(f) == 0);
+  rewind(f);
+  ASSERT(fread(out, 1, sizeof(out) - 1, f) > 0);
+  ASSERT(strncmp(out, "{\"displayTimeUnit\"", 18) == 0);
+  ASSERT(strstr(out, "\"test \\\"main\\\"\"") != NULL);
+  ASSERT(strstr(out, "{\"name\": \"compile\", \"ph\": \"B\"") != NULL);
+  ASSERT(strstr(out, "{\"name\": \"parse\", \"ph\": \"E\"") != NULL);
+  ASSERT(strstr(out, "{\"name\": \"swap\", \"ph\": \"i\"") != NULL);
+  ASSERT(strstr(out, "{\"name\": \"fill\", \"ph\": \"X\"") != NULL);
+  ASSERT(strstr(out, "\"args\": {\"value\": 64}") != NULL);
+  ASSERT(strstr(out, "\"args\": {\"value\": 9454948}") != NULL);
+  ASSERT(strstr(out, "\"name\": \"host\"") != NULL);
+  ASSERT(strstr(out, "\"args\": {\"value\": 127}") != NULL);
+  ASSERT(strstr(out, "\"args\": {\"value\": 126}") == NULL);
+  ASSERT(strstr(out, "stopped") == NULL);
+  ASSERT(strstr(out, "\n]}\n") != NULL);
+  fclose(f);
+  glitch_destroy(g);
+}
+
+static void test_record() {
+  printf("TEST: glitch_record()\n");
+  const char *a = "bpm=0,each((k,v),v*saw(hz(k)),(k0,v0),(k1,v1))+x*sin(220)";
+  const char *b = "lpf(sqr(hz(y*12))*r(1), 800)";
+  struct glitch *g = glitch_create();
+  float buf[512], out[8192];
+  int16_t s16[512];
+  size_t n = 0;
+  FILE *f = tmpfile();
+  ASSERT(glitch_record(g, f) == 0);
+  glitch_set_control(g, 32);
+  ASSERT(glitch_compile(g, a, strlen(a)) == 0);
+  glitch_midi(g, 0x90, 69, 100);
+  glitch_midi_at(g, 300, 0x90, 72, 80);
+  for (int i = 0; i < 4; i++) {
+    glitch_fill(g, buf, 128, 2);
+    memcpy(out + n, buf, 256 * sizeof(float));
+    n = n + 256;
+  }
+  glitch_set(g, "x", 0.5);
+  glitch_fill(g, buf, 100, 1);
+  memcpy(out + n, buf, 100 * sizeof(float));
+  n = n + 100;
+  glitch_midi(g, 0x80, 69, 0);
+  /* Formats other than float are replayed as float fills of their blocks */
+  glitch_fill_s16(g, s16, 64, 2);
+  ASSERT(glitch_compile(g, b, strlen(b)) == 0);
+  glitch_set(g, "y", 0.25);
+  glitch_fill(g, buf, 200, 2);
+  memcpy(out + n, buf, 400 * sizeof(float));
+  n = n + 400;
+  glitch_reset(g);
+  glitch_fill(g, buf, 50, 2);
+  ASSERT(glitch_record(g, NULL) == 0);
+  glitch_destroy(g);
+
+  rewind(f);
+  g = glitch_create();
+  FILE *r = tmpfile();
+  uint64_t hash = 0xcbf29ce484222325ULL, expect = hash;
+  ASSERT(glitch_replay(g, f, r, NULL, &hash) ==
+         128 * 4 + 100 + 64 + 200 + 50);
+  ASSERT(g->control == 32);
+  rewind(r);
+  float replayed[8192];
+  ASSERT(fread(replayed, sizeof(float), 8192, r) == n + 128 + 100);
+  /* The hash covers the same frames as the output */
+  for (size_t i = 0; i < (n + 128 + 100) * sizeof(float); i++) {
+    expect = (expect ^ ((unsigned char *)replayed)[i]) * 0x100000001b3ULL;
+  }
+  ASSERT(hash == expect);
+  /* Frames up to the s16 fill and after it are identical */
+  ASSERT(memcmp(replayed, out, (n - 400) * sizeof(float)) == 0);
+  ASSERT(memcmp(replayed + n - 400 + 128, out + n - 400,
+                400 * sizeof(float)) == 0);
+  glitch_destroy(g);
+
+  /* A log must start with its header */
+  rewind(f);
+  fputc('X', f);
+  rewind(f);
+  g = glitch_create();
+  ASSERT(glitch_replay(g, f, NULL, NULL, NULL) == -1);
   glitch_destroy(g);
-  double ns = 1000000000 * (end - start) / N;
-  printf("BENCH %40s:\t%f ns/op (%dM op/sec)\n", s, ns, (int)(1000 / ns));
+  fclose(r);
+  fclose(f);
 }
 
-static void run_benchmarks() {
-  printf("\n## Arithmetics\n");
-  test_benchmark("0");
-  test_benchmark("x=x+1");
-  test_benchmark("byte(t*(42&t>>10))");
-
-  printf("\n## Instruments\n");
-  test_benchmark("sin(440)");
-  test_benchmark("saw(440)");
-  test_benchmark("tri(440)");
-  test_benchmark("sqr(440)");
-  test_benchmark("fm(440,1,1)");
-  /*test_benchmark("piano(440)");*/
-  test_benchmark("pluck(440)");
-  test_benchmark("tr808(BD,1)");
-
-  printf("\n## Sequencers\n");
-  test_benchmark("a(i=i+1,1,2,3,4)");
-  test_benchmark("s(i=i+1/6)");
-  test_benchmark("seq(120,1,2,3,4)");
-  test_benchmark("seq(120,(0.5,1),2,(2,3),(1.5,4))");
-  test_benchmark("seq((2,120),(0.5,1),2,(2,3),(1.5,4))");
-  test_benchmark("seq(120*2,1,2,0,0,3,4,0,0)");
-  test_benchmark("loop(120,1,2,3,4)");
-  /* TODO: nested sequences */
-  /* TODO: variable bpm and offset */
-
-  printf("\n## Effects\n");
-  test_benchmark("lpf(saw(440))");
-  test_benchmark("hpf(saw(440))");
-  test_benchmark("bpf(saw(440))");
-  test_benchmark("bsf(saw(440))");
-  test_benchmark("delay(saw(seq(120,440)),0.1,0.5,0.5)");
-
-  printf("\n## Utils\n");
-  test_benchmark("hz(A4)");
-  test_benchmark("scale(42)");
-  test_benchmark("r()");
-  test_benchmark("env(sin(seq(120,440)),0.1,0.3)");
-  test_benchmark("mix(sin(220),sin(440),sin(880),sin(110))");
-  test_benchmark("(sin(220)+sin(440)+sin(880)+sin(110))/4");
-  test_benchmark("each(f,sin(f),220,440,880,110)/4");
-  test_benchmark("delay(sin(440),0.25,0.5,0.5)");
-  test_benchmark("delay(sin(440),0.25+sin(4)/10,0.5,0.5)");
+static void test_snapshot() {
+  printf("TEST: glitch_snapshot()\n");
+  const char *src =
+      "a=seq(240,1,2,(1,3,5)),"
+      "mix(sin(hz(a*3)),delay(pluck(hz(a),0.5),0.01,0.5,0.3),"
+      "lpf(saw(110)*env(seq(480,1,0)),800),each(k,tri(k*110)*r(1),1,2),"
+      "poly((k,g,v),v*fm(hz(k),1,0.5)),loop(120,0,t&255)/256)";
+  struct glitch *g = glitch_create();
+  struct glitch *h = glitch_create();
+  static float a[4096], b[4096];
+  ASSERT(glitch_compile(g, src, strlen(src)) == 0);
+  ASSERT(glitch_compile(h, src, strlen(src)) == 0);
+  glitch_midi(g, 0x90, 60, 100);
+  glitch_midi_at(g, 6000, 0x80, 60, 0);
+  glitch_set_at(g, 11000, "x", 1);
+  for (int i = 0; i < 10; i++) {
+    glitch_fill(g, a, 1000, 2);
+  }
+  long n = glitch_snapshot(g, NULL, 0);
+  ASSERT(n > 0);
+  unsigned char *snap = malloc(n);
+  ASSERT(glitch_snapshot(g, snap, n) == n);
+  glitch_fill(g, a, 2048, 2);
+
+  /* Another instance continues from the snapshot */
+  ASSERT(glitch_restore(h, snap, n) == 0);
+  ASSERT(h->frame == 10000 && h->nevents == 1);
+  ASSERT(h->events[0].var == expr_var(&h->vars, "x", 1));
+  glitch_fill(h, b, 2048, 2);
+  ASSERT(memcmp(a, b, sizeof(a)) == 0);
+
+  /* So does the same instance after rendering further */
+  glitch_fill(g, b, 1000, 2);
+  ASSERT(glitch_restore(g, snap, n) == 0);
+  glitch_fill(g, b, 2048, 2);
+  ASSERT(memcmp(a, b, sizeof(a)) == 0);
+
+  /* Programs of another shape and truncated snapshots are rejected, the
+   * state is left as it was */
+  long m = glitch_snapshot(g, NULL, 0);
+  unsigned char *before = malloc(m), *after = malloc(m);
+  ASSERT(glitch_snapshot(g, before, m) == m);
+  ASSERT(glitch_restore(g, snap, n - 1) == -1);
+  ASSERT(glitch_snapshot(g, after, m) == m);
+  ASSERT(memcmp(before, after, m) == 0);
+  ASSERT(glitch_compile(h, "sin(440)", 8) == 0);
+  glitch_fill(h, b, 16, 2);
+  ASSERT(glitch_restore(h, snap, n) == -1);
+  free(before);
+  free(after);
+  free(snap);
+  glitch_destroy(g);
+  glitch_destroy(h);
+
+  /* Restores are logged and replayed */
+  FILE *f = tmpfile(), *r = tmpfile();
+  g = glitch_create();
+  ASSERT(glitch_record(g, f) == 0);
+  ASSERT(glitch_compile(g, "saw(110)+seq(240,1,2,3)", 23) == 0);
+  glitch_fill(g, a, 1000, 2);
+  n = glitch_snapshot(g, NULL, 0);
+  snap = malloc(n);
+  ASSERT(glitch_snapshot(g, snap, n) == n);
+  glitch_fill(g, a, 500, 2);
+  ASSERT(glitch_restore(g, snap, n) == 0);
+  ASSERT(glitch_restore(g, snap, n - 1) == -1);
+  glitch_fill(g, a, 1000, 2);
+  ASSERT(glitch_record(g, NULL) == 0);
+  glitch_destroy(g);
+  rewind(f);
+  g = glitch_create();
+  ASSERT(glitch_replay(g, f, r, NULL, NULL) == 2500);
+  ASSERT(g->frame == 2000);
+  ASSERT(fseek(r, -2000 * (long)sizeof(float), SEEK_END) == 0);
+  ASSERT(fread(b, sizeof(float), 2000, r) == 2000);
+  ASSERT(memcmp(a, b, 2000 * sizeof(float)) == 0);
+  free(snap);
+  glitch_destroy(g);
+  fclose(r);
+  fclose(f);
 }
 
 int main() {
@@ -450,8 +1350,24 @@ int main() {
   test_seq();
   test_env();
   test_delay();
-
-  run_benchmarks();
+  test_fill();
+  test_channels();
+  test_formats();
+  test_poly();
+  test_sleep();
+  test_midi_at();
+  test_sample_rate();
+  test_cache();
+  test_tick();
+  test_control();
+  test_int();
+  test_threads();
+  test_pipeline();
+  test_load();
+  test_profile();
+  test_trace();
+  test_record();
+  test_snapshot();
 
   return status;
 }
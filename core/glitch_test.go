@@ -1,6 +1,17 @@
 package core
 
-import "testing"
+import (
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"reflect"
+	"runtime"
+	"strings"
+	"testing"
+	"time"
+)
 
 func eval(g Glitch) float32 {
 	f32 := []float32{0}
@@ -71,3 +82,317 @@ func TestGlitchSamples(t *testing.T) {
 		t.Error("bar() should not be present, but compile succeeds")
 	}
 }
+
+func TestGlitchFillInt(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+
+	g.Compile("out(-1, 1)")
+	s16 := make([]int16, 4)
+	g.FillInt16(s16, 2, 2)
+	if s16[0] > -32766 || s16[1] < 32766 {
+		t.Error("expected full scale int16 samples, got", s16)
+	}
+	s32 := make([]int32, 2)
+	g.FillInt32(s32, 1, 2)
+	if s32[0] != -2147483648 {
+		t.Error("expected full scale int32 samples, got", s32)
+	}
+}
+
+func TestGlitchLoad(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+
+	g.Compile("lpf(saw(100), 800)")
+	buf := make([]float32, 512)
+	for i := 0; i < 4; i++ {
+		g.Fill(buf, 256, 2)
+	}
+	g.Xrun(1, 2)
+	if l := g.Load(); l.Fills != 4 || l.Peak <= 0 || l.Underruns != 1 || l.Overruns != 2 {
+		t.Error("unexpected load", l)
+	}
+	g.ResetLoad()
+	if l := g.Load(); l != (Load{}) {
+		t.Error("expected load to be cleared, got", l)
+	}
+}
+
+func TestGlitchProfile(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+
+	src := "lpf(sin(440), 800)"
+	g.Compile(src)
+	g.Fill(make([]float32, 128), 64, 2)
+	path := filepath.Join(os.TempDir(), "glitch_test.folded")
+	defer os.Remove(path)
+	if err := g.Profile(path, src, false); err == ErrNoProfile {
+		t.Skip(err)
+	} else if err != nil {
+		t.Fatal(err)
+	}
+	if b, err := ioutil.ReadFile(path); err != nil || !strings.Contains(string(b), ";sin@1:5 ") {
+		t.Error("expected folded stacks of sin(), got", string(b), err)
+	}
+}
+
+func TestRecord(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+
+	path := filepath.Join(os.TempDir(), "glitch_test.log")
+	defer os.Remove(path)
+	if err := g.Record(path); err != nil {
+		t.Fatal(err)
+	}
+	g.Compile("sin(440)")
+	g.Set("x", 1)
+	g.MIDI([]byte{0x90, 69, 100})
+	g.Fill(make([]float32, 128), 64, 2)
+	if err := g.Record(""); err != nil {
+		t.Fatal(err)
+	}
+	b, err := ioutil.ReadFile(path)
+	if err != nil || !strings.HasPrefix(string(b), "GLITCHREC1\n") ||
+		!strings.Contains(string(b), "sin(440)") {
+		t.Error("expected a log of the session, got", b, err)
+	}
+}
+
+func TestSnapshot(t *testing.T) {
+	g, h := NewGlitch(), NewGlitch()
+	defer g.Destroy()
+	defer h.Destroy()
+
+	src := "lpf(saw(seq(240, 100, 200)), 800) + delay(sin(440), 0.1, 0.5, 0.5)"
+	g.Compile(src)
+	h.Compile(src)
+	a, b := make([]float32, 1024), make([]float32, 1024)
+	g.Fill(a, 512, 2)
+	state, err := g.Snapshot()
+	if err != nil {
+		t.Fatal(err)
+	}
+	g.Fill(a, 512, 2)
+	if err := h.Restore(state); err != nil {
+		t.Fatal(err)
+	}
+	h.Fill(b, 512, 2)
+	if !reflect.DeepEqual(a, b) {
+		t.Error("restored instance renders different samples")
+	}
+	h.Compile("sin(440)")
+	h.Fill(b, 1, 1)
+	if err := h.Restore(state); err != ErrSnapshot {
+		t.Error("expected ErrSnapshot for another program, got", err)
+	}
+}
+
+func TestTrace(t *testing.T) {
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	g := NewGlitch()
+	defer g.Destroy()
+
+	TraceStart()
+	TraceBegin("test")
+	g.Compile("sin(440)")
+	g.Fill(make([]float32, 128), 64, 2)
+	TraceInstant("marker", 42)
+	TraceSpan("span")()
+	TraceEnd("test")
+	TraceStop()
+	path := filepath.Join(os.TempDir(), "glitch_test.json")
+	defer os.Remove(path)
+	if err := TraceDump(path); err != nil {
+		t.Fatal(err)
+	}
+	b, err := ioutil.ReadFile(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	trace := struct {
+		TraceEvents []struct {
+			Name string `json:"name"`
+			Ph   string `json:"ph"`
+		} `json:"traceEvents"`
+	}{}
+	if err := json.Unmarshal(b, &trace); err != nil {
+		t.Fatal(err, string(b))
+	}
+	seen := map[string]bool{}
+	for _, e := range trace.TraceEvents {
+		seen[e.Name+"/"+e.Ph] = true
+	}
+	for _, name := range []string{"test/B", "test/E", "marker/i", "span/X", "compile/B", "fill/X"} {
+		if !seen[name] {
+			t.Error("expected event", name, "in", string(b))
+		}
+	}
+}
+
+func poolTasks(n, frames int) []Task {
+	tasks := []Task{}
+	for i := 0; i < n; i++ {
+		g := NewGlitch()
+		g.Compile(fmt.Sprintf("lpf(saw(%d) + sin(%d), 800)", 100+i, 200+i))
+		tasks = append(tasks, Task{Glitch: g, Buf: make([]float32, frames*2), Frames: frames, Channels: 2})
+	}
+	return tasks
+}
+
+func TestPool(t *testing.T) {
+	p := NewPool(4)
+	defer p.Close()
+	tasks := poolTasks(10, 512)
+	expect := poolTasks(10, 512)
+	for i := 0; i < 3; i++ {
+		p.Fill(tasks)
+		for j, task := range expect {
+			task.Glitch.Fill(task.Buf, task.Frames, task.Channels)
+			if !reflect.DeepEqual(task.Buf, tasks[j].Buf) {
+				t.Fatal("pool output differs from sequential rendering", i, j)
+			}
+		}
+	}
+	for i := range tasks {
+		tasks[i].Glitch.Destroy()
+		expect[i].Glitch.Destroy()
+	}
+}
+
+func TestAhead(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+	expect := NewGlitch()
+	defer expect.Destroy()
+	for _, x := range []Glitch{g, expect} {
+		x.Compile("lpf(saw(100) + sin(220), 800)")
+	}
+	a := NewAhead(g, 2000, 256, 2)
+	defer a.Close()
+	if a.Size() != 2048 {
+		t.Fatal("expected ring size rounded up to blocks, got", a.Size())
+	}
+	buf := make([]float32, 512*2)
+	ref := make([]float32, 512*2)
+	for i := 0; i < 10; i++ {
+		for a.Occupancy() < a.Size() {
+			time.Sleep(time.Millisecond)
+		}
+		a.Read(buf, 512, 2)
+		expect.Fill(ref[:256*2], 256, 2)
+		expect.Fill(ref[256*2:], 256, 2)
+		if !reflect.DeepEqual(buf, ref) {
+			t.Fatal("ring output differs from sequential rendering", i)
+		}
+	}
+	if a.Underruns() != 0 {
+		t.Error("expected no underruns, got", a.Underruns())
+	}
+}
+
+func TestAheadEvents(t *testing.T) {
+	g := NewGlitch()
+	defer g.Destroy()
+	g.Compile("x")
+	a := NewAhead(g, 2048, 256, 1)
+	defer a.Close()
+	buf := make([]float32, 512)
+	full := func() {
+		for a.Occupancy() < a.Size() {
+			time.Sleep(time.Millisecond)
+		}
+	}
+	// Frames rendered before a flush are never played
+	full()
+	g.Set("x", 2)
+	a.Flush()
+	full()
+	a.Read(buf, 512, 1)
+	for i, x := range buf {
+		if x != 2 {
+			t.Fatal("expected frames rendered after flush", i, x)
+		}
+	}
+	// Changes are delayed by the ring, like MIDI messages
+	full()
+	if err := g.SetAt("x", 3, time.Now()); err != nil {
+		t.Fatal(err)
+	}
+	if g.Get("x") != 2 {
+		t.Fatal("expected change to be queued, got", g.Get("x"))
+	}
+	for i := 0; i < 4; i++ {
+		a.Read(buf, 512, 1)
+		if buf[511] != 2 {
+			t.Fatal("expected change after the ring is played", i, buf[511])
+		}
+	}
+	full()
+	for i := 0; i < 4; i++ {
+		a.Read(buf, 512, 1)
+	}
+	if buf[511] != 3 {
+		t.Fatal("expected changed variable, got", buf[511])
+	}
+	if a.Underruns() != 0 {
+		t.Error("expected no underruns, got", a.Underruns())
+	}
+}
+
+func BenchmarkPool(b *testing.B) {
+	for _, n := range []int{1, 2, 4, 8} {
+		b.Run(fmt.Sprintf("workers=%d", n), func(b *testing.B) {
+			p := NewPool(n)
+			defer p.Close()
+			tasks := poolTasks(32, 512)
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				p.Fill(tasks)
+			}
+			b.StopTimer()
+			for _, task := range tasks {
+				task.Glitch.Destroy()
+			}
+		})
+	}
+}
+
+func BenchmarkTick(b *testing.B) {
+	files, _ := filepath.Glob("../examples/bytebeat/*.glitch")
+	modes := []struct {
+		name string
+		mode TickMode
+	}{{"off", TickOff}, {"hold", TickHold}, {"linear", TickLinear}}
+	buf := make([]float32, 512)
+	for _, m := range modes {
+		for _, file := range files {
+			text, err := ioutil.ReadFile(file)
+			if err != nil {
+				b.Fatal(err)
+			}
+			name := m.name + "/" + filepath.Base(file)
+			b.Run(name, func(b *testing.B) {
+				// A fresh instance renders one second, before the render cache
+				// would take over
+				for i := 0; i < b.N; i++ {
+					b.StopTimer()
+					g := NewGlitch()
+					g.SetTick(m.mode)
+					if err := g.Compile(string(text)); err != nil {
+						b.Fatal(err)
+					}
+					b.StartTimer()
+					for n := 0; n < sampleRate; n = n + len(buf) {
+						g.Fill(buf, len(buf), 1)
+					}
+					b.StopTimer()
+					g.Destroy()
+				}
+			})
+		}
+	}
+}
@@ -3,31 +3,70 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef LIBGLITCH_TEST
 //
-// Test helpers: assert and benchmark macros
+// Test helpers: assert macro, kernels are timed by glitch_bench
 //
 #include <stdio.h>
-#include <time.h>
 #define libglitch_assert(cond) (!(cond) ? printf("FAIL: %s\n", #cond) : 0);
-#define libglitch_bench_clock() ((float)clock() * 1000000000L / CLOCKS_PER_SEC)
-#define libglitch_bench(_name, _iter)                                          \
-  for (long _start_ns = libglitch_bench_clock(), _i = (_iter);                 \
-       _i > 0 || (printf("BENCH: %30s: %f ns/op\n", _name,                     \
-			 (libglitch_bench_clock() - _start_ns) / _iter),       \
-		  0);                                                          \
-       _i--)
-// Number of benchmark iterations
-static long N = 1000000L;
-// Variables used inside the benchmark loop to prevent loop optimizations
-static volatile float x, y;
 
 #endif /* LIBGLITCH_TEST */
 
-// Audio engine sample rate. Used to advance oscillators at the given frequency.
-static int libglitch_sample_rate;
+// Thread-local storage, so that engine instances may render concurrently
+#if defined(_MSC_VER)
+#define LIBGLITCH_TLS __declspec(thread)
+#else
+#define LIBGLITCH_TLS __thread
+#endif
+
+// Default audio engine sample rate.
+static int libglitch_default_sample_rate;
+// Sample rate of the instance rendered by the current thread. Used to advance
+// oscillators at the given frequency.
+static LIBGLITCH_TLS int libglitch_sample_rate;
+
+// Flushes a value decaying towards zero in a feedback path before it becomes
+// subnormal, arithmetic on subnormals is very slow on most CPUs.
+static inline float libglitch_flush(float x) {
+  return (fabsf(x) < 1e-20f ? 0.f : x);
+}
+
+// Enables flush-to-zero and denormals-are-zero modes, returns the previous
+// mode to be passed to libglitch_denormals_restore().
+static inline unsigned long libglitch_denormals_off(void) {
+#if defined(__SSE__) || defined(_M_X64)
+  unsigned int csr = _mm_getcsr();
+  _mm_setcsr(csr | 0x8040); // FTZ | DAZ
+  return csr;
+#elif defined(__aarch64__)
+  unsigned long fpcr;
+  __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr | (1UL << 24))); // FZ
+  return fpcr;
+#else
+  return 0;
+#endif
+}
+
+static inline void libglitch_denormals_restore(unsigned long mode) {
+#if defined(__SSE__) || defined(_M_X64)
+  _mm_setcsr((unsigned int)mode);
+#elif defined(__aarch64__)
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(mode));
+#else
+  (void)mode;
+#endif
+}
 
 // Interpolation util. XXX currently does not interploate at all.
 static inline float libglitch_interpolate(float *arr, size_t len, float index) {
@@ -53,31 +92,132 @@ static float libglitch_wrap(float x) {
 // =================================
 // r: pseudo-random number generator
 // =================================
+//
+// Four interleaved xoshiro128+ generators, one per SIMD lane. Numbers are
+// produced in blocks and handed out one by one, so the SSE2 path gives the
+// same values as the scalar one. Each stream is seeded from a seed and a
+// stream number, so that independent streams can be split from one seed.
+#define LIBGLITCH_RAND_BLOCK 64
+
+typedef struct libglitch_rand {
+  int init;
+  int n;          // Numbers left in the block
+  uint32_t s[16]; // Generator state, four words per lane
+  float block[LIBGLITCH_RAND_BLOCK];
+} libglitch_rand_t;
+
+// Default seed, used by streams that are not bound to an engine instance
 static unsigned long long libglitch_rand_seed;
 
-static inline void libglitch_rand_init(unsigned long long seed) {
-  libglitch_rand_seed = seed;
+static inline uint64_t libglitch_splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
-static inline float libglitch_rand(float max) {
-  libglitch_rand_seed = 6364136223846793005ULL * libglitch_rand_seed + 1;
-  return (libglitch_rand_seed >> 33) * max / 0x7fffffff;
+static inline void libglitch_rand_init(libglitch_rand_t *r,
+				       unsigned long long seed,
+				       unsigned long stream) {
+  uint64_t x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+  for (int i = 0; i < 16; i += 2) {
+    uint64_t z = libglitch_splitmix64(&x);
+    r->s[i] = (uint32_t)z;
+    r->s[i + 1] = (uint32_t)(z >> 32);
+  }
+  r->init = 1;
+  r->n = 0;
+}
+
+// Fills out with n uniform numbers in the range [0..1), bypassing the block
+static void libglitch_rand_fill(libglitch_rand_t *r, float *out, size_t n) {
+  size_t i = 0;
+  uint32_t *s = r->s;
+#if defined(__SSE2__)
+  __m128i s0 = _mm_loadu_si128((__m128i *)(s + 0));
+  __m128i s1 = _mm_loadu_si128((__m128i *)(s + 4));
+  __m128i s2 = _mm_loadu_si128((__m128i *)(s + 8));
+  __m128i s3 = _mm_loadu_si128((__m128i *)(s + 12));
+  const __m128 k = _mm_set1_ps(1.f / 16777216.f);
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = _mm_add_epi32(s0, s3);
+    __m128i t = _mm_slli_epi32(s1, 9);
+    s2 = _mm_xor_si128(s2, s0);
+    s3 = _mm_xor_si128(s3, s1);
+    s1 = _mm_xor_si128(s1, s2);
+    s0 = _mm_xor_si128(s0, s3);
+    s2 = _mm_xor_si128(s2, t);
+    s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+    x = _mm_srli_epi32(x, 8);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x), k));
+  }
+  _mm_storeu_si128((__m128i *)(s + 0), s0);
+  _mm_storeu_si128((__m128i *)(s + 4), s1);
+  _mm_storeu_si128((__m128i *)(s + 8), s2);
+  _mm_storeu_si128((__m128i *)(s + 12), s3);
+#endif
+  for (; i < n; i += 4) {
+    for (size_t j = 0; j < 4 && j < n - i; j++) {
+      uint32_t *l = s + j;
+      uint32_t x = l[0] + l[12];
+      uint32_t t = l[4] << 9;
+      l[8] ^= l[0];
+      l[12] ^= l[4];
+      l[4] ^= l[8];
+      l[0] ^= l[12];
+      l[8] ^= t;
+      l[12] = (l[12] << 11) | (l[12] >> 21);
+      out[i + j] = (float)(x >> 8) * (1.f / 16777216.f);
+    }
+  }
+}
+
+static inline float libglitch_rand(libglitch_rand_t *r, float max) {
+  if (!r->init) {
+    libglitch_rand_init(r, libglitch_rand_seed, 0);
+  }
+  if (r->n == 0) {
+    libglitch_rand_fill(r, r->block, LIBGLITCH_RAND_BLOCK);
+    r->n = LIBGLITCH_RAND_BLOCK;
+  }
+  return r->block[LIBGLITCH_RAND_BLOCK - r->n--] * max;
 }
 
 #ifdef LIBGLITCH_TEST
 static inline void libglitch_rand_test() {
+  libglitch_rand_t r = {0};
+  libglitch_rand_t r2 = {0};
   // Two random numbers are unlikely to be equal
-  libglitch_assert(libglitch_rand(10000) != libglitch_rand(10000));
+  libglitch_assert(libglitch_rand(&r, 10000) != libglitch_rand(&r, 10000));
   // Random with zero range should return zero
-  libglitch_assert(libglitch_rand(0) == 0);
+  libglitch_assert(libglitch_rand(&r, 0) == 0);
   // If any of the parameters is NAN - libglitch_rand() returns NAN
-  libglitch_assert(isnan(libglitch_rand(NAN)));
+  libglitch_assert(isnan(libglitch_rand(&r, NAN)));
   // Random numbers should always be within the [min, max] range
   for (int i = 0; i < 100000; i++) {
-    libglitch_assert(libglitch_rand(1) >= 0 && libglitch_rand(1) <= 1);
+    libglitch_assert(libglitch_rand(&r, 1) >= 0 && libglitch_rand(&r, 1) < 1);
   }
-
-  libglitch_bench("rand()", N) { y = libglitch_rand(x); }
+  // Same seed and stream give the same numbers, other streams differ
+  libglitch_rand_init(&r, 42, 1);
+  libglitch_rand_init(&r2, 42, 1);
+  for (int i = 0; i < 1000; i++) {
+    libglitch_assert(libglitch_rand(&r, 1) == libglitch_rand(&r2, 1));
+  }
+  libglitch_rand_init(&r2, 42, 2);
+  libglitch_assert(libglitch_rand(&r, 1) != libglitch_rand(&r2, 1));
+  // Known xoshiro128+ outputs of state {1, 2, 3, 4} in all lanes: 5, 12295,
+  // 25178119, numbers are taken lane by lane and keep the top 24 bits
+  for (int i = 0; i < 16; i++) {
+    r.s[i] = i / 4 + 1;
+  }
+  r.n = 0;
+  float v[12];
+  for (int i = 0; i < 12; i++) {
+    v[i] = libglitch_rand(&r, 16777216);
+  }
+  libglitch_assert(v[0] == 0 && v[3] == 0);
+  libglitch_assert(v[4] == 48 && v[7] == 48);
+  libglitch_assert(v[8] == 98352 && v[11] == 98352);
 }
 #endif
 
@@ -109,8 +249,6 @@ static void libglitch_byte_test() {
   libglitch_assert(libglitch_byte(-129) == 0);
 
   libglitch_assert(isnan(libglitch_byte(NAN)));
-
-  libglitch_bench("byte()", N) { y = libglitch_byte(x); }
 }
 #endif
 
@@ -161,8 +299,6 @@ static void libglitch_hz_test() {
   libglitch_assert(libglitch_hz(3.2) > libglitch_hz(3));
   libglitch_assert(libglitch_hz(3.2) < libglitch_hz(4));
   libglitch_assert(isnan(libglitch_hz(NAN)));
-
-  libglitch_bench("hz()", N) { y = libglitch_hz(x); }
 }
 #endif
 
@@ -218,17 +354,6 @@ static float libglitch_sqr(libglitch_osc_t *osc, float freq, float pwm) {
   return (w < pwm ? 1 : -1);
 }
 
-#ifdef LIBGLITCH_TEST
-static void libglitch_osc_test() {
-  libglitch_osc_t osc = {0};
-  x = 440;
-  libglitch_bench("sin()", N) { y = libglitch_sin(&osc, x); }
-  libglitch_bench("tri()", N) { y = libglitch_saw(&osc, x); }
-  libglitch_bench("saw()", N) { y = libglitch_tri(&osc, x); }
-  libglitch_bench("sqr()", N) { y = libglitch_sqr(&osc, x, 0.5); }
-}
-#endif
-
 // ==================================
 // lpf, hpf, bpf, bsf: biquad filters
 // ==================================
@@ -309,20 +434,10 @@ static inline float libglitch_biquad(libglitch_biquad_t *filter,
   filter->x2 = filter->x1;
   filter->x1 = input;
   filter->y2 = filter->y1;
-  filter->y1 = out;
+  filter->y1 = libglitch_flush(out);
   return out;
 }
 
-#ifdef LIBGLITCH_TEST
-static void libglitch_biquad_test() {
-  libglitch_biquad_t filter = {0.f, 0.f, 0.f, 0.f};
-  x = 42;
-  libglitch_bench("lpf()", N) {
-    x = libglitch_biquad(&filter, LIBGLITCH_FILTER_LPF, x, x, x);
-  }
-}
-#endif
-
 // ============================
 // env: attack-release envelope
 // ============================
@@ -382,23 +497,16 @@ static float libglitch_env(libglitch_env_t *env, float g, float v, float at,
     r = 1 - env->rval;
   }
 
-  env->t++;
+  /* Envelope stays at the end of release until the next gate */
+  if (env->t < env->at + env->rt) {
+    env->t++;
+  }
   if (isnan(g)) {
     env->t = 0;
     r = NAN;
   }
   return r * v;
 }
-#ifdef LIBGLITCH_TEST
-static void libglitch_env_test() {
-  libglitch_env_t env = {0};
-  x = 42;
-  libglitch_bench("env()", N) {
-    x = libglitch_env(&env, x, x, 0.01, 0.5, 0.2, 0.6);
-  }
-}
-#endif
-
 // ======================================
 // delay: simple delay line with feedback
 // ======================================
@@ -452,31 +560,23 @@ static float libglitch_delay(libglitch_delay_t *delay, float signal, float time,
 
   /* Write updated value to the buffer */
   signal = (isnan(signal) ? 0 : signal);
-  delay->buf[delay->pos] = delay->buf[delay->pos] * feedback + signal;
+  delay->buf[delay->pos] =
+      libglitch_flush(delay->buf[delay->pos] * feedback + signal);
   delay->pos = (delay->pos + 1) % delay->n;
   return signal + out;
 }
 
 static void libglitch_delay_free(libglitch_delay_t *delay) { free(delay->buf); }
 
-#ifdef LIBGLITCH_TEST
-static void libglitch_delay_test() {
-  libglitch_delay_t delay = {0};
-  x = 42;
-  libglitch_bench("delay()", N) {
-    x = libglitch_delay(&delay, x, 0.25, 0.5, 0.2);
-  }
-  libglitch_delay_free(&delay);
-}
-#endif
-
 // ===============================
 // pluck: Karplus-Strong algorithm
 // ===============================
 typedef struct libglitch_pluck {
   int init; /* FIXME: can we use sample != NULL instead? */
   int t;
+  int n; // Length of sample
   float *sample;
+  libglitch_rand_t rng; // Excitation noise
 } libglitch_pluck_t;
 
 static float libglitch_pluck(libglitch_pluck_t *pluck, float freq, float decay,
@@ -498,20 +598,28 @@ static float libglitch_pluck(libglitch_pluck_t *pluck, float freq, float decay,
 
   if (pluck->init == 0) {
     pluck->sample = (float *)realloc(pluck->sample, sizeof(float) * n);
-    for (int i = 0; i < n; i++) {
-      if (fill != NULL) {
+    if (fill != NULL) {
+      for (int i = 0; i < n; i++) {
 	pluck->sample[i] = fill(context);
-      } else {
-	pluck->sample[i] = (rand() * 2.0f / RAND_MAX) - 1.0f;
+      }
+    } else {
+      // White noise excitation
+      if (!pluck->rng.init) {
+	libglitch_rand_init(&pluck->rng, libglitch_rand_seed, 0);
+      }
+      libglitch_rand_fill(&pluck->rng, pluck->sample, n);
+      for (int i = 0; i < n; i++) {
+	pluck->sample[i] = pluck->sample[i] * 2.0f - 1.0f;
       }
     }
     pluck->init = 1;
     pluck->t = 0;
+    pluck->n = n;
   }
   float x = pluck->sample[pluck->t % n];
   float y = pluck->sample[(pluck->t + 1) % n];
   pluck->t = (pluck->t + 1) % n;
-  pluck->sample[pluck->t] = x * decay + y * (1 - decay);
+  pluck->sample[pluck->t] = libglitch_flush(x * decay + y * (1 - decay));
   return x;
 }
 
@@ -519,14 +627,159 @@ static void libglitch_pluck_free(libglitch_pluck_t *pluck) {
   free(pluck->sample);
 }
 
+// =========================================
+// Sample format conversion with TPDF dither
+// =========================================
+//
+// Dither noise comes from four interleaved xorshift32 generators, so that the
+// SSE2 path produces the same values as the scalar one.
+static inline void libglitch_dither_init(uint32_t state[4], uint32_t seed) {
+  for (int i = 0; i < 4; i++) {
+    seed = seed * 1664525u + 1013904223u;
+    state[i] = seed | 1;
+  }
+}
+
+static inline float libglitch_dither_uniform(uint32_t *x) {
+  union {
+    uint32_t i;
+    float f;
+  } u;
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  u.i = (*x >> 9) | 0x3f800000u;
+  return u.f - 1.f;
+}
+
+// Converts n floats to integers in the [lo..hi] range, scaled by the given
+// factor, NaN to zero. If state is not NULL, triangular dither of 1 LSB is
+// added.
+static void libglitch_quantize(int32_t *out, const float *in, size_t n,
+			       float scale, float lo, float hi,
+			       uint32_t state[4]) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  __m128 vscale = _mm_set1_ps(scale);
+  __m128 vlo = _mm_set1_ps(lo);
+  __m128 vhi = _mm_set1_ps(hi);
+  __m128i s = _mm_setzero_si128();
+  __m128i mant = _mm_set1_epi32(0x3f800000);
+  if (state != NULL) {
+    s = _mm_loadu_si128((__m128i *)state);
+  }
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(in + i), vscale);
+    if (state != NULL) {
+      __m128 r[2];
+      for (int k = 0; k < 2; k++) {
+	s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+	s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+	s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+	r[k] = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(s, 9), mant));
+      }
+      x = _mm_add_ps(x, _mm_sub_ps(r[0], r[1]));
+    }
+    x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+    x = _mm_min_ps(_mm_max_ps(x, vlo), vhi);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_cvtps_epi32(x));
+  }
+  if (state != NULL) {
+    _mm_storeu_si128((__m128i *)state, s);
+  }
+#endif
+  for (; i < n; i++) {
+    float x = in[i] * scale;
+    if (state != NULL) {
+      uint32_t *lane = &state[i % 4];
+      float r0 = libglitch_dither_uniform(lane);
+      float r1 = libglitch_dither_uniform(lane);
+      x = x + (r0 - r1);
+    }
+    if (isnan(x)) {
+      x = 0;
+    } else if (x < lo) {
+      x = lo;
+    } else if (x > hi) {
+      x = hi;
+    }
+    out[i] = (int32_t)lrintf(x);
+  }
+}
+
+static void libglitch_to_s16(int16_t *out, const float *in, size_t n,
+			     uint32_t state[4]) {
+  int32_t tmp[256];
+  while (n > 0) {
+    size_t len = (n < 256 ? n : 256);
+    libglitch_quantize(tmp, in, len, 32767.f, -32768.f, 32767.f, state);
+    for (size_t i = 0; i < len; i++) {
+      out[i] = (int16_t)tmp[i];
+    }
+    in = in + len;
+    out = out + len;
+    n = n - len;
+  }
+}
+
+// Packed little-endian 24-bit samples, 3 bytes each
+static void libglitch_to_s24(unsigned char *out, const float *in, size_t n,
+			     uint32_t state[4]) {
+  int32_t tmp[256];
+  while (n > 0) {
+    size_t len = (n < 256 ? n : 256);
+    libglitch_quantize(tmp, in, len, 8388607.f, -8388608.f, 8388607.f, state);
+    for (size_t i = 0; i < len; i++) {
+      *out++ = (unsigned char)(tmp[i] & 0xff);
+      *out++ = (unsigned char)((tmp[i] >> 8) & 0xff);
+      *out++ = (unsigned char)((tmp[i] >> 16) & 0xff);
+    }
+    in = in + len;
+    n = n - len;
+  }
+}
+
+// 32-bit samples are not dithered, float precision is well below 1 LSB
+static void libglitch_to_s32(int32_t *out, const float *in, size_t n) {
+  libglitch_quantize(out, in, n, 2147483648.f, -2147483648.f, 2147483520.f,
+		     NULL);
+}
+
 #ifdef LIBGLITCH_TEST
-static void libglitch_pluck_test() {
-  libglitch_pluck_t pluck = {0};
-  x = 42;
-  libglitch_bench("pluck()", N) {
-    x = libglitch_pluck(&pluck, 0.25, 0.5, NULL, NULL);
+static void libglitch_convert_test() {
+  uint32_t state[4];
+  float in[7] = {0, 0.5f, -0.5f, 1, -1, 2, -2};
+  int16_t s16[7];
+  unsigned char s24[7 * 3];
+  int32_t s32[7];
+  libglitch_dither_init(state, 0);
+
+  // Dither adds at most 1 LSB of noise, values are clipped
+  libglitch_to_s16(s16, in, 7, state);
+  libglitch_assert(s16[0] >= -1 && s16[0] <= 1);
+  libglitch_assert(s16[1] >= 16383 && s16[1] <= 16385);
+  libglitch_assert(s16[2] >= -16385 && s16[2] <= -16383);
+  libglitch_assert(s16[3] >= 32766 && s16[4] <= -32767);
+  libglitch_assert(s16[5] == 32767 && s16[6] == -32768);
+
+  libglitch_to_s24(s24, in, 7, state);
+  libglitch_assert(s24[15] == 0xff && s24[16] == 0xff && s24[17] == 0x7f);
+  libglitch_assert(s24[18] == 0 && s24[19] == 0 && s24[20] == 0x80);
+
+  libglitch_to_s32(s32, in, 7);
+  libglitch_assert(s32[0] == 0 && s32[1] == 1073741824);
+  libglitch_assert(s32[4] == -2147483647 - 1 && s32[5] == 2147483520);
+
+  // NaN is silence, in vector and scalar lanes alike
+  float nan[5] = {NAN, NAN, NAN, NAN, NAN};
+  libglitch_to_s16(s16, nan, 5, state);
+  libglitch_to_s24(s24, nan, 5, state);
+  libglitch_to_s32(s32, nan, 5);
+  for (int i = 0; i < 5; i++) {
+    libglitch_assert(s16[i] == 0 && s32[i] == 0);
+    libglitch_assert(s24[i * 3] == 0 && s24[i * 3 + 1] == 0 &&
+		     s24[i * 3 + 2] == 0);
   }
-  libglitch_pluck_free(&pluck);
 }
 #endif
 
@@ -534,9 +787,9 @@ static void libglitch_pluck_test() {
 // libglitch initialization
 // ========================
 static void libglitch_init(int sample_rate, unsigned long long seed) {
-  libglitch_sample_rate = sample_rate;
+  libglitch_default_sample_rate = libglitch_sample_rate = sample_rate;
 
-  libglitch_rand_init(seed);
+  libglitch_rand_seed = seed;
   libglitch_byte_init();
   libglitch_hz_init();
   libglitch_osc_init();
@@ -547,11 +800,7 @@ static void libglitch_test() {
   libglitch_rand_test();
   libglitch_byte_test();
   libglitch_hz_test();
-  libglitch_osc_test();
-  libglitch_biquad_test();
-  libglitch_env_test();
-  libglitch_delay_test();
-  libglitch_pluck_test();
+  libglitch_convert_test();
 }
 #endif /* LIBGLITCH_TEST */
 
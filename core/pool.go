@@ -0,0 +1,113 @@
+package core
+
+import (
+	"runtime"
+	"sync"
+)
+
+// Task is one buffer to be rendered by an instance
+type Task struct {
+	Glitch   Glitch
+	Buf      []float32
+	Frames   int
+	Channels int
+}
+
+// Pool renders buffers of many instances concurrently. Each worker runs on its
+// own locked OS thread. A task is queued to the worker given by its index in
+// the batch, so an instance passed at the same index stays on the same thread
+// from buffer to buffer, while idle workers steal tasks from busy ones.
+type Pool struct {
+	workers []*worker
+	wg      sync.WaitGroup
+}
+
+type worker struct {
+	sync.Mutex
+	tasks []*Task
+	start chan struct{}
+}
+
+func NewPool(n int) *Pool {
+	if n < 1 {
+		n = runtime.NumCPU()
+	}
+	p := &Pool{}
+	for i := 0; i < n; i++ {
+		w := &worker{start: make(chan struct{})}
+		p.workers = append(p.workers, w)
+	}
+	for i, w := range p.workers {
+		go p.run(i, w)
+	}
+	return p
+}
+
+// Fill renders all tasks and returns when they are done
+func (p *Pool) Fill(tasks []Task) {
+	for i := range tasks {
+		w := p.workers[i%len(p.workers)]
+		w.tasks = append(w.tasks, &tasks[i])
+	}
+	p.wg.Add(len(p.workers))
+	for _, w := range p.workers {
+		w.start <- struct{}{}
+	}
+	p.wg.Wait()
+}
+
+// Close stops the workers, the pool can not be used after that
+func (p *Pool) Close() {
+	for _, w := range p.workers {
+		close(w.start)
+	}
+}
+
+func (p *Pool) run(id int, w *worker) {
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	for range w.start {
+		for {
+			t := w.pop()
+			if t == nil {
+				t = p.steal(id)
+			}
+			if t == nil {
+				break
+			}
+			t.Glitch.Fill(t.Buf, t.Frames, t.Channels)
+		}
+		p.wg.Done()
+	}
+}
+
+// pop takes the next task from the front of the own queue
+func (w *worker) pop() *Task {
+	w.Lock()
+	defer w.Unlock()
+	if len(w.tasks) == 0 {
+		return nil
+	}
+	t := w.tasks[0]
+	w.tasks = w.tasks[1:]
+	if len(w.tasks) == 0 {
+		w.tasks = nil
+	}
+	return t
+}
+
+// steal takes a task from the back of the queue of another worker
+func (p *Pool) steal(id int) *Task {
+	for i := 1; i < len(p.workers); i++ {
+		w := p.workers[(id+i)%len(p.workers)]
+		w.Lock()
+		if n := len(w.tasks); n > 0 {
+			t := w.tasks[n-1]
+			w.tasks = w.tasks[:n-1]
+			w.Unlock()
+			return t
+		}
+		w.Unlock()
+	}
+	return nil
+}
@@ -0,0 +1,129 @@
+package core
+
+/*
+#include <stdio.h>
+#include <stdlib.h>
+#include "glitch.h"
+*/
+import "C"
+import (
+	"errors"
+	"runtime/debug"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+var traceGC struct {
+	sync.Mutex
+	quit chan struct{}
+}
+
+// TraceStart starts recording engine activity and garbage collector pauses
+// into per-thread rings, that are written by TraceDump in the Chrome trace
+// format, for chrome://tracing or ui.perfetto.dev
+func TraceStart() {
+	C.glitch_trace_start()
+	traceGC.Lock()
+	defer traceGC.Unlock()
+	if traceGC.quit == nil {
+		traceGC.quit = make(chan struct{})
+		go traceGCPauses(traceGC.quit)
+	}
+}
+
+// TraceStop stops recording, events recorded so far are kept
+func TraceStop() {
+	C.glitch_trace_stop()
+	traceGC.Lock()
+	defer traceGC.Unlock()
+	if traceGC.quit != nil {
+		close(traceGC.quit)
+		traceGC.quit = nil
+	}
+}
+
+// TraceThread names the calling OS thread in the trace
+func TraceThread(name string) {
+	s := C.CString(name)
+	C.glitch_trace_thread(s)
+	C.free(unsafe.Pointer(s))
+}
+
+// TraceBegin and TraceEnd record a span of the calling OS thread, so both must
+// be called from the same locked goroutine
+func TraceBegin(name string) {
+	s := C.CString(name)
+	C.glitch_trace_begin(s)
+	C.free(unsafe.Pointer(s))
+}
+
+func TraceEnd(name string) {
+	s := C.CString(name)
+	C.glitch_trace_end(s)
+	C.free(unsafe.Pointer(s))
+}
+
+// TraceSpan records a span that ends when the returned function is called,
+// unlike TraceBegin it may be used from any goroutine
+func TraceSpan(name string) func() {
+	start := C.glitch_trace_now()
+	return func() {
+		s := C.CString(name)
+		C.glitch_trace_complete(s, start, C.glitch_trace_now()-start)
+		C.free(unsafe.Pointer(s))
+	}
+}
+
+// TraceInstant records an event with an argument, e.g. a count
+func TraceInstant(name string, arg int) {
+	s := C.CString(name)
+	C.glitch_trace_instant(s, C.long(arg))
+	C.free(unsafe.Pointer(s))
+}
+
+// TraceDump writes the latest events of all threads to a file
+func TraceDump(path string) error {
+	p := C.CString(path)
+	defer C.free(unsafe.Pointer(p))
+	mode := C.CString("w")
+	defer C.free(unsafe.Pointer(mode))
+	f, err := C.fopen(p, mode)
+	if f == nil {
+		return err
+	}
+	C.glitch_trace_dump(f)
+	if C.fclose(f) != 0 {
+		return errors.New("glitch: can not write trace")
+	}
+	return nil
+}
+
+// traceGCPauses polls the collector statistics and records pauses since the
+// last poll as complete events on the clock of the trace
+func traceGCPauses(quit chan struct{}) {
+	stats := &debug.GCStats{}
+	debug.ReadGCStats(stats)
+	last := stats.NumGC
+	for {
+		select {
+		case <-quit:
+			return
+		case <-time.After(100 * time.Millisecond):
+		}
+		debug.ReadGCStats(stats)
+		now, us := time.Now(), float64(C.glitch_trace_now())
+		n := int(stats.NumGC - last)
+		if n > len(stats.Pause) {
+			n = len(stats.Pause)
+		}
+		last = stats.NumGC
+		name := C.CString("gc")
+		for i := n - 1; i >= 0; i-- {
+			pause := stats.Pause[i]
+			start := us - float64(now.Sub(stats.PauseEnd[i])+pause)/1e3
+			C.glitch_trace_complete(name, C.double(start), C.double(float64(pause)/1e3))
+		}
+		C.free(unsafe.Pointer(name))
+	}
+}
@@ -1,4 +1,5 @@
-package main
+// Package loader provides glitch sample data read from a directory
+package loader
 
 import (
 	"io/ioutil"
@@ -10,26 +11,36 @@ import (
 	"github.com/naivesound/glitch/core"
 )
 
-type sampleLoader struct {
+// Samples are read from subdirectories of Dir, each subdirectory is a sample
+// and WAV files inside it are its variants.
+type Samples struct {
+	Dir     string
 	samples map[string][][]float32
 }
 
-func (loader *sampleLoader) dir() string {
-	return "samples"
+func New(dir string) *Samples {
+	return &Samples{Dir: dir}
 }
 
-func (loader *sampleLoader) poll() {
+func (loader *Samples) dir() string {
+	return loader.Dir
+}
+
+// Poll reads all samples and registers them in the engine
+func (loader *Samples) Poll() {
 	loader.samples = map[string][][]float32{}
 	for sample, variants := range loader.scan() {
 		loader.samples[sample] = make([][]float32, len(variants), len(variants))
+		end := core.TraceSpan("load")
 		for i, variant := range variants {
 			loader.samples[sample][i] = loader.read(variant)
 		}
+		end()
 		core.AddSample(sample)
 	}
 }
 
-func (loader *sampleLoader) read(name string) []float32 {
+func (loader *Samples) read(name string) []float32 {
 	b, err := ioutil.ReadFile(name)
 	if err != nil {
 		return nil
@@ -43,7 +54,7 @@ func (loader *sampleLoader) read(name string) []float32 {
 	return f
 }
 
-func (loader *sampleLoader) scan() (samples map[string][]string) {
+func (loader *Samples) scan() (samples map[string][]string) {
 	samples = map[string][]string{}
 	files, err := ioutil.ReadDir(loader.dir())
 	if err != nil {
@@ -70,7 +81,7 @@ func (loader *sampleLoader) scan() (samples map[string][]string) {
 	return samples
 }
 
-func (loader *sampleLoader) LoadSample(name string, variant, frame int) float32 {
+func (loader *Samples) LoadSample(name string, variant, frame int) float32 {
 	samples, ok := loader.samples[name]
 	if !ok {
 		return float32(math.NaN())
@@ -239,12 +239,28 @@ function toolbar(app) {
                class: 'toolbar__btn desktop-only',
                onclick: function() { app.modal('settings'); },
              }, icons.settings)),
+             loadMeter(app),
              h('li', null, h('div', {
                class: 'toolbar__btn',
                onclick: function() { window.open('https://github.com/naivesound/glitch/blob/master/API.md'); },
              }, icons.help))));
 }
 
+// DSP load of the last second and its peak, red when close to real time
+function loadMeter(app) {
+  var load = app.data.load;
+  if (!load) {
+    return h('li', null);
+  }
+  var pct = function(x) { return Math.round(x * 100) + '%'; };
+  var xruns = load.underruns + load.overruns;
+  return h('li', {class: 'desktop-only'},
+           h('div', {
+             class: 'toolbar__meter' + (load.peak > 0.8 || xruns > 0 ? ' toolbar__meter--warn' : ''),
+             title: 'DSP load, peak load and xruns since stop',
+           }, 'DSP ' + pct(load.average) + ' / ' + pct(load.peak) + (xruns > 0 ? ' ' + xruns + ' XRUN' : '')));
+}
+
 function materialIcon(icon) {
   return h('i', {class: 'material-icons', style:{display: 'inline', fontSize: '32px', lineHeight: '64px'}}, icon);
 }
@@ -423,6 +439,9 @@ function init() {
     } else if (e.keyCode === 13 && e.ctrlKey) {  // Ctrl+Enter
       e.preventDefault();
       app.togglePlayback();
+    } else if (e.keyCode === 84 && e.ctrlKey) {  // Ctrl+T
+      e.preventDefault();
+      app.dumpTrace();
     }
   };
 